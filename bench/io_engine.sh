@@ -0,0 +1,52 @@
+#!/bin/bash
+# Compares the blocking and io_uring I/O engines on a generated jobs directory.
+# Usage: bench/io_engine.sh [num_jobs] [lines_per_job] [max_threads]
+# The server runs in watch mode so the end of every job is visible through its
+# .done marker.
+
+NUM_JOBS=${1:-64}
+LINES=${2:-20000}
+THREADS=${3:-4}
+SERVER=${SERVER:-./src/server/kvs}
+
+if [ ! -x "$SERVER" ]; then
+  echo "Build the server first (make)" >&2
+  exit 1
+fi
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# Every job writes, reads and deletes a few hundred keys
+for ((j = 0; j < NUM_JOBS; j++)); do
+  awk -v lines="$LINES" -v seed="$j" 'BEGIN {
+    srand(seed);
+    for (i = 0; i < lines; i++) {
+      k = "k" int(rand() * 500);
+      r = rand();
+      if (r < 0.5) printf("WRITE [(%s,v%d)(a%s,w%d)]\n", k, i, k, i);
+      else if (r < 0.95) printf("READ [%s,a%s,zz]\n", k, k);
+      else printf("DELETE [%s]\n", k);
+    }
+  }' > "$WORKDIR/job$j.job"
+done
+
+echo "engine,jobs,lines_per_job,threads,seconds"
+for engine in sync uring; do
+  rm -f "$WORKDIR"/*.out "$WORKDIR"/*.done
+  start=$(date +%s.%N)
+  "$SERVER" -w -i "$engine" "$WORKDIR" "$THREADS" 1 "bench_io_$$" > /dev/null &
+  pid=$!
+  while [ "$(find "$WORKDIR" -name '*.done' | wc -l)" -lt "$NUM_JOBS" ]; do
+    if ! kill -0 "$pid" 2> /dev/null; then
+      echo "Server exited before finishing the jobs" >&2
+      exit 1
+    fi
+    sleep 0.01
+  done
+  end=$(date +%s.%N)
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+  echo "$engine,$NUM_JOBS,$LINES,$THREADS,$(awk -v s="$start" -v e="$end" 'BEGIN { printf("%.3f", e - s) }')"
+done
+rm -f "/tmp/bench_io_$$"
@@ -0,0 +1,214 @@
+// Generates a directory of .job files with a synthetic workload. The same
+// options and seed always give the same files.
+// Usage: bench/jobgen [options] <dir>
+//   -j jobs        job files (default 8)
+//   -n lines       commands per job (default 10000)
+//   -k keys        distinct keys (default 10000)
+//   -K min[:max]   key length, uniform between the bounds (default 8:16)
+//   -V min[:max]   value length, uniform between the bounds (default 16:64)
+//   -m r:w:d       weights of READ, WRITE and DELETE (default 80:15:5)
+//   -b batch       keys per command (default 1)
+//   -z skew        Zipf exponent of the key popularity, 0 for uniform (default 0.99)
+//   -B every       a BACKUP every this many commands, 0 for none (default 0)
+//   -s seed        (default 1)
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_KEY_LEN 39  // MAX_STRING_SIZE of the server, minus the terminator
+#define MAX_BATCH 256   // MAX_WRITE_SIZE of the server
+
+typedef struct Options {
+  unsigned long jobs;
+  unsigned long lines;
+  unsigned long keys;
+  unsigned long key_min, key_max;
+  unsigned long value_min, value_max;
+  unsigned long reads, writes, deletes;
+  unsigned long batch;
+  double skew;
+  unsigned long backup_every;
+  unsigned long seed;
+} Options;
+
+// xorshift64*, so the files do not depend on the C library.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static double next_unit(uint64_t *state) {
+  return (double)(next_random(state) >> 11) / 9007199254740992.0;  // [0, 1)
+}
+
+static unsigned long next_between(uint64_t *state, unsigned long min, unsigned long max) {
+  return min + (unsigned long)(next_random(state) % (max - min + 1));
+}
+
+// Cumulative probabilities of the keys by rank, so that a key is drawn with
+// a binary search.
+static double *zipf_cdf(unsigned long keys, double skew) {
+  double *cdf = malloc(keys * sizeof(double));
+  if (cdf == NULL) {
+    return NULL;
+  }
+  double sum = 0;
+  for (unsigned long i = 0; i < keys; i++) {
+    sum += 1.0 / pow((double)(i + 1), skew);
+    cdf[i] = sum;
+  }
+  for (unsigned long i = 0; i < keys; i++) {
+    cdf[i] /= sum;
+  }
+  return cdf;
+}
+
+static unsigned long draw_key(const double *cdf, unsigned long keys, uint64_t *state) {
+  double u = next_unit(state);
+  unsigned long low = 0, high = keys - 1;
+  while (low < high) {
+    unsigned long mid = (low + high) / 2;
+    if (cdf[mid] < u) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Writes the name of a key: its rank, padded to a length of its own.
+static void put_key(FILE *out, const Options *opts, unsigned long rank) {
+  uint64_t state = (rank + 1) * 0x9E3779B97F4A7C15ULL;
+  unsigned long len = next_between(&state, opts->key_min, opts->key_max);
+  char key[MAX_KEY_LEN + 1];
+  int written = snprintf(key, sizeof(key), "k%lu", rank);
+  while ((unsigned long)written < len) {
+    key[written++] = (char)('a' + next_random(&state) % 26);
+  }
+  key[written] = '\0';
+  fputs(key, out);
+}
+
+static void put_value(FILE *out, const Options *opts, uint64_t *state) {
+  unsigned long len = next_between(state, opts->value_min, opts->value_max);
+  for (unsigned long i = 0; i < len; i++) {
+    fputc('a' + (int)(next_random(state) % 26), out);
+  }
+}
+
+static int write_job(const char *path, const Options *opts, const double *cdf, uint64_t *state) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to create %s\n", path);
+    return 1;
+  }
+  unsigned long total = opts->reads + opts->writes + opts->deletes;
+  for (unsigned long line = 1; line <= opts->lines; line++) {
+    if (opts->backup_every != 0 && line % opts->backup_every == 0) {
+      fputs("BACKUP\n", out);
+      continue;
+    }
+    unsigned long pick = (unsigned long)(next_random(state) % total);
+    int is_write = pick >= opts->reads && pick < opts->reads + opts->writes;
+    fputs(pick < opts->reads ? "READ [" : is_write ? "WRITE [" : "DELETE [", out);
+    for (unsigned long i = 0; i < opts->batch; i++) {
+      unsigned long rank = draw_key(cdf, opts->keys, state);
+      if (is_write) {
+        fputc('(', out);
+        put_key(out, opts, rank);
+        fputc(',', out);
+        put_value(out, opts, state);
+        fputc(')', out);
+      } else {
+        if (i > 0) {
+          fputc(',', out);
+        }
+        put_key(out, opts, rank);
+      }
+    }
+    fputs("]\n", out);
+  }
+  return fclose(out) == 0 ? 0 : 1;
+}
+
+// Parses "min" or "min:max".
+static int parse_bounds(const char *arg, unsigned long *min, unsigned long *max) {
+  char *end;
+  *min = strtoul(arg, &end, 10);
+  *max = *min;
+  if (*end == ':') {
+    *max = strtoul(end + 1, &end, 10);
+  }
+  return *end != '\0' || *min > *max;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-j jobs] [-n lines] [-k keys] [-K min:max] [-V min:max] [-m r:w:d]\n"
+          "       [-b batch] [-z skew] [-B every] [-s seed] <dir>\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  Options opts = {8, 10000, 10000, 8, 16, 16, 64, 80, 15, 5, 1, 0.99, 0, 1};
+  int opt;
+  int bad = 0;
+  while ((opt = getopt(argc, argv, "j:n:k:K:V:m:b:z:B:s:")) != -1) {
+    switch (opt) {
+      case 'j': opts.jobs = strtoul(optarg, NULL, 10); break;
+      case 'n': opts.lines = strtoul(optarg, NULL, 10); break;
+      case 'k': opts.keys = strtoul(optarg, NULL, 10); break;
+      case 'K': bad |= parse_bounds(optarg, &opts.key_min, &opts.key_max); break;
+      case 'V': bad |= parse_bounds(optarg, &opts.value_min, &opts.value_max); break;
+      case 'm':
+        bad |= sscanf(optarg, "%lu:%lu:%lu", &opts.reads, &opts.writes, &opts.deletes) != 3;
+        break;
+      case 'b': opts.batch = strtoul(optarg, NULL, 10); break;
+      case 'z': opts.skew = strtod(optarg, NULL); break;
+      case 'B': opts.backup_every = strtoul(optarg, NULL, 10); break;
+      case 's': opts.seed = strtoul(optarg, NULL, 10); break;
+      default: bad = 1;
+    }
+  }
+  // Keys are "k<rank>" at least, so they must fit the longest rank
+  char longest[32];
+  unsigned long min_key_len = opts.keys == 0 ? 0 : (unsigned long)snprintf(longest, sizeof(longest), "k%lu", opts.keys - 1);
+  if (bad || optind != argc - 1 || opts.jobs == 0 || opts.keys == 0 || opts.batch == 0 ||
+      opts.batch > MAX_BATCH || opts.key_max > MAX_KEY_LEN || opts.key_min < min_key_len ||
+      opts.value_min == 0 || opts.reads + opts.writes + opts.deletes == 0 || opts.skew < 0) {
+    if (!bad && opts.key_min < min_key_len) {
+      fprintf(stderr, "Keys need at least %lu characters\n", min_key_len);
+    }
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *dir = argv[optind];
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s\n", dir);
+    return 1;
+  }
+  double *cdf = zipf_cdf(opts.keys, opts.skew);
+  if (cdf == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  uint64_t state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+  int failed = 0;
+  char path[4096];
+  for (unsigned long j = 0; j < opts.jobs && !failed; j++) {
+    snprintf(path, sizeof(path), "%s/bench%03lu.job", dir, j);
+    failed = write_job(path, &opts, cdf, &state);
+  }
+  free(cdf);
+  return failed;
+}
@@ -0,0 +1,178 @@
+// Compares the lock-free queue of src/server/mpmc.h with the ring that the
+// session hand-off used before it: a mutex and two semaphores counting the
+// free and the filled slots.
+// Usage: bench/mpmc [producers] [consumers] [items_per_producer] [capacity]
+// Every item is checked to be taken exactly once, so a small capacity also
+// works as a stress run of the full and empty waits.
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/server/mpmc.h"
+
+#define MAX_THREADS 64
+
+typedef struct SemRing {
+  void **items;
+  size_t cap;
+  size_t prodptr;
+  size_t consptr;
+  sem_t free_slots;
+  sem_t filled_slots;
+  pthread_mutex_t lock;
+} SemRing;
+
+typedef struct Queue {
+  const char *name;
+  void (*push)(void *queue, void *item);
+  void *(*pop)(void *queue);
+  void *queue;
+} Queue;
+
+static size_t items_per_producer;
+static size_t num_consumers;
+static unsigned char *taken;  // Times every item was taken
+static const Queue *current;
+
+static void sem_ring_push(void *queue, void *item) {
+  SemRing *ring = queue;
+  sem_wait(&ring->free_slots);
+  pthread_mutex_lock(&ring->lock);
+  ring->items[ring->prodptr] = item;
+  ring->prodptr = (ring->prodptr + 1) % ring->cap;
+  pthread_mutex_unlock(&ring->lock);
+  sem_post(&ring->filled_slots);
+}
+
+static void *sem_ring_pop(void *queue) {
+  SemRing *ring = queue;
+  sem_wait(&ring->filled_slots);
+  pthread_mutex_lock(&ring->lock);
+  void *item = ring->items[ring->consptr];
+  ring->consptr = (ring->consptr + 1) % ring->cap;
+  pthread_mutex_unlock(&ring->lock);
+  sem_post(&ring->free_slots);
+  return item;
+}
+
+static void mpmc_queue_push(void *queue, void *item) {
+  mpmc_push(queue, item);
+}
+
+static void *mpmc_queue_pop(void *queue) {
+  return mpmc_pop(queue);
+}
+
+// Items are their number plus one, so none is NULL; 0 tells a consumer to stop.
+static void *producer(void *arg) {
+  size_t first = (size_t)(uintptr_t)arg * items_per_producer;
+  for (size_t i = 0; i < items_per_producer; i++) {
+    current->push(current->queue, (void *)(uintptr_t)(first + i + 1));
+  }
+  return NULL;
+}
+
+static uintptr_t stop_item;
+
+static void *consumer(void *arg) {
+  (void)arg;
+  while (1) {
+    uintptr_t item = (uintptr_t)current->pop(current->queue);
+    if (item == stop_item) {
+      return NULL;
+    }
+    __atomic_add_fetch(&taken[item - 1], 1, __ATOMIC_RELAXED);
+  }
+}
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Runs a queue once and checks every item was taken exactly once.
+// @return 0 if successful, 1 otherwise.
+static int run(const Queue *queue, size_t num_producers, size_t cap) {
+  size_t total = num_producers * items_per_producer;
+  pthread_t producers[MAX_THREADS];
+  pthread_t consumers[MAX_THREADS];
+  memset(taken, 0, total);
+  current = queue;
+  stop_item = total + 1;
+
+  double start = now_seconds();
+  for (size_t i = 0; i < num_consumers; i++) {
+    pthread_create(&consumers[i], NULL, consumer, NULL);
+  }
+  for (size_t i = 0; i < num_producers; i++) {
+    pthread_create(&producers[i], NULL, producer, (void *)(uintptr_t)i);
+  }
+  for (size_t i = 0; i < num_producers; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  for (size_t i = 0; i < num_consumers; i++) {
+    queue->push(queue->queue, (void *)stop_item);
+  }
+  for (size_t i = 0; i < num_consumers; i++) {
+    pthread_join(consumers[i], NULL);
+  }
+  double seconds = now_seconds() - start;
+
+  for (size_t i = 0; i < total; i++) {
+    if (taken[i] != 1) {
+      fprintf(stderr, "%s: item %zu taken %u times\n", queue->name, i + 1, taken[i]);
+      return 1;
+    }
+  }
+  printf("%s,%zu,%zu,%zu,%zu,%.3f,%.2f\n", queue->name, num_producers, num_consumers,
+         items_per_producer, cap, seconds, (double)total / seconds / 1e6);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t num_producers = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+  num_consumers = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+  items_per_producer = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+  size_t cap = argc > 4 ? strtoul(argv[4], NULL, 10) : 1024;
+  if (num_producers == 0 || num_producers > MAX_THREADS || num_consumers == 0 ||
+      num_consumers > MAX_THREADS || items_per_producer == 0 || cap == 0) {
+    fprintf(stderr, "Usage: %s [producers] [consumers] [items_per_producer] [capacity]\n",
+            argv[0]);
+    return 1;
+  }
+
+  taken = malloc(num_producers * items_per_producer);
+  SemRing ring = {.cap = cap, .prodptr = 0, .consptr = 0};
+  ring.items = malloc(cap * sizeof(void *));
+  MpmcQueue mpmc;
+  if (taken == NULL || ring.items == NULL || mpmc_init(&mpmc, cap) != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  sem_init(&ring.free_slots, 0, (unsigned int)cap);
+  sem_init(&ring.filled_slots, 0, 0);
+  pthread_mutex_init(&ring.lock, NULL);
+
+  const Queue queues[] = {
+      {"semaphores", sem_ring_push, sem_ring_pop, &ring},
+      {"mpmc", mpmc_queue_push, mpmc_queue_pop, &mpmc},
+  };
+  int failed = 0;
+  printf("queue,producers,consumers,items_per_producer,capacity,seconds,mops\n");
+  for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+    failed |= run(&queues[i], num_producers, cap);
+  }
+
+  mpmc_destroy(&mpmc);
+  sem_destroy(&ring.free_slots);
+  sem_destroy(&ring.filled_slots);
+  pthread_mutex_destroy(&ring.lock);
+  free(ring.items);
+  free(taken);
+  return failed;
+}
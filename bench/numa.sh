@@ -0,0 +1,99 @@
+#!/bin/bash
+# Compares the server with and without NUMA placement (-p) on a generated jobs
+# directory, with the keyspace split in shards.
+# Usage: bench/numa.sh [num_jobs] [lines_per_job] [max_threads] [shards]
+# For every run it prints where the anonymous memory of the server ended up
+# (pages per node, from /proc/<pid>/numa_maps) and, when perf is installed,
+# the loads served by the local node and by remote ones (node-loads and
+# node-load-misses). On hosts with a single node both runs look alike.
+
+NUM_JOBS=${1:-32}
+LINES=${2:-20000}
+THREADS=${3:-4}
+SHARDS=${4:-4}
+SERVER=${SERVER:-./src/server/kvs}
+
+if [ ! -x "$SERVER" ]; then
+  echo "Build the server first (make)" >&2
+  exit 1
+fi
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# Every job writes, reads and deletes keys spread over all the shards, with
+# values long enough for the pairs to dominate the memory of the server
+for ((j = 0; j < NUM_JOBS; j++)); do
+  awk -v lines="$LINES" -v seed="$j" 'BEGIN {
+    srand(seed);
+    pad = sprintf("%200s", ""); gsub(/ /, "x", pad);
+    for (i = 0; i < lines; i++) {
+      k = "k" int(rand() * 20000);
+      r = rand();
+      if (r < 0.4) printf("WRITE [(%s,%s%d)]\n", k, pad, i);
+      else if (r < 0.95) printf("READ [%s,a%s]\n", k, k);
+      else printf("DELETE [%s]\n", k);
+    }
+  }' > "$WORKDIR/job$j.job"
+done
+
+# Sums the pages of the anonymous mappings of a process by node.
+pages_per_node() {
+  awk '/anon=|heap|stack/ {
+    for (i = 1; i <= NF; i++) {
+      if ($i ~ /^N[0-9]+=/) {
+        split($i, kv, "=");
+        pages[kv[1]] += kv[2];
+      }
+    }
+  }
+  END {
+    out = "";
+    for (n in pages) out = out (out == "" ? "" : " ") n "=" pages[n];
+    print out;
+  }' "/proc/$1/numa_maps" 2> /dev/null
+}
+
+HAS_PERF=0
+if command -v perf > /dev/null 2>&1; then
+  HAS_PERF=1
+fi
+
+echo "placement,jobs,lines_per_job,threads,shards,seconds,pages_per_node,node_loads,remote_loads"
+for placement in off on; do
+  flags=(-w -s "$SHARDS")
+  if [ "$placement" = on ]; then
+    flags+=(-p)
+  fi
+  rm -f "$WORKDIR"/*.out "$WORKDIR"/*.done "$WORKDIR/perf.txt"
+  start=$(date +%s.%N)
+  "$SERVER" "${flags[@]}" "$WORKDIR" "$THREADS" 1 "bench_numa_$$" > /dev/null &
+  pid=$!
+  perf_pid=
+  if [ "$HAS_PERF" = 1 ]; then
+    perf stat -x, -e node-loads,node-load-misses -p "$pid" -o "$WORKDIR/perf.txt" 2> /dev/null &
+    perf_pid=$!
+  fi
+  while [ "$(find "$WORKDIR" -name '*.done' | wc -l)" -lt "$NUM_JOBS" ]; do
+    if ! kill -0 "$pid" 2> /dev/null; then
+      echo "Server exited before finishing the jobs" >&2
+      exit 1
+    fi
+    sleep 0.01
+  done
+  end=$(date +%s.%N)
+  pages=$(pages_per_node "$pid")
+
+  loads=n/a
+  remote=n/a
+  if [ -n "$perf_pid" ]; then
+    kill -INT "$perf_pid" 2> /dev/null
+    wait "$perf_pid" 2> /dev/null
+    loads=$(awk -F, '$3 ~ /^node-loads/ { print $1 }' "$WORKDIR/perf.txt")
+    remote=$(awk -F, '$3 ~ /^node-load-misses/ { print $1 }' "$WORKDIR/perf.txt")
+  fi
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+  echo "$placement,$NUM_JOBS,$LINES,$THREADS,$SHARDS,$(awk -v s="$start" -v e="$end" 'BEGIN { printf("%.3f", e - s) }'),$pages,${loads:-n/a},${remote:-n/a}"
+done
+rm -f "/tmp/bench_numa_$$"
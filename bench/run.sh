@@ -0,0 +1,96 @@
+#!/bin/bash
+# Runs the server over jobs made by bench/jobgen for every pair of max_threads
+# and max_backups, and prints one CSV row per run.
+# Usage: bench/run.sh
+# Settings come from the environment:
+#   THREADS="1 2 4 8"  BACKUPS="1 4"  REPEAT=3
+#   JOBS=16 LINES=20000 KEYS=10000 KEY_SIZE=8:16 VALUE_SIZE=16:64
+#   MIX=80:15:5 BATCH=1 SKEW=0.99 BACKUP_EVERY=0 SEED=1
+# The jobs only depend on these settings, so rows of different builds with
+# the same settings compare. Latencies come from the stats FIFO of the server
+# (-S) and are in microseconds; peak_rss_kb is VmHWM of the server process
+# (backups run in children and are not counted).
+
+THREADS=${THREADS:-1 2 4 8}
+BACKUPS=${BACKUPS:-1 4}
+REPEAT=${REPEAT:-3}
+JOBS=${JOBS:-16}
+LINES=${LINES:-20000}
+KEYS=${KEYS:-10000}
+KEY_SIZE=${KEY_SIZE:-8:16}
+VALUE_SIZE=${VALUE_SIZE:-16:64}
+MIX=${MIX:-80:15:5}
+BATCH=${BATCH:-1}
+SKEW=${SKEW:-0.99}
+BACKUP_EVERY=${BACKUP_EVERY:-0}
+SEED=${SEED:-1}
+SERVER=${SERVER:-./src/server/kvs}
+JOBGEN=${JOBGEN:-./bench/jobgen}
+
+if [ ! -x "$SERVER" ] || [ ! -x "$JOBGEN" ]; then
+  echo "Build the server and the generator first (make src/server/kvs bench/jobgen)" >&2
+  exit 1
+fi
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+if ! "$JOBGEN" -j "$JOBS" -n "$LINES" -k "$KEYS" -K "$KEY_SIZE" -V "$VALUE_SIZE" -m "$MIX" \
+  -b "$BATCH" -z "$SKEW" -B "$BACKUP_EVERY" -s "$SEED" "$WORKDIR/jobs"; then
+  exit 1
+fi
+
+# Prints a field of an operation of the stats JSON, in microseconds.
+latency_us() {
+  sed -n "s/.*\"$2\":{\([^}]*\)}.*/\1/p" "$1" |
+    awk -v field="$3" -F, '{
+      for (i = 1; i <= NF; i++) {
+        split($i, kv, ":");
+        if (kv[1] == "\"" field "\"") printf("%.1f", kv[2] / 1000);
+      }
+    }'
+}
+
+# Prints the operations of every kind counted in the stats JSON, leaving out
+# the counts of the hot keys that follow them.
+total_ops() {
+  sed 's/"hot_keys":.*//' "$1" | grep -o '"count":[0-9]*' | awk -F: '{ sum += $2 } END { print sum + 0 }'
+}
+
+VERSION=$(git describe --always --dirty 2> /dev/null || echo unknown)
+
+echo "version,jobs,lines_per_job,keys,key_size,value_size,mix,batch,skew,backup_every,threads,backups,run,seconds,ops,ops_per_sec,read_p50_us,read_p99_us,read_p999_us,write_p50_us,write_p99_us,write_p999_us,peak_rss_kb"
+for threads in $THREADS; do
+  for backups in $BACKUPS; do
+    for ((run = 1; run <= REPEAT; run++)); do
+      rm -f "$WORKDIR"/jobs/*.out "$WORKDIR"/jobs/*.bck "$WORKDIR"/jobs/*.done "$WORKDIR/stats"
+      start=$(date +%s.%N)
+      "$SERVER" -w -S "$WORKDIR/stats" "$WORKDIR/jobs" "$threads" "$backups" "bench_run_$$" > /dev/null &
+      pid=$!
+      while [ "$(find "$WORKDIR/jobs" -name '*.done' | wc -l)" -lt "$JOBS" ]; do
+        if ! kill -0 "$pid" 2> /dev/null; then
+          echo "Server exited before finishing the jobs" >&2
+          exit 1
+        fi
+        sleep 0.01
+      done
+      end=$(date +%s.%N)
+      timeout 5 cat "$WORKDIR/stats" > "$WORKDIR/stats.json"
+      rss=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status")
+      kill "$pid" 2> /dev/null
+      wait "$pid" 2> /dev/null
+
+      ops=$(total_ops "$WORKDIR/stats.json")
+      seconds=$(awk -v s="$start" -v e="$end" 'BEGIN { printf("%.3f", e - s) }')
+      rate=$(awk -v ops="$ops" -v s="$seconds" 'BEGIN { printf("%.0f", s > 0 ? ops / s : 0) }')
+      row="$VERSION,$JOBS,$LINES,$KEYS,$KEY_SIZE,$VALUE_SIZE,$MIX,$BATCH,$SKEW,$BACKUP_EVERY"
+      row="$row,$threads,$backups,$run,$seconds,$ops,$rate"
+      for op in read write; do
+        for field in p50_ns p99_ns p999_ns; do
+          row="$row,$(latency_us "$WORKDIR/stats.json" "$op" "$field")"
+        done
+      done
+      echo "$row,${rss:-n/a}"
+    done
+  done
+done
+rm -f "/tmp/bench_run_$$"
@@ -1,5 +1,10 @@
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <fcntl.h> 
 #include <sys/wait.h>
@@ -12,10 +17,220 @@
 #include "src/common/io.h"
 #include "src/common/constants.h"
 #include "src/common/protocol.h"
+#include "src/common/shm.h"
+
+static int use_shm = 0;  // Rings with a server on a unix socket (kvs_set_transport)
+static int use_tcp = 0;  // The server path is a TCP address
+
+int kvs_set_transport(const char* name) {
+  if (strcmp(name, "pipe") == 0) {
+    use_shm = 0;
+    use_tcp = 0;
+  } else if (strcmp(name, "shm") == 0) {
+    use_shm = 1;
+    use_tcp = 0;
+  } else if (strcmp(name, "tcp") == 0) {
+    use_shm = 0;
+    use_tcp = 1;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+// Makes the rings of a session and names their ends by descriptors of the
+// connection (see src/common/shm.h).
+// @return The memfd to pass to the server, -1 if it failed.
+static int open_rings(int fd, int* notif_fifo, int* req_fifo, int* resp_fifo) {
+  int memfd = shm_create();
+  int fds[SHM_RINGS] = {fd, -1, -1};
+  if (memfd == -1 || (fds[SHM_RESPONSES] = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1 ||
+      (fds[SHM_NOTIFICATIONS] = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1 ||
+      shm_attach(memfd, SHM_CLIENT, fds) != 0) {
+    for (int i = SHM_RESPONSES; i < SHM_RINGS; i++) {
+      if (fds[i] != -1) {
+        close(fds[i]);
+      }
+    }
+    if (memfd != -1) {
+      close(memfd);
+    }
+    return -1;
+  }
+  *req_fifo = fds[SHM_REQUESTS];
+  *resp_fifo = fds[SHM_RESPONSES];
+  *notif_fifo = fds[SHM_NOTIFICATIONS];
+  return memfd;
+}
+
+// Connects to a server listening on a unix socket (see UNIX_HELLO_SIZE).
+// @return 0 if successful, -2 otherwise (with nothing left to clean up).
+static int connect_unix(const char* client_id, char const* server_path, int* notif_fifo,
+                        int* req_fifo, int* resp_fifo) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, server_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to connect to the register socket\n");
+    if (fd != -1) {
+      close(fd);
+    }
+    return -2;
+  }
+  // Either the write end of a pipe for the notifications, or the rings
+  int passed_fd;
+  int notif[2];
+  if (use_shm) {
+    passed_fd = open_rings(fd, notif_fifo, req_fifo, resp_fifo);
+  } else {
+    passed_fd = pipe(notif) == 0 ? notif[1] : -1;
+  }
+  if (passed_fd == -1) {
+    fprintf(stderr, "Failed to create the notification channel\n");
+    close(fd);
+    return -2;
+  }
+
+  char hello[UNIX_HELLO_SIZE];
+  memset(hello, '\0', sizeof(hello));
+  hello[0] = (char)('0' + (use_shm ? OP_CODE_CONNECT_SHM : OP_CODE_CONNECT));
+  strncpy(hello + 1, client_id, MAX_KEY_SIZE - 1);
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = hello, .iov_len = sizeof(hello)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+  ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  // The server writes the notifications to its own copy, or maps the rings
+  close(passed_fd);
+  if (sent != (ssize_t)sizeof(hello)) {
+    fprintf(stderr, "Failed to register with the server\n");
+    if (use_shm) {
+      shm_close(*notif_fifo);
+      shm_close(*resp_fifo);
+      shm_close(fd);
+    } else {
+      close(notif[0]);
+      close(fd);
+    }
+    return -2;
+  }
+
+  if (!use_shm) {
+    *req_fifo = fd;
+    *resp_fifo = fd;
+    *notif_fifo = notif[0];
+  }
+  return 0;
+}
+
+// Opens a TCP connection to the first address that takes it.
+// @return The connection, -1 if none did.
+static int dial_tcp(const struct addrinfo* addrs) {
+  for (const struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next) {
+    int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    int on = 1;
+    if (fd != -1 && connect(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == 0) {
+      return fd;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  return -1;
+}
+
+// Connects to a server listening on TCP (see TCP_TOKEN_SIZE).
+// @param address "[host:]port", with the host in brackets if it has colons;
+//                the loopback interface if there is none.
+// @return 0 if successful, -2 otherwise (with nothing left to clean up).
+static int connect_tcp(const char* client_id, const char* address, int* notif_fifo,
+                       int* req_fifo, int* resp_fifo) {
+  char host[256] = "";
+  const char* port = strrchr(address, ':');
+  if (port == NULL) {
+    port = address;
+  } else {
+    const char* start = address;
+    size_t len = (size_t)(port - address);
+    if (len >= 2 && address[0] == '[' && port[-1] == ']') {
+      start++;
+      len -= 2;
+    }
+    if (len >= sizeof(host)) {
+      fprintf(stderr, "Invalid server address: %s\n", address);
+      return -2;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+    port++;
+  }
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo* addrs;
+  int error = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &addrs);
+  if (error != 0) {
+    fprintf(stderr, "Invalid server address %s: %s\n", address, gai_strerror(error));
+    return -2;
+  }
+
+  char hello[UNIX_HELLO_SIZE];
+  memset(hello, '\0', sizeof(hello));
+  hello[0] = '0' + OP_CODE_CONNECT;
+  strncpy(hello + 1, client_id, MAX_KEY_SIZE - 1);
+  char answer[2 + TCP_TOKEN_SIZE];
+  int intr = 0;
+  int session = dial_tcp(addrs);
+  int notif = -1;
+  if (session != -1 && write_all(session, hello, sizeof(hello)) == 1 &&
+      read_all(session, answer, sizeof(answer), &intr) == 1 &&
+      answer[0] == '0' + OP_CODE_CONNECT && answer[1] == '0') {
+    // The notifications come on a connection of their own, named by the token
+    memset(hello, '\0', sizeof(hello));
+    hello[0] = '0' + OP_CODE_CONNECT_NOTIF;
+    memcpy(hello + 1, answer + 2, TCP_TOKEN_SIZE);
+    notif = dial_tcp(addrs);
+    if (notif != -1 && write_all(notif, hello, sizeof(hello)) != 1) {
+      close(notif);
+      notif = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (notif == -1) {
+    fprintf(stderr, "Failed to connect to the server at %s\n", address);
+    if (session != -1) {
+      close(session);
+    }
+    return -2;
+  }
+
+  *req_fifo = session;
+  *resp_fifo = session;
+  *notif_fifo = notif;
+  return 0;
+}
 
 int kvs_connect(const char* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
                 char const* notif_pipe_path, int* notif_fifo, int* req_fifo, int* resp_fifo) {
 
+  if (use_tcp) {
+    return connect_tcp(req_pipe_path + 8, server_pipe_path, notif_fifo, req_fifo, resp_fifo);
+  }
+
+  // A server started with -t unix listens on a socket, and no FIFOs are made
+  struct stat st;
+  if (stat(server_pipe_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    return connect_unix(req_pipe_path + 8, server_pipe_path, notif_fifo, req_fifo, resp_fifo);
+  }
+
   // Create fifos
   int register_fifo;
 
@@ -126,17 +341,31 @@ int kvs_disconnect(char const* req_pipe_path, char const* resp_pipe_path, char c
 
   if (result == 0){
     // Close the notification fifo
-    if (close(fd_notif_pipe) == -1){
+    if (shm_close(fd_notif_pipe) == -1){
       fprintf(stderr, "Failed to close fifo\n");
       return 1;
     }
     
     // Close the request fifo
-    if (close(fd_req_pipe) == -1){
+    if (shm_close(fd_req_pipe) == -1){
       fprintf(stderr, "Failed to close fifo\n");
       return 1;
     }
 
+    // A unix socket carries both requests and responses, and has no FIFOs
+    if (fd_resp_pipe == fd_req_pipe){
+      return 0;
+    }
+
+    // Neither do rings
+    if (shm_is_channel(fd_resp_pipe)){
+      if (shm_close(fd_resp_pipe) == -1){
+        fprintf(stderr, "Failed to close fifo\n");
+        return 1;
+      }
+      return 0;
+    }
+
     // Close the response fifo
     if (close(fd_resp_pipe) == -1){
       fprintf(stderr, "Failed to close fifo\n");
@@ -250,4 +479,63 @@ int kvs_unsubscribe(const char* key, int fd_req_pipe, int fd_resp_pipe) {
   return result;
 }
 
+int kvs_pool_acquire(const char* pool_path, int* pool_fd, int* notif_fifo, int* req_fifo,
+                     int* resp_fifo) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(pool_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Pool socket path too long: %s\n", pool_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, pool_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to connect to the pool %s\n", pool_path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  // Blocks until the pool has a session to lend
+  char byte;
+  union {
+    char buf[CMSG_SPACE(POOL_SESSION_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t got;
+  do {
+    got = recvmsg(fd, &msg, 0);
+  } while (got == -1 && errno == EINTR);
+
+  struct cmsghdr* cmsg = got == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(POOL_SESSION_FDS * sizeof(int))) {
+    fprintf(stderr, "The pool did not lend a session\n");
+    close(fd);
+    return 1;
+  }
+  int fds[POOL_SESSION_FDS];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  *req_fifo = fds[0];
+  *resp_fifo = fds[1];
+  *notif_fifo = fds[2];
+  *pool_fd = fd;
+  return 0;
+}
 
+int kvs_pool_release(int pool_fd, int fd_req_pipe, int fd_resp_pipe, int fd_notif_pipe) {
+  int result = 0;
+  result |= close(fd_req_pipe) == -1;
+  result |= close(fd_resp_pipe) == -1;
+  result |= close(fd_notif_pipe) == -1;
+  // The pool takes the session back once the connection is closed
+  result |= close(pool_fd) == -1;
+  if (result) {
+    fprintf(stderr, "Failed to close the session\n");
+  }
+  return result;
+}
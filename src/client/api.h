@@ -8,9 +8,27 @@
 /// @param req_pipe_path Path to the name pipe to be created for requests.
 /// @param resp_pipe_path Path to the name pipe to be created for responses.
 /// @param server_pipe_path Path to the name pipe where the server is listening.
+///        If it is a unix socket (the server runs with -t unix), no FIFOs are
+///        made: requests and responses share a connection (*req_fifo and
+///        *resp_fifo), and notifications come through a pipe; or, with
+///        kvs_set_transport("shm"), all three go through shared-memory rings,
+///        named by descriptors of that connection. With
+///        kvs_set_transport("tcp"), it is the "[host:]port" of a server that
+///        runs with -t tcp, and requests and responses share one connection
+///        and notifications come through another.
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int kvs_connect(const char* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
                 char const* notif_pipe_path, int* notif_fifo, int* req_fifo, int* resp_fifo);
+
+/// Selects how kvs_connect reaches a server: "pipe" (the default) for FIFOs,
+/// or a unix socket and a notification pipe; "shm" for shared-memory rings
+/// over a unix socket, for clients on the same machine as the server (a
+/// server on a register FIFO is still reached through FIFOs); "tcp" for a
+/// server on another host, or on the loopback interface.
+/// @param name Name of the transport.
+/// @return 0 if the name is valid, 1 otherwise.
+int kvs_set_transport(const char* name);
+
 /// Disconnects from an KVS server.
 /// @return 0 in case of success, 1 otherwise.
 int kvs_disconnect(char const* req_pipe_path, char const* resp_pipe_path, char const* notif_pipe_path,
@@ -27,5 +45,20 @@ int kvs_subscribe(const char* key, int fd_req_pipe, int fd_resp_pipe);
 /// @return 0 if the key was unsubscribed successfully  (subscription existed and was removed), 1 otherwise.
 
 int kvs_unsubscribe(const char* key, int fd_req_pipe, int fd_resp_pipe);
+
+/// Takes a session from a session pool (src/client/pool.c), waiting while
+/// every session is taken. The session is used like one from kvs_connect,
+/// with no subscriptions, but must be given back with kvs_pool_release
+/// instead of kvs_disconnect.
+/// @param pool_path Path to the socket of the pool.
+/// @param pool_fd Set to the connection with the pool.
+/// @return 0 if a session was taken, 1 otherwise.
+int kvs_pool_acquire(const char* pool_path, int* pool_fd, int* notif_fifo, int* req_fifo,
+                     int* resp_fifo);
+
+/// Gives a session back to its pool, which ends its subscriptions. Exiting
+/// does the same.
+/// @return 0 in case of success, 1 otherwise.
+int kvs_pool_release(int pool_fd, int fd_req_pipe, int fd_resp_pipe, int fd_notif_pipe);
  
 #endif  // CLIENT_API_H
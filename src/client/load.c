@@ -0,0 +1,484 @@
+// Load generator: opens many sessions with the server, subscribes each to a
+// few keys and writes those keys through job files, to measure how long a
+// write takes to reach its subscribers and how many notifications the server
+// delivers per second.
+//
+// Every value written starts with the CLOCK_MONOTONIC time its job file was
+// published, so the latency of a notification is the time from publishing
+// the write to reading it from the notification FIFO. The server must watch
+// the jobs directory (-w) and serve every session at once (-c).
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/client/api.h"
+#include "src/common/constants.h"
+#include "src/common/io.h"
+#include "src/common/protocol.h"
+
+#define MAX_SESSIONS 1024
+#define MAX_PAIRS_PER_JOB 256  // Pairs of a WRITE command
+#define MAX_VALUE_BYTES (1 << 20)  // MAX_VALUE_SIZE of the server
+#define MAX_JOB_PATH 4096
+#define MIN_VALUE_SIZE 21  // The publish time and its ':'
+#define SEED_TIMEOUT_MS 10000
+
+// Latency histogram, log-linear like the one of the server metrics.
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_BITS 40
+#define NUM_BUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct Options {
+  size_t sessions;
+  size_t keys_per_session;
+  size_t num_keys;
+  double jobs_per_sec;
+  size_t pairs_per_job;
+  size_t value_size;
+  unsigned int duration_s;
+  unsigned int interval_ms;
+  const char *prefix;
+} Options;
+
+typedef struct Latencies {
+  uint64_t count;
+  uint64_t max_ns;
+  uint64_t buckets[NUM_BUCKETS];
+} Latencies;
+
+typedef struct Session {
+  char req_path[MAX_PIPE_PATH_LENGTH];
+  char resp_path[MAX_PIPE_PATH_LENGTH];
+  char notif_path[MAX_PIPE_PATH_LENGTH];
+  int req_fd, resp_fd, notif_fd;
+  pthread_t reader;
+  Latencies latencies;  // Written by the reader, read by the reporter
+} Session;
+
+static Options opts = {4, 4, 64, 100, 8, 32, 10, 1000, "load"};
+static const char *jobs_dir;
+static Session *sessions;
+static uint64_t writes_published = 0;
+static int writing_done = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t ns) {
+  if (ns < SUB_BUCKETS) {
+    return (size_t)ns;
+  }
+  int bits = 63 - __builtin_clzll(ns);
+  if (bits >= MAX_BITS) {
+    return NUM_BUCKETS - 1;
+  }
+  size_t sub = (size_t)(ns >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1);
+  return (size_t)(bits - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// Highest latency a bucket holds.
+static uint64_t bucket_max(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  size_t shift = bucket / SUB_BUCKETS - 1;
+  uint64_t sub = bucket % SUB_BUCKETS;
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const Latencies *latencies, uint64_t per_mille) {
+  uint64_t rank = (latencies->count * per_mille + 999) / 1000;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < NUM_BUCKETS; i++) {
+    seen += latencies->buckets[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t ns = bucket_max(i);
+      return ns < latencies->max_ns ? ns : latencies->max_ns;
+    }
+  }
+  return 0;
+}
+
+// Only the reader of a session writes its latencies, the stores are atomic
+// so the reporter never sees half of one.
+static void record(Latencies *latencies, uint64_t ns) {
+  __atomic_store_n(&latencies->count, latencies->count + 1, __ATOMIC_RELAXED);
+  size_t bucket = bucket_of(ns);
+  __atomic_store_n(&latencies->buckets[bucket], latencies->buckets[bucket] + 1, __ATOMIC_RELAXED);
+  if (ns > latencies->max_ns) {
+    __atomic_store_n(&latencies->max_ns, ns, __ATOMIC_RELAXED);
+  }
+}
+
+// Sums the latencies of every session.
+static void snapshot(Latencies *total) {
+  memset(total, 0, sizeof(Latencies));
+  for (size_t s = 0; s < opts.sessions; s++) {
+    const Latencies *latencies = &sessions[s].latencies;
+    total->count += __atomic_load_n(&latencies->count, __ATOMIC_RELAXED);
+    uint64_t max_ns = __atomic_load_n(&latencies->max_ns, __ATOMIC_RELAXED);
+    if (max_ns > total->max_ns) {
+      total->max_ns = max_ns;
+    }
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+      total->buckets[i] += __atomic_load_n(&latencies->buckets[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void key_name(char *key, size_t size, size_t index) {
+  snprintf(key, size, "lk%zu", index);
+}
+
+// Reads notifications until the FIFO is closed, timing the ones that carry
+// a publish time.
+static void *read_notifications(void *arg) {
+  Session *session = arg;
+  char key[MAX_KEY_SIZE];
+  unsigned char len_buffer[NOTIF_HEADER_SIZE - MAX_KEY_SIZE];
+  char *value = NULL;
+  size_t capacity = 0;
+  int intr = 0;
+
+  while (read_all(session->notif_fd, key, MAX_KEY_SIZE, &intr) == 1 &&
+         read_all(session->notif_fd, len_buffer, sizeof(len_buffer), &intr) == 1) {
+    uint64_t received = now_ns();
+    size_t value_len = 0;
+    for (size_t i = 0; i < sizeof(len_buffer); i++) {
+      value_len |= (size_t)len_buffer[i] << (8 * i);
+    }
+    if (value_len + 1 > capacity) {
+      char *grown = realloc(value, value_len + 1);
+      if (grown == NULL) {
+        fprintf(stderr, "Failed to allocate a notification\n");
+        break;
+      }
+      value = grown;
+      capacity = value_len + 1;
+    }
+    if (read_all(session->notif_fd, value, value_len, &intr) != 1) {
+      break;
+    }
+    value[value_len] = '\0';
+
+    // DELETED, EXPIRED and EVICTED carry no time
+    char *end;
+    unsigned long long published = strtoull(value, &end, 10);
+    if (end != value && *end == ':') {
+      record(&session->latencies, received > published ? received - published : 0);
+    }
+  }
+  free(value);
+  return NULL;
+}
+
+// Publishes a job: it is written under a name the server ignores, then
+// renamed, so the server never reads half of it.
+static int publish_job(const char *name, const char *text, size_t len) {
+  char tmp_path[MAX_JOB_PATH];
+  char job_path[MAX_JOB_PATH];
+  snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.tmp", jobs_dir, name);
+  snprintf(job_path, sizeof(job_path), "%s/%s.job", jobs_dir, name);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create %s\n", tmp_path);
+    return 1;
+  }
+  int result = write_all(fd, text, len) == -1;
+  result |= close(fd) == -1;
+  if (result || rename(tmp_path, job_path) == -1) {
+    fprintf(stderr, "Failed to publish %s\n", job_path);
+    unlink(tmp_path);
+    return 1;
+  }
+  return 0;
+}
+
+// Appends the pair of a key to a WRITE command: the publish time, then
+// padding up to the value size.
+static size_t put_pair(char *text, size_t key_index, uint64_t stamp) {
+  char key[MAX_STRING_SIZE];
+  key_name(key, sizeof(key), key_index);
+  int len = sprintf(text, "(%s,%llu:", key, (unsigned long long)stamp);
+  size_t value_len = (size_t)len - strlen(key) - 2;
+  while (value_len < opts.value_size) {
+    text[len++] = 'x';
+    value_len++;
+  }
+  text[len++] = ')';
+  return (size_t)len;
+}
+
+// Writes every key once, so they can be subscribed, and waits for the server
+// to finish the job.
+static int seed_keys(char *text) {
+  char name[64];
+  snprintf(name, sizeof(name), "load_%ld_seed", (long)getpid());
+  size_t len = 0;
+  for (size_t k = 0; k < opts.num_keys; k++) {
+    if (k % MAX_PAIRS_PER_JOB == 0) {
+      len += (size_t)sprintf(text + len, k == 0 ? "WRITE [" : "]\nWRITE [");
+    }
+    len += put_pair(text + len, k, 0);
+  }
+  len += (size_t)sprintf(text + len, "]\n");
+  if (publish_job(name, text, len) != 0) {
+    return 1;
+  }
+
+  char done_path[MAX_JOB_PATH];
+  snprintf(done_path, sizeof(done_path), "%s/%s.done", jobs_dir, name);
+  for (unsigned int waited = 0; access(done_path, F_OK) != 0; waited += 10) {
+    if (waited >= SEED_TIMEOUT_MS) {
+      fprintf(stderr, "The server did not run %s.job, is it watching %s (-w)?\n", name, jobs_dir);
+      return 1;
+    }
+    delay(10);
+  }
+  return 0;
+}
+
+// Publishes jobs at the set rate until the duration is over.
+static void *write_jobs(void *arg) {
+  char *text = arg;
+  char name[64];
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)opts.duration_s * 1000000000;
+  uint64_t period = (uint64_t)(1e9 / opts.jobs_per_sec);
+  size_t next_key = 0;
+
+  for (uint64_t job = 0;; job++) {
+    uint64_t due = start + job * period;
+    if (due >= end) {
+      break;
+    }
+    struct timespec until = {(time_t)(due / 1000000000), (long)(due % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+      // Sleep again until it is due
+    }
+
+    uint64_t stamp = now_ns();
+    size_t len = (size_t)sprintf(text, "WRITE [");
+    for (size_t p = 0; p < opts.pairs_per_job; p++) {
+      len += put_pair(text + len, next_key, stamp);
+      next_key = (next_key + 1) % opts.num_keys;
+    }
+    len += (size_t)sprintf(text + len, "]\n");
+    snprintf(name, sizeof(name), "load_%ld_%llu", (long)getpid(), (unsigned long long)job);
+    if (publish_job(name, text, len) != 0) {
+      break;
+    }
+    __atomic_add_fetch(&writes_published, opts.pairs_per_job, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&writing_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int open_session(size_t index, const char *register_path) {
+  Session *session = &sessions[index];
+  // The server takes the client id from the request FIFO path, past "/tmp/req"
+  snprintf(session->req_path, MAX_PIPE_PATH_LENGTH, "/tmp/req%s%zu", opts.prefix, index);
+  snprintf(session->resp_path, MAX_PIPE_PATH_LENGTH, "/tmp/resp%s%zu", opts.prefix, index);
+  snprintf(session->notif_path, MAX_PIPE_PATH_LENGTH, "/tmp/notif%s%zu", opts.prefix, index);
+  if (kvs_connect(session->req_path, session->resp_path, register_path, session->notif_path,
+                  &session->notif_fd, &session->req_fd, &session->resp_fd) != 0) {
+    fprintf(stderr, "Session %zu failed to connect\n", index);
+    return 1;
+  }
+
+  // Sessions take consecutive runs of keys, wrapping around
+  char key[MAX_STRING_SIZE];
+  for (size_t k = 0; k < opts.keys_per_session; k++) {
+    key_name(key, sizeof(key), (index * opts.keys_per_session + k) % opts.num_keys);
+    if (kvs_subscribe(key, session->req_fd, session->resp_fd) != 1) {
+      fprintf(stderr, "Session %zu failed to subscribe %s\n", index, key);
+      return 1;
+    }
+  }
+
+  if (pthread_create(&session->reader, NULL, read_notifications, session) != 0) {
+    fprintf(stderr, "Failed to create the reader of session %zu\n", index);
+    return 1;
+  }
+  return 0;
+}
+
+static void close_session(size_t index) {
+  Session *session = &sessions[index];
+  pthread_cancel(session->reader);
+  pthread_join(session->reader, NULL);
+  if (kvs_disconnect(session->req_path, session->resp_path, session->notif_path, session->req_fd,
+                     session->resp_fd, session->notif_fd) != 0) {
+    fprintf(stderr, "Session %zu failed to disconnect\n", index);
+  }
+}
+
+// Writes a CSV row with what happened since the previous one.
+static void report(FILE *csv, double elapsed_s, double interval_s, uint64_t writes,
+                   const Latencies *interval) {
+  fprintf(csv, "%.3f,%llu,%.1f,%llu,%.1f,%.1f,%.1f,%.1f,%.1f\n", elapsed_s,
+          (unsigned long long)writes, (double)writes / interval_s,
+          (unsigned long long)interval->count, (double)interval->count / interval_s,
+          (double)percentile(interval, 500) / 1e3, (double)percentile(interval, 990) / 1e3,
+          (double)percentile(interval, 999) / 1e3, (double)interval->max_ns / 1e3);
+  fflush(csv);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] <register_pipe_path> <jobs_dir>\n"
+          "  -n sessions          sessions opened (default 4)\n"
+          "  -k keys              keys each session subscribes (default 4)\n"
+          "  -K keys              keys written, lk0 to lk<keys-1> (default 64)\n"
+          "  -r jobs              write jobs published per second (default 100)\n"
+          "  -b pairs             pairs written by each job (default 8)\n"
+          "  -v bytes             value size, at least 21 (default 32)\n"
+          "  -d seconds           time spent writing (default 10)\n"
+          "  -t ms                time between CSV rows (default 1000)\n"
+          "  -p prefix            prefix of the client ids (default load)\n"
+          "Prints one CSV row per interval on stdout, latencies in microseconds.\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  int bad = 0;
+  while ((opt = getopt(argc, argv, "n:k:K:r:b:v:d:t:p:")) != -1) {
+    switch (opt) {
+      case 'n': opts.sessions = strtoul(optarg, NULL, 10); break;
+      case 'k': opts.keys_per_session = strtoul(optarg, NULL, 10); break;
+      case 'K': opts.num_keys = strtoul(optarg, NULL, 10); break;
+      case 'r': opts.jobs_per_sec = strtod(optarg, NULL); break;
+      case 'b': opts.pairs_per_job = strtoul(optarg, NULL, 10); break;
+      case 'v': opts.value_size = strtoul(optarg, NULL, 10); break;
+      case 'd': opts.duration_s = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 't': opts.interval_ms = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 'p': opts.prefix = optarg; break;
+      default: bad = 1;
+    }
+  }
+  if (bad || argc - optind != 2 || opts.sessions == 0 || opts.sessions > MAX_SESSIONS ||
+      opts.num_keys == 0 || opts.keys_per_session > opts.num_keys || opts.jobs_per_sec <= 0 ||
+      opts.pairs_per_job == 0 || opts.pairs_per_job > MAX_PAIRS_PER_JOB ||
+      opts.value_size < MIN_VALUE_SIZE || opts.value_size > MAX_VALUE_BYTES || opts.interval_ms == 0 ||
+      strlen("/tmp/notif") + strlen(opts.prefix) + 5 > MAX_PIPE_PATH_LENGTH) {
+    usage(argv[0]);
+    return 1;
+  }
+  char register_path[MAX_PIPE_PATH_LENGTH] = "/tmp/";
+  strncat(register_path, argv[optind], MAX_PIPE_PATH_LENGTH - strlen(register_path) - 1);
+  jobs_dir = argv[optind + 1];
+
+  // The API reports every call on stdout, which is kept for the CSV
+  int csv_fd = dup(STDOUT_FILENO);
+  FILE *csv = csv_fd == -1 ? NULL : fdopen(csv_fd, "w");
+  if (csv == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+    fprintf(stderr, "Failed to set up the output\n");
+    return 1;
+  }
+
+  // Big enough for the seed job, which also fits any write job
+  size_t pair_size = MAX_STRING_SIZE + opts.value_size + 4;
+  size_t text_size = (opts.num_keys > opts.pairs_per_job ? opts.num_keys : opts.pairs_per_job) *
+                     pair_size + (opts.num_keys / MAX_PAIRS_PER_JOB + 1) * 16;
+  char *seed_text = malloc(text_size);
+  char *job_text = malloc(opts.pairs_per_job * pair_size + 16);
+  sessions = calloc(opts.sessions, sizeof(Session));
+  Latencies *previous = calloc(1, sizeof(Latencies));
+  Latencies *current = calloc(1, sizeof(Latencies));
+  if (seed_text == NULL || job_text == NULL || sessions == NULL || previous == NULL ||
+      current == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  if (seed_keys(seed_text) != 0) {
+    return 1;
+  }
+  size_t opened = 0;
+  while (opened < opts.sessions && open_session(opened, register_path) == 0) {
+    opened++;
+  }
+  if (opened < opts.sessions) {
+    for (size_t s = 0; s < opened; s++) {
+      close_session(s);
+    }
+    return 1;
+  }
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, write_jobs, job_text) != 0) {
+    fprintf(stderr, "Failed to create the writer\n");
+    return 1;
+  }
+
+  fprintf(csv, "elapsed_s,writes,writes_per_s,notifications,notifications_per_s,p50_us,p99_us,"
+               "p999_us,max_us\n");
+  uint64_t start = now_ns();
+  uint64_t last = start;
+  uint64_t last_writes = 0;
+  Latencies total = {0};
+  int idle = 0;
+  // Goes on after the last write until an interval goes by with no
+  // notification, so the late ones are counted
+  while (!__atomic_load_n(&writing_done, __ATOMIC_ACQUIRE) || !idle) {
+    delay(opts.interval_ms);
+    uint64_t now = now_ns();
+    uint64_t writes = __atomic_load_n(&writes_published, __ATOMIC_RELAXED);
+    snapshot(current);
+    Latencies interval;
+    interval.count = current->count - previous->count;
+    interval.max_ns = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+      interval.buckets[i] = current->buckets[i] - previous->buckets[i];
+      if (interval.buckets[i] > 0) {
+        interval.max_ns = bucket_max(i);
+      }
+    }
+    if (interval.max_ns > current->max_ns) {
+      interval.max_ns = current->max_ns;
+    }
+    report(csv, (double)(now - start) / 1e9, (double)(now - last) / 1e9, writes - last_writes,
+           &interval);
+    idle = interval.count == 0;
+    last = now;
+    last_writes = writes;
+    Latencies *swap = previous;
+    previous = current;
+    current = swap;
+  }
+  pthread_join(writer, NULL);
+
+  snapshot(&total);
+  double seconds = (double)(last - start) / 1e9;
+  fprintf(stderr,
+          "%llu writes, %llu notifications in %.1f s (%.1f/s), latency p50 %.1f us, p99 %.1f us, "
+          "p999 %.1f us, max %.1f us\n",
+          (unsigned long long)__atomic_load_n(&writes_published, __ATOMIC_RELAXED),
+          (unsigned long long)total.count, seconds, (double)total.count / seconds,
+          (double)percentile(&total, 500) / 1e3, (double)percentile(&total, 990) / 1e3,
+          (double)percentile(&total, 999) / 1e3, (double)total.max_ns / 1e3);
+
+  for (size_t s = 0; s < opts.sessions; s++) {
+    close_session(s);
+  }
+  fclose(csv);
+  free(seed_text);
+  free(job_text);
+  free(sessions);
+  free(previous);
+  free(current);
+  return 0;
+}
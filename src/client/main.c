@@ -10,6 +10,7 @@
 #include "src/client/api.h"
 #include "src/common/constants.h"
 #include "src/common/io.h"
+#include "src/common/protocol.h"
 
 int notif_fifo, req_fifo, resp_fifo; 
 
@@ -18,7 +19,7 @@ void* reads_notifs(void* arg){
   int *fd_notif = (int*) arg;
   int fd_notif_pipe = *fd_notif;
   char key_buffer[MAX_KEY_SIZE];
-  char value_buffer[MAX_KEY_SIZE];
+  unsigned char len_buffer[NOTIF_HEADER_SIZE - MAX_KEY_SIZE];
   int intr = 0;
   
   while(1){
@@ -39,33 +40,66 @@ void* reads_notifs(void* arg){
       kill(getpid(), SIGKILL);
     }
 
-    if (read_all(fd_notif_pipe, value_buffer, sizeof(char)*MAX_KEY_SIZE, &intr) == -1) {
+    // Values have any length (see NOTIF_HEADER_SIZE)
+    size_t value_len = 0;
+    char *value_buffer = NULL;
+    if (read_all(fd_notif_pipe, len_buffer, sizeof(len_buffer), &intr) != -1) {
+      for (size_t i = 0; i < sizeof(len_buffer); i++) {
+        value_len |= (size_t)len_buffer[i] << (8 * i);
+      }
+      value_buffer = malloc(value_len + 1);
+    }
+    if (value_buffer == NULL || read_all(fd_notif_pipe, value_buffer, value_len, &intr) == -1) {
       if (intr){
         fprintf(stderr, "Reading from the notification FIFO was interrupted\n");
       } else {
         fprintf(stderr, "Failed to read from the notification FIFO\n");
       }
+      free(value_buffer);
       return NULL;
     }
+    value_buffer[value_len] = '\0';
 
     printf("(%s,%s)\n", key_buffer, value_buffer);
+    free(value_buffer);
   }
   return NULL;
 }
 
 
 int main(int argc, char* argv[]) {
+  // Rings instead of a pipe with a server on a unix socket, or TCP, with an
+  // address instead of a register path (kvs_set_transport)
+  int tcp = 0;
+  if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+    tcp = strcmp(argv[2], "tcp") == 0;
+    if (kvs_set_transport(argv[2]) != 0) {
+      fprintf(stderr, "Unknown transport: %s\n", argv[2]);
+      return 1;
+    }
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
   if (argc < 3) {
-    fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-t pipe|shm|tcp] <client_unique_id> <register_pipe_path>\n", argv[0]);
+    fprintf(stderr, "       %s -P <pool_socket_path>\n", argv[0]);
     return 1;
   }
+  // Takes a session from a pool (src/client/pool.c) instead of connecting
+  const char* pool_path = strcmp(argv[1], "-P") == 0 ? argv[2] : NULL;
+  int pool_fd = -1;
   
   pthread_t thread_id;
   char req_pipe_path[256] = "/tmp/req";
   char resp_pipe_path[256] = "/tmp/resp";
   char notif_pipe_path[256] = "/tmp/notif";
   char register_pipe_path[256] = "/tmp/";
-  strcat(register_pipe_path, argv[2]);
+  if (tcp) {
+    snprintf(register_pipe_path, sizeof(register_pipe_path), "%s", argv[2]);
+  } else {
+    strcat(register_pipe_path, argv[2]);
+  }
 
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
   unsigned int delay_ms;
@@ -78,7 +112,13 @@ int main(int argc, char* argv[]) {
   req_pipe_path[strlen(req_pipe_path)] = '\0';
   resp_pipe_path[strlen(resp_pipe_path)] = '\0';
   notif_pipe_path[strlen(notif_pipe_path)] = '\0';
-  int connection = kvs_connect(req_pipe_path, resp_pipe_path, register_pipe_path, notif_pipe_path, &notif_fifo, &req_fifo, &resp_fifo);
+  int connection;
+  if (pool_path != NULL) {
+    // Nothing to clean up if it fails
+    connection = kvs_pool_acquire(pool_path, &pool_fd, &notif_fifo, &req_fifo, &resp_fifo) == 0 ? 0 : -2;
+  } else {
+    connection = kvs_connect(req_pipe_path, resp_pipe_path, register_pipe_path, notif_pipe_path, &notif_fifo, &req_fifo, &resp_fifo);
+  }
   
   if(connection < 0){
     if(connection == -1){
@@ -128,6 +168,9 @@ int main(int argc, char* argv[]) {
       case CMD_DISCONNECT:
         pthread_cancel(thread_id);
         pthread_join(thread_id, NULL);
+        if (pool_path != NULL) {
+          return kvs_pool_release(pool_fd, req_fifo, resp_fifo, notif_fifo) == 0 ? 0 : -1;
+        }
         // debug this bs
         if (kvs_disconnect(req_pipe_path, resp_pipe_path, notif_pipe_path, req_fifo, resp_fifo, notif_fifo) != 0) {
           fprintf(stderr, "Failed to disconnect to the server\n");
@@ -0,0 +1,295 @@
+// Session pool: keeps sessions with the server open and lends them to
+// short-lived clients, so they skip creating FIFOs and registering with the
+// server. A client connects to the socket of the pool and gets the FIFOs of a
+// free session (see POOL_SESSION_FDS and kvs_pool_acquire); when it closes
+// the connection, or exits or crashes, the pool ends its subscriptions,
+// drops what it left unread and lends the session again.
+//
+// The FIFOs are unlinked as soon as the session is open, so a pool that
+// crashes leaves none behind, and the server ends its sessions when their
+// request FIFOs close. A session that breaks is opened again. The server must
+// serve every session at once (-c).
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "src/client/api.h"
+#include "src/common/constants.h"
+#include "src/common/io.h"
+#include "src/common/protocol.h"
+
+#define MAX_SESSIONS 1024
+#define RECONNECT_DELAY_MS 1000
+#define DRAIN_SIZE 4096
+#define SESSION_SUFFIX_SIZE 24  // "<pid>.<index>.<generation>" and its NUL
+
+typedef struct PoolSession {
+  size_t index;
+  unsigned generation;  // Times the session was opened, part of its client id
+  int req_fd, resp_fd, notif_fd;  // -1 while closed
+  pthread_t thread;
+} PoolSession;
+
+static size_t num_sessions = 4;
+static const char *prefix = "pool";
+static char register_path[MAX_PIPE_PATH_LENGTH] = "/tmp/";
+static int listen_fd;
+
+static void close_session(PoolSession *session) {
+  close(session->req_fd);
+  if (session->resp_fd != session->req_fd) {  // The same socket over unix
+    close(session->resp_fd);
+  }
+  close(session->notif_fd);
+  session->req_fd = -1;
+  session->resp_fd = -1;
+  session->notif_fd = -1;
+}
+
+static int open_session(PoolSession *session) {
+  char req_path[MAX_PIPE_PATH_LENGTH];
+  char resp_path[MAX_PIPE_PATH_LENGTH];
+  char notif_path[MAX_PIPE_PATH_LENGTH];
+  // The server takes the client id from the request FIFO path, past "/tmp/req"
+  long pid = (long)getpid();
+  session->generation++;
+  snprintf(req_path, sizeof(req_path), "/tmp/req%s%ld.%zu.%u", prefix, pid, session->index,
+           session->generation);
+  snprintf(resp_path, sizeof(resp_path), "/tmp/resp%s%ld.%zu.%u", prefix, pid, session->index,
+           session->generation);
+  snprintf(notif_path, sizeof(notif_path), "/tmp/notif%s%ld.%zu.%u", prefix, pid,
+           session->index, session->generation);
+  // Left by an earlier pool with the same pid, which is gone
+  unlink(req_path);
+  unlink(resp_path);
+  unlink(notif_path);
+
+  int result = kvs_connect(req_path, resp_path, register_path, notif_path, &session->notif_fd,
+                           &session->req_fd, &session->resp_fd);
+  // The open FIFOs work on without their names
+  unlink(req_path);
+  unlink(resp_path);
+  unlink(notif_path);
+  if (result != 0) {
+    fprintf(stderr, "Session %zu failed to connect\n", session->index);
+    close_session(session);  // The FIFOs it did not open are still -1
+    return 1;
+  }
+  return 0;
+}
+
+// Ends the subscriptions a client left, and drops the responses and
+// notifications it did not read.
+// @return 0 if the session can be lent again, 1 if it broke.
+static int reset_session(PoolSession *session) {
+  char op = '0' + OP_CODE_RESET;
+  if (write_all(session->req_fd, &op, 1) == -1) {
+    return 1;
+  }
+
+  // Responses are 3 bytes and only the one of a reset has op code 5, but the
+  // client may have left one half read, so the reset is looked for a byte at
+  // a time
+  char response[2];
+  int intr = 0;
+  do {
+    if (read_all(session->resp_fd, response, 1, &intr) != 1) {
+      return 1;
+    }
+  } while (response[0] != op);
+  if (read_all(session->resp_fd, response, 2, &intr) != 1 || response[0] != '0') {
+    return 1;
+  }
+
+  // The notifications of the subscriptions were all written before the reset
+  int flags = fcntl(session->notif_fd, F_GETFL);
+  if (flags == -1 || fcntl(session->notif_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return 1;
+  }
+  char drained[DRAIN_SIZE];
+  ssize_t got;
+  while ((got = read(session->notif_fd, drained, sizeof(drained))) > 0) {
+    // Dropped
+  }
+  int emptied = got == -1 && errno == EAGAIN;  // Not closed by the server
+  if (fcntl(session->notif_fd, F_SETFL, flags) == -1) {
+    return 1;
+  }
+  return emptied ? 0 : 1;
+}
+
+static int lend_session(int conn, const PoolSession *session) {
+  char byte = 0;
+  int fds[POOL_SESSION_FDS] = {session->req_fd, session->resp_fd, session->notif_fd};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1 ? 0 : 1;
+}
+
+// Waits until the client closes the connection, or exits.
+static void wait_release(int conn) {
+  char byte;
+  ssize_t got;
+  do {
+    got = read(conn, &byte, 1);
+  } while (got > 0 || (got == -1 && errno == EINTR));
+}
+
+// Lends one session, over and over. The threads of the free sessions accept
+// the clients, so a client waits for a session in the listen backlog.
+static void *serve_session(void *arg) {
+  PoolSession *session = arg;
+  while (1) {
+    if (session->req_fd == -1 && open_session(session) != 0) {
+      delay(RECONNECT_DELAY_MS);
+      continue;
+    }
+
+    int conn = accept(listen_fd, NULL, NULL);
+    if (conn == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        fprintf(stderr, "Failed to accept a client: %s\n", strerror(errno));
+        delay(RECONNECT_DELAY_MS);
+      }
+      continue;
+    }
+    int lent = lend_session(conn, session) == 0;
+    if (lent) {
+      wait_release(conn);
+    }
+    close(conn);
+
+    if (lent && reset_session(session) != 0) {
+      fprintf(stderr, "Session %zu broke, opening it again\n", session->index);
+      close_session(session);
+    }
+  }
+  return NULL;
+}
+
+// Listens on the pool socket, taking over the one of a pool that is gone.
+// @return The listening socket, -1 if it failed.
+static int listen_pool(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Pool socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create the pool socket\n");
+    return -1;
+  }
+  int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  if (!bound && errno == EADDRINUSE) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    int alive = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (probe != -1) {
+      close(probe);
+    }
+    if (alive) {
+      fprintf(stderr, "Another pool is serving %s\n", path);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+    bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+  if (!bound || listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] <register_pipe_path> <pool_socket_path>\n"
+          "  -n sessions          sessions kept open (default 4)\n"
+          "  -p prefix            prefix of the client ids (default pool)\n"
+          "Runs until SIGINT or SIGTERM. Clients take sessions with kvs_pool_acquire\n"
+          "(client -P <pool_socket_path>).\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  int bad = 0;
+  while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+    switch (opt) {
+      case 'n': num_sessions = strtoul(optarg, NULL, 10); break;
+      case 'p': prefix = optarg; break;
+      default: bad = 1;
+    }
+  }
+  if (bad || argc - optind != 2 || num_sessions == 0 || num_sessions > MAX_SESSIONS ||
+      strlen("/tmp/notif") + strlen(prefix) + SESSION_SUFFIX_SIZE > MAX_PIPE_PATH_LENGTH) {
+    usage(argv[0]);
+    return 1;
+  }
+  strncat(register_path, argv[optind], MAX_PIPE_PATH_LENGTH - strlen(register_path) - 1);
+  const char *pool_path = argv[optind + 1];
+
+  // The API reports every call on stdout
+  if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+    fprintf(stderr, "Failed to set up the output\n");
+    return 1;
+  }
+  // Clients and sessions that are gone fail writes instead; the other
+  // signals are taken by the main thread alone
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+  listen_fd = listen_pool(pool_path);
+  if (listen_fd == -1) {
+    return 1;
+  }
+  PoolSession *sessions = calloc(num_sessions, sizeof(PoolSession));
+  if (sessions == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    unlink(pool_path);
+    return 1;
+  }
+  for (size_t s = 0; s < num_sessions; s++) {
+    sessions[s] = (PoolSession){.index = s, .req_fd = -1, .resp_fd = -1, .notif_fd = -1};
+    if (open_session(&sessions[s]) != 0 ||
+        pthread_create(&sessions[s].thread, NULL, serve_session, &sessions[s]) != 0) {
+      fprintf(stderr, "Failed to start session %zu\n", s);
+      unlink(pool_path);
+      return 1;
+    }
+  }
+  fprintf(stderr, "Pool of %zu sessions serving %s\n", num_sessions, pool_path);
+
+  int sig;
+  sigwait(&stop, &sig);
+  // Exiting closes the sessions, which the server then ends; the ones that
+  // are lent end when their clients let them go
+  unlink(pool_path);
+  return 0;
+}
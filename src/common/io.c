@@ -7,6 +7,7 @@
 #include <time.h>
 #include <unistd.h>
 #include "src/common/constants.h"
+#include "src/common/shm.h"
  
 int find_in_vector(int * index_seen, int hashed_key, int count){
     for (int i = 0; i < count; i++){
@@ -23,7 +24,7 @@ int read_all(int fd, void *buffer, size_t size, int *intr) {
   }
   size_t bytes_read = 0;
   while (bytes_read < size) {
-    ssize_t result = read(fd, buffer + bytes_read, size - bytes_read);
+    ssize_t result = shm_read(fd, buffer + bytes_read, size - bytes_read);
     if (result == -1) {
       if (errno == EINTR) {
         if (intr != NULL) {
@@ -63,7 +64,7 @@ int read_string(int fd, char *str) {
 int write_all(int fd, const void *buffer, size_t size) {
   size_t bytes_written = 0;
   while (bytes_written < size) {
-    ssize_t result = write(fd, buffer + bytes_written, size - bytes_written);
+    ssize_t result = shm_write(fd, buffer + bytes_written, size - bytes_written);
     if (result == -1) {
       if (errno == EINTR) {
         // error for broken PIPE (error associated with writting to the closed PIPE)
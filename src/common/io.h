@@ -5,7 +5,8 @@
 
 /// Reads a given number of bytes from a file descriptor. Will block until all
 /// bytes are read, or fail if not all bytes could be read.
-/// @param fd File descriptor to read from.
+/// @param fd File descriptor to read from, or that names a shared-memory ring
+///           (see src/common/shm.h).
 /// @param buffer Buffer to read into.
 /// @param size Number of bytes to read.
 /// @param intr Pointer to a variable that will be set to 1 if the read was interrupted.
@@ -16,7 +17,7 @@ int read_string(int fd, char *str);
 
 /// Writes a given number of bytes to a file descriptor. Will block until all
 /// bytes are written, or fail if not all bytes could be written.
-/// @param fd File descriptor to write to.
+/// @param fd File descriptor to write to, or that names a shared-memory ring.
 /// @param buffer Buffer to write from.
 /// @param size Number of bytes to write.
 /// @return On success, returns 1, on error, returns -1
@@ -9,7 +9,44 @@ enum {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_SUBSCRIBE = 3,
   OP_CODE_UNSUBSCRIBE = 4,
+  // Ends every subscription of the session, which stays connected; the
+  // request is the op code alone (see src/client/pool.c)
+  OP_CODE_RESET = 5,
+  // Registers over a unix socket with shared-memory rings (see src/common/shm.h)
+  OP_CODE_CONNECT_SHM = 6,
+  // Opens the notification connection of a session over TCP (see TCP_TOKEN_SIZE)
+  OP_CODE_CONNECT_NOTIF = 7,
   // TODO mais opcodes para cada operacao
 };
 
+// Notifications of a subscription: the key, NUL padded to MAX_KEY_SIZE bytes,
+// the length of the value as 4 little-endian bytes, then the value (not NUL
+// terminated). A pair that is gone sends "DELETED", "EXPIRED" or "EVICTED"
+// as its value, and ends the subscription.
+#define NOTIF_HEADER_SIZE (MAX_KEY_SIZE + 4)
+
+// Over a unix socket (a server started with -t unix), a client opens one
+// connection, which carries its requests and responses as the FIFOs would.
+// It registers by sending OP_CODE_CONNECT and its id, NUL padded to
+// MAX_KEY_SIZE bytes, with the write end of a pipe for its notifications as
+// SCM_RIGHTS.
+// A client on the same machine may send OP_CODE_CONNECT_SHM instead, with the
+// memfd of its rings (shm_create) in place of the pipe; its requests,
+// responses and notifications then go through the rings.
+#define UNIX_HELLO_SIZE (1 + MAX_KEY_SIZE)
+
+// Over TCP (a server started with -t tcp), a client registers on a first
+// connection with the same hello, passing no descriptor, and the server
+// answers with OP_CODE_CONNECT, '0' and a token of TCP_TOKEN_SIZE bytes. The
+// client then opens a second connection, for its notifications, and sends
+// OP_CODE_CONNECT_NOTIF and the token, NUL padded to a hello. Both must come
+// within a second of the first connection.
+#define TCP_TOKEN_SIZE 16
+
+// A session pool (src/client/pool.c) lends a session by sending one byte
+// over its socket with the request, response and notification FIFOs of the
+// session, in this order, as SCM_RIGHTS. The session is given back when the
+// connection closes.
+#define POOL_SESSION_FDS 3
+
 #endif  // COMMON_PROTOCOL_H
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE  // memfd_create(), F_ADD_SEALS, syscall()
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAX_FDS 65536  // Descriptors that may name a ring
+#define SHM_SPINS 4096     // Looks at a ring before sleeping, with more than one CPU
+#define SHM_WAIT_MS 100    // Sleep between checks that the peer is still there
+#define CACHE_LINE 64
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+// A ring in shared memory. The writer owns head and the reader owns tail,
+// each on a cache line of its own; both count bytes and wrap around.
+typedef struct ShmRing {
+  uint32_t head;  // Bytes written, the futex the reader sleeps on
+  uint32_t reader_sleeping;
+  uint32_t writer_closed;
+  char head_pad[CACHE_LINE - 3 * sizeof(uint32_t)];
+  uint32_t tail;  // Bytes read, the futex the writer sleeps on while full
+  uint32_t writer_sleeping;
+  uint32_t reader_closed;
+  char tail_pad[CACHE_LINE - 3 * sizeof(uint32_t)];
+  char data[SHM_RING_SIZE];
+} ShmRing;
+
+typedef struct ShmRegion {
+  ShmRing rings[SHM_RINGS];
+} ShmRegion;
+
+// A region mapped in this process, unmapped with the last of its channels.
+typedef struct ShmMapping {
+  ShmRegion *region;
+  int channels;
+} ShmMapping;
+
+// The end of a ring this side has.
+typedef struct ShmChannel {
+  ShmRing *ring;
+  ShmMapping *mapping;
+  int writer;  // 1 if this side writes the ring
+  int users;   // Its descriptor, and the calls using it
+  pthread_mutex_t lock;  // Writers of this process take turns
+} ShmChannel;
+
+// Channels by descriptor. The lock is only taken for descriptors that name
+// a ring, so that one is not freed as a call starts using it.
+static ShmChannel *channels[SHM_MAX_FDS];
+static pthread_rwlock_t channels_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int spins = 0;
+
+int shm_create(void) {
+  int fd = memfd_create("kvs-session", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1) {
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(ShmRegion)) == -1 || fcntl(fd, F_ADD_SEALS, SHM_SEALS) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int shm_attach(int memfd, int side, const int fds[SHM_RINGS]) {
+  // A peer that could shrink the memfd would make this side fault on it
+  struct stat st;
+  int seals = fcntl(memfd, F_GET_SEALS);
+  if (fstat(memfd, &st) == -1 || st.st_size != (off_t)sizeof(ShmRegion) || seals == -1 ||
+      (seals & SHM_SEALS) != SHM_SEALS) {
+    return 1;
+  }
+  for (int i = 0; i < SHM_RINGS; i++) {
+    if (fds[i] < 0 || fds[i] >= SHM_MAX_FDS || shm_is_channel(fds[i])) {
+      return 1;
+    }
+  }
+
+  ShmMapping *mapping = malloc(sizeof(ShmMapping));
+  void *region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  ShmChannel *ends[SHM_RINGS];
+  int made = 0;
+  while (made < SHM_RINGS && (ends[made] = malloc(sizeof(ShmChannel))) != NULL) {
+    made++;
+  }
+  if (mapping == NULL || region == MAP_FAILED || made < SHM_RINGS) {
+    while (made > 0) {
+      free(ends[--made]);
+    }
+    if (region != MAP_FAILED) {
+      munmap(region, sizeof(ShmRegion));
+    }
+    free(mapping);
+    return 1;
+  }
+  mapping->region = region;
+  mapping->channels = SHM_RINGS;
+
+  // Spinning only helps if the peer runs meanwhile
+  __atomic_store_n(&spins, sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPINS : 0, __ATOMIC_RELAXED);
+  pthread_rwlock_wrlock(&channels_lock);
+  for (int i = 0; i < SHM_RINGS; i++) {
+    ends[i]->ring = &mapping->region->rings[i];
+    ends[i]->mapping = mapping;
+    // The client writes the requests, the server the rest
+    ends[i]->writer = (i == SHM_REQUESTS) == (side == SHM_CLIENT);
+    ends[i]->users = 1;
+    pthread_mutex_init(&ends[i]->lock, NULL);
+    __atomic_store_n(&channels[fds[i]], ends[i], __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&channels_lock);
+  return 0;
+}
+
+int shm_is_channel(int fd) {
+  return fd >= 0 && fd < SHM_MAX_FDS && __atomic_load_n(&channels[fd], __ATOMIC_ACQUIRE) != NULL;
+}
+
+static ShmChannel *get_channel(int fd) {
+  if (!shm_is_channel(fd)) {
+    return NULL;
+  }
+  pthread_rwlock_rdlock(&channels_lock);
+  ShmChannel *channel = channels[fd];
+  if (channel != NULL) {
+    __atomic_add_fetch(&channel->users, 1, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&channels_lock);
+  return channel;
+}
+
+static void put_channel(ShmChannel *channel) {
+  if (__atomic_sub_fetch(&channel->users, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  ShmMapping *mapping = channel->mapping;
+  if (__atomic_sub_fetch(&mapping->channels, 1, __ATOMIC_ACQ_REL) == 0) {
+    munmap(mapping->region, sizeof(ShmRegion));
+    free(mapping);
+  }
+  pthread_mutex_destroy(&channel->lock);
+  free(channel);
+}
+
+static void release_channel(void *channel) {
+  put_channel(channel);
+}
+
+static void futex_wake(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Whether the peer closed its end of the connection, or exited.
+static int peer_gone(int fd) {
+  char byte;
+  ssize_t got = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return got == 0 || (got == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Sleeps while *word is still seen, telling the peer through sleeping.
+// @param cancellable Whether pthread_cancel may end the sleep; a reader holds
+//                    no lock, so it is cancelled as it would be in read().
+// @return 1 if the peer is gone, 0 to look at the ring again.
+static int sleep_on(int fd, uint32_t *word, uint32_t seen, uint32_t *sleeping, int cancellable) {
+  int gone = 0;
+  __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen) {
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = SHM_WAIT_MS * 1000000L};
+    int type;
+    if (cancellable) {
+      pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &type);
+    }
+    long result = syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    if (cancellable) {
+      pthread_setcanceltype(type, NULL);
+    }
+    gone = result == -1 && errno == ETIMEDOUT && peer_gone(fd);
+  }
+  __atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+  return gone;
+}
+
+static ssize_t ring_read(int fd, ShmRing *ring, char *buffer, size_t size) {
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint32_t head;
+  int spun = 0;
+  while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail) {
+    if (__atomic_load_n(&ring->writer_closed, __ATOMIC_ACQUIRE)) {
+      if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        return 0;
+      }
+    } else if (spun < __atomic_load_n(&spins, __ATOMIC_RELAXED)) {
+      spun++;
+      cpu_relax();
+    } else if (sleep_on(fd, &ring->head, tail, &ring->reader_sleeping, 1)) {
+      return 0;
+    }
+  }
+  uint32_t used = head - tail;
+  if (used > SHM_RING_SIZE) {
+    errno = EPROTO;  // The peer broke the ring
+    return -1;
+  }
+
+  size_t n = used < size ? used : size;
+  size_t offset = tail & (SHM_RING_SIZE - 1);
+  size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+  memcpy(buffer, ring->data + offset, first);
+  memcpy(buffer + first, ring->data, n - first);
+  __atomic_store_n(&ring->tail, tail + (uint32_t)n, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->writer_sleeping, __ATOMIC_SEQ_CST)) {
+    futex_wake(&ring->tail);
+  }
+  return (ssize_t)n;
+}
+
+static ssize_t ring_write(int fd, ShmRing *ring, const char *buffer, size_t size) {
+  size_t written = 0;
+  int spun = 0;
+  while (written < size) {
+    if (__atomic_load_n(&ring->reader_closed, __ATOMIC_ACQUIRE)) {
+      errno = EPIPE;
+      return -1;
+    }
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t used = head - tail;
+    if (used > SHM_RING_SIZE) {
+      errno = EPROTO;
+      return -1;
+    }
+    if (used == SHM_RING_SIZE) {
+      if (spun < __atomic_load_n(&spins, __ATOMIC_RELAXED)) {
+        spun++;
+        cpu_relax();
+      } else if (sleep_on(fd, &ring->tail, tail, &ring->writer_sleeping, 0)) {
+        errno = EPIPE;
+        return -1;
+      }
+      continue;
+    }
+
+    size_t n = SHM_RING_SIZE - used < size - written ? SHM_RING_SIZE - used : size - written;
+    size_t offset = head & (SHM_RING_SIZE - 1);
+    size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, buffer + written, first);
+    memcpy(ring->data, buffer + written + first, n - first);
+    __atomic_store_n(&ring->head, head + (uint32_t)n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->reader_sleeping, __ATOMIC_SEQ_CST)) {
+      futex_wake(&ring->head);
+    }
+    written += n;
+    spun = 0;
+  }
+  return (ssize_t)size;
+}
+
+ssize_t shm_read(int fd, void *buffer, size_t size) {
+  ShmChannel *channel = get_channel(fd);
+  if (channel == NULL) {
+    return read(fd, buffer, size);
+  }
+  ssize_t result;
+  if (channel->writer) {
+    errno = EBADF;
+    result = -1;
+  } else {
+    // A reader cancelled while it sleeps lets go of the channel
+    pthread_cleanup_push(release_channel, channel);
+    result = ring_read(fd, channel->ring, buffer, size);
+    pthread_cleanup_pop(0);
+  }
+  put_channel(channel);
+  return result;
+}
+
+ssize_t shm_write(int fd, const void *buffer, size_t size) {
+  ShmChannel *channel = get_channel(fd);
+  if (channel == NULL) {
+    return write(fd, buffer, size);
+  }
+  ssize_t result;
+  if (!channel->writer) {
+    errno = EBADF;
+    result = -1;
+  } else {
+    // Each write goes in whole, so messages are never interleaved
+    pthread_mutex_lock(&channel->lock);
+    result = ring_write(fd, channel->ring, buffer, size);
+    pthread_mutex_unlock(&channel->lock);
+  }
+  put_channel(channel);
+  return result;
+}
+
+int shm_close(int fd) {
+  ShmChannel *channel = NULL;
+  if (shm_is_channel(fd)) {
+    pthread_rwlock_wrlock(&channels_lock);
+    channel = channels[fd];
+    __atomic_store_n(&channels[fd], NULL, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&channels_lock);
+  }
+  if (channel != NULL) {
+    ShmRing *ring = channel->ring;
+    __atomic_store_n(channel->writer ? &ring->writer_closed : &ring->reader_closed, 1,
+                     __ATOMIC_SEQ_CST);
+    // Whoever sleeps on the ring looks at it again
+    futex_wake(&ring->head);
+    futex_wake(&ring->tail);
+    put_channel(channel);
+  }
+  return close(fd);
+}
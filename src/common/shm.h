@@ -0,0 +1,59 @@
+#ifndef COMMON_SHM_H
+#define COMMON_SHM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Shared-memory channels for clients on the same machine as the server. The
+// client makes a memfd holding three rings, for its requests, the responses
+// and its notifications, and passes it over the unix socket it connects with
+// (see OP_CODE_CONNECT_SHM). Each side then names its end of every ring with a
+// descriptor of that socket, so read_all and write_all go through the rings
+// like they would through FIFOs, with no system call while the other side is
+// awake: a side that finds its ring empty (or full) spins for a while, then
+// sleeps on a futex, and is only woken if it sleeps. The socket tells either
+// side when the other is gone.
+#define SHM_RING_SIZE (64 * 1024)  // Bytes of each ring, a power of 2
+
+#define SHM_CLIENT 0
+#define SHM_SERVER 1
+
+// Rings of a session, by the descriptor that names them on each side
+#define SHM_REQUESTS 0
+#define SHM_RESPONSES 1
+#define SHM_NOTIFICATIONS 2
+#define SHM_RINGS 3
+
+/// Makes a memfd with the rings of a session, sealed at its size.
+/// @return The memfd, -1 if it failed.
+int shm_create(void);
+
+/// Maps the rings of a memfd and names their ends on this side. The memfd may
+/// be closed afterwards.
+/// @param memfd The memfd, from shm_create (checked if it came from a peer).
+/// @param side SHM_CLIENT or SHM_SERVER.
+/// @param fds Descriptors of the connection with the peer, one per ring
+///            (by SHM_REQUESTS, SHM_RESPONSES and SHM_NOTIFICATIONS), all
+///            different.
+/// @return 0 if successful, 1 otherwise.
+int shm_attach(int memfd, int side, const int fds[SHM_RINGS]);
+
+/// Whether a descriptor names the end of a ring.
+int shm_is_channel(int fd);
+
+/// Reads from a descriptor, through its ring if it names one, blocking until
+/// there is something to read.
+/// @return Bytes read, 0 at the end (the peer closed the ring or is gone), -1
+///         on error.
+ssize_t shm_read(int fd, void *buffer, size_t size);
+
+/// Writes to a descriptor, all of it at once through its ring if it names
+/// one; writers of the same ring take turns.
+/// @return Bytes written, -1 on error (EPIPE if the peer is gone).
+ssize_t shm_write(int fd, const void *buffer, size_t size);
+
+/// Closes a descriptor, and its end of a ring if it names one.
+/// @return 0 if successful, -1 otherwise.
+int shm_close(int fd);
+
+#endif  // COMMON_SHM_H
@@ -0,0 +1,531 @@
+#define _GNU_SOURCE  // syscall()
+#include "aio.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "src/common/io.h"
+
+#define AIO_RING_ENTRIES 16
+
+// A chunk of a file. While busy it belongs to the kernel.
+typedef struct AioBuf {
+  char *data;
+  size_t len;  // Bytes filled (output) or bytes read (input)
+  off_t off;   // Offset of data[0] in the file
+  int busy;
+  int res;  // Result of the last completed request
+} AioBuf;
+
+// One io_uring instance per thread, so no locking is needed around it.
+typedef struct AioRing {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+} AioRing;
+
+typedef struct AioFile {
+  int fd;
+  int mode;
+  AioRing *ring;  // NULL when the blocking engine is used
+  AioBuf bufs[AIO_WRITE_BUFFERS];
+  int cur;
+  size_t pos;  // Read position in the current input chunk
+  int ahead;   // 1 if the other input chunk holds (or is reading) the next data
+  int eof;
+} AioFile;
+
+static int engine = AIO_ENGINE_SYNC;
+static AioFile *aio_files[AIO_MAX_FILES];
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void ring_destroy(AioRing *ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  }
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_size);
+  }
+  if (ring->sq_ptr != NULL) {
+    munmap(ring->sq_ptr, ring->sq_size);
+  }
+  close(ring->fd);
+  free(ring);
+}
+
+static AioRing *ring_create() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = sys_io_uring_setup(AIO_RING_ENTRIES, &params);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  AioRing *ring = calloc(1, sizeof(AioRing));
+  if (ring == NULL) {
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->entries = params.sq_entries;
+
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) {
+      ring->sq_size = ring->cq_size;
+    }
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    ring_destroy(ring);
+    return NULL;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      ring_destroy(ring);
+      return NULL;
+    }
+  }
+
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    ring_destroy(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_ptr;
+  char *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *)(void *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(void *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(void *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(void *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(void *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+  return ring;
+}
+
+static void ring_key_destructor(void *ring) {
+  ring_destroy(ring);
+}
+
+static void ring_key_create() {
+  pthread_key_create(&ring_key, ring_key_destructor);
+}
+
+// Gets the ring of the calling thread, creating it on first use.
+static AioRing *thread_ring() {
+  pthread_once(&ring_key_once, ring_key_create);
+  AioRing *ring = pthread_getspecific(ring_key);
+  if (ring == NULL) {
+    ring = ring_create();
+    if (ring != NULL) {
+      pthread_setspecific(ring_key, ring);
+    }
+  }
+  return ring;
+}
+
+// Moves finished requests out of the completion queue, waiting for at least
+// min_complete of them.
+static int ring_reap(AioRing *ring, unsigned min_complete) {
+  if (min_complete > 0) {
+    while (sys_io_uring_enter(ring->fd, 0, min_complete, IORING_ENTER_GETEVENTS) == -1) {
+      if (errno != EINTR) {
+        return -1;
+      }
+    }
+  }
+
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    AioBuf *buf = (AioBuf *)(uintptr_t)cqe->user_data;
+    buf->res = cqe->res;
+    buf->busy = 0;
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int ring_submit(AioRing *ring, int fd, AioBuf *buf, unsigned char opcode, size_t len) {
+  unsigned tail = *ring->sq_tail;
+  while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+    if (ring_reap(ring, 1) != 0) {
+      return -1;
+    }
+  }
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->off = (uint64_t)buf->off;
+  sqe->addr = (uint64_t)(uintptr_t)buf->data;
+  sqe->len = (unsigned)len;
+  sqe->user_data = (uint64_t)(uintptr_t)buf;
+  ring->sq_array[index] = index;
+  buf->busy = 1;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  // Once the tail moved the entry belongs to the kernel, so only give up if
+  // the ring itself is broken
+  while (sys_io_uring_enter(ring->fd, 1, 0, 0) == -1) {
+    if (errno == EAGAIN || errno == EBUSY) {
+      if (ring_reap(ring, 1) != 0) {
+        return -1;
+      }
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int wait_buf(AioRing *ring, AioBuf *buf) {
+  while (buf->busy) {
+    if (ring_reap(ring, 1) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int aio_set_engine(const char *name) {
+  if (strcmp(name, "sync") == 0) {
+    engine = AIO_ENGINE_SYNC;
+    return 0;
+  }
+
+  if (strcmp(name, "uring") != 0) {
+    return 1;
+  }
+
+  // Probe once, so a kernel without io_uring falls back right away
+  AioRing *ring = ring_create();
+  if (ring == NULL) {
+    fprintf(stderr, "io_uring is not available, using blocking I/O\n");
+    engine = AIO_ENGINE_SYNC;
+    return 0;
+  }
+  ring_destroy(ring);
+  engine = AIO_ENGINE_URING;
+  return 0;
+}
+
+int aio_get_engine() {
+  return engine;
+}
+
+static AioFile *get_file(int fd) {
+  if (fd < 0 || fd >= AIO_MAX_FILES) {
+    return NULL;
+  }
+  return aio_files[fd];
+}
+
+static void free_file(AioFile *file) {
+  for (int i = 0; i < AIO_WRITE_BUFFERS; i++) {
+    free(file->bufs[i].data);
+  }
+  free(file);
+}
+
+// Starts reading the chunk that follows buf into the other input buffer.
+static void read_ahead(AioFile *file, AioBuf *buf) {
+  AioBuf *next = &file->bufs[file->cur ^ 1];
+  next->off = buf->off + (off_t)buf->len;
+  next->len = 0;
+  if (ring_submit(file->ring, file->fd, next, IORING_OP_READ, AIO_CHUNK_SIZE) != 0) {
+    ssize_t result = pread(file->fd, next->data, AIO_CHUNK_SIZE, next->off);
+    next->res = result < 0 ? -1 : (int)result;
+  }
+  file->ahead = 1;
+}
+
+int aio_open(int fd, int mode) {
+  if (fd < 0 || fd >= AIO_MAX_FILES) {
+    return 1;
+  }
+
+  AioFile *file = calloc(1, sizeof(AioFile));
+  if (file == NULL) {
+    return 1;
+  }
+  file->fd = fd;
+  file->mode = mode;
+
+  int buffers = mode == AIO_INPUT ? 2 : AIO_WRITE_BUFFERS;
+  for (int i = 0; i < buffers; i++) {
+    file->bufs[i].data = malloc(AIO_CHUNK_SIZE);
+    if (file->bufs[i].data == NULL) {
+      free_file(file);
+      return 1;
+    }
+  }
+
+  if (engine == AIO_ENGINE_URING) {
+    file->ring = thread_ring();
+  }
+
+  if (mode == AIO_INPUT && file->ring != NULL) {
+    // Pretend an empty chunk ends at offset 0 so the first one is read ahead
+    file->cur = 1;
+    read_ahead(file, &file->bufs[1]);
+  }
+
+  aio_files[fd] = file;
+  return 0;
+}
+
+// Makes the next input chunk current.
+// @return 1 if there is data, 0 on end of file, -1 on error.
+static int next_chunk(AioFile *file) {
+  AioBuf *buf;
+
+  if (file->ring == NULL) {
+    buf = &file->bufs[0];
+    ssize_t result;
+    while ((result = read(file->fd, buf->data, AIO_CHUNK_SIZE)) == -1 && errno == EINTR)
+      ;
+    if (result <= 0) {
+      return (int)result;
+    }
+    buf->len = (size_t)result;
+    file->pos = 0;
+    return 1;
+  }
+
+  if (!file->ahead) {
+    return 0;
+  }
+
+  buf = &file->bufs[file->cur ^ 1];
+  if (wait_buf(file->ring, buf) != 0) {
+    return -1;
+  }
+
+  if (buf->res < 0) {
+    // Not supported by this kernel or failed: finish the file synchronously
+    ssize_t result = pread(file->fd, buf->data, AIO_CHUNK_SIZE, buf->off);
+    if (result < 0) {
+      return -1;
+    }
+    buf->res = (int)result;
+  }
+
+  file->ahead = 0;
+  if (buf->res == 0) {
+    return 0;
+  }
+
+  buf->len = (size_t)buf->res;
+  file->cur ^= 1;
+  file->pos = 0;
+  read_ahead(file, buf);
+  return 1;
+}
+
+ssize_t aio_read(int fd, void *buffer, size_t size) {
+  AioFile *file = get_file(fd);
+  if (file == NULL || file->mode != AIO_INPUT) {
+    return read(fd, buffer, size);
+  }
+
+  size_t copied = 0;
+  while (copied < size && !file->eof) {
+    AioBuf *buf = &file->bufs[file->cur];
+    if (file->pos == buf->len) {
+      int result = next_chunk(file);
+      if (result < 0) {
+        return copied > 0 ? (ssize_t)copied : -1;
+      }
+      if (result == 0) {
+        file->eof = 1;
+        break;
+      }
+      continue;
+    }
+
+    size_t count = buf->len - file->pos;
+    if (count > size - copied) {
+      count = size - copied;
+    }
+    memcpy((char *)buffer + copied, buf->data + file->pos, count);
+    file->pos += count;
+    copied += count;
+  }
+
+  return (ssize_t)copied;
+}
+
+// Checks that a finished write reached the file, writing whatever the kernel
+// left out synchronously.
+static int complete_write(AioFile *file, AioBuf *buf) {
+  if (buf->res < 0) {
+    fprintf(stderr, "Failed to write to output file\n");
+    return -1;
+  }
+
+  size_t written = (size_t)buf->res;
+  while (written < buf->len) {
+    ssize_t result = pwrite(file->fd, buf->data + written, buf->len - written,
+                            buf->off + (off_t)written);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to write to output file\n");
+      return -1;
+    }
+    written += (size_t)result;
+  }
+  buf->len = 0;
+  return 0;
+}
+
+// Hands the current output chunk to the kernel and moves to the next one.
+static int submit_chunk(AioFile *file) {
+  AioBuf *buf = &file->bufs[file->cur];
+  if (buf->len == 0) {
+    return 0;
+  }
+
+  if (file->ring == NULL) {
+    int result = write_all(file->fd, buf->data, buf->len);
+    buf->len = 0;
+    return result == -1 ? -1 : 0;
+  }
+
+  // Offsets are explicit, so chunks may complete in any order
+  off_t next_off = buf->off + (off_t)buf->len;
+  if (ring_submit(file->ring, file->fd, buf, IORING_OP_WRITE, buf->len) != 0) {
+    buf->res = 0;
+    if (complete_write(file, buf) != 0) {
+      return -1;
+    }
+  }
+
+  file->cur = (file->cur + 1) % AIO_WRITE_BUFFERS;
+  AioBuf *next = &file->bufs[file->cur];
+  if (wait_buf(file->ring, next) != 0) {
+    return -1;
+  }
+  if (next->len > 0 && complete_write(file, next) != 0) {
+    return -1;
+  }
+  next->off = next_off;
+  return 0;
+}
+
+int aio_write(int fd, const void *buffer, size_t size) {
+  AioFile *file = get_file(fd);
+  if (file == NULL || file->mode != AIO_OUTPUT) {
+    return write_all(fd, buffer, size) == -1 ? -1 : 0;
+  }
+
+  const char *data = buffer;
+  while (size > 0) {
+    AioBuf *buf = &file->bufs[file->cur];
+    size_t count = AIO_CHUNK_SIZE - buf->len;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(buf->data + buf->len, data, count);
+    buf->len += count;
+    data += count;
+    size -= count;
+
+    if (buf->len == AIO_CHUNK_SIZE && submit_chunk(file) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int aio_flush(int fd) {
+  AioFile *file = get_file(fd);
+  if (file == NULL || file->mode != AIO_OUTPUT) {
+    return 0;
+  }
+
+  int result = submit_chunk(file);
+  if (file->ring == NULL) {
+    return result;
+  }
+
+  for (int i = 0; i < AIO_WRITE_BUFFERS; i++) {
+    AioBuf *buf = &file->bufs[i];
+    if (i == file->cur) {
+      continue;
+    }
+    if (wait_buf(file->ring, buf) != 0) {
+      return -1;
+    }
+    if (buf->len > 0 && complete_write(file, buf) != 0) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+int aio_close(int fd) {
+  AioFile *file = get_file(fd);
+  if (file == NULL) {
+    return 0;
+  }
+
+  int result = 0;
+  if (file->mode == AIO_OUTPUT) {
+    result = aio_flush(fd);
+  } else if (file->ring != NULL && file->ahead) {
+    // The kernel may still be filling the read-ahead chunk
+    wait_buf(file->ring, &file->bufs[file->cur ^ 1]);
+  }
+
+  aio_files[fd] = NULL;
+  free_file(file);
+  return result;
+}
@@ -0,0 +1,54 @@
+#ifndef KVS_AIO_H
+#define KVS_AIO_H
+
+#include <sys/types.h>
+
+// I/O engine used for job (.job) and output (.out) files. Both engines read
+// and write in AIO_CHUNK_SIZE chunks; the io_uring engine also reads the next
+// chunk ahead and keeps output chunks in flight while the job keeps running.
+#define AIO_ENGINE_SYNC 0
+#define AIO_ENGINE_URING 1
+
+#define AIO_INPUT 0
+#define AIO_OUTPUT 1
+
+#define AIO_CHUNK_SIZE 65536
+#define AIO_WRITE_BUFFERS 4
+#define AIO_MAX_FILES 1024
+
+/// Selects the I/O engine by name ("sync" or "uring"). If io_uring is not
+/// available on this system the blocking engine is used instead.
+/// @param name Name of the engine.
+/// @return 0 if the name is valid, 1 otherwise.
+int aio_set_engine(const char *name);
+
+/// Gets the engine in use.
+/// @return AIO_ENGINE_SYNC or AIO_ENGINE_URING.
+int aio_get_engine();
+
+/// Starts buffering a file descriptor. Unregistered descriptors are read and
+/// written directly.
+/// @param fd File descriptor (positioned at offset 0).
+/// @param mode AIO_INPUT or AIO_OUTPUT.
+/// @return 0 if successful, 1 otherwise.
+int aio_open(int fd, int mode);
+
+/// Reads from a file descriptor, blocking until size bytes or the end of the
+/// file were reached.
+/// @return Number of bytes read, 0 on end of file, -1 on error.
+ssize_t aio_read(int fd, void *buffer, size_t size);
+
+/// Writes to a file descriptor. Writes to an output registered with aio_open
+/// are queued and may complete after the call returns.
+/// @return 0 if successful, -1 otherwise.
+int aio_write(int fd, const void *buffer, size_t size);
+
+/// Waits until every write queued on fd has reached the file.
+/// @return 0 if successful, -1 otherwise.
+int aio_flush(int fd);
+
+/// Flushes and stops buffering a file descriptor. Does not close it.
+/// @return 0 if successful, -1 otherwise.
+int aio_close(int fd);
+
+#endif  // KVS_AIO_H
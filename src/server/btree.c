@@ -0,0 +1,345 @@
+#include "btree.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LEAF(node) ((BTreeLeaf *)(void *)(node))
+#define INNER(node) ((BTreeInner *)(void *)(node))
+
+// Index of the first key of a leaf that is not smaller than key.
+static int lower_bound(const BTreeLeaf *leaf, const char *key) {
+  int low = 0, high = leaf->header.count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (strcmp(leaf->keys[mid], key) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Child of an inner node that may hold key: keys equal to a separator are
+// on its right.
+static int child_index(const BTreeInner *inner, const char *key) {
+  int low = 0, high = inner->header.count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (strcmp(inner->keys[mid], key) <= 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+int btree_init(BTree *tree) {
+  memset(tree, 0, sizeof(BTree));
+  BTreeLeaf *root = calloc(1, sizeof(BTreeLeaf));
+  if (root == NULL) {
+    return 1;
+  }
+  root->header.leaf = 1;
+  tree->root = &root->header;
+  return 0;
+}
+
+// Makes sure an insertion has every node it may need: one leaf, one inner
+// node per level and one more for a new root.
+static int reserve_nodes(BTree *tree) {
+  if (tree->spare_leaf == NULL) {
+    tree->spare_leaf = malloc(sizeof(BTreeLeaf));
+    if (tree->spare_leaf == NULL) {
+      return 1;
+    }
+  }
+  while (tree->num_spare_inners < tree->height + 1) {
+    BTreeInner *inner = malloc(sizeof(BTreeInner));
+    if (inner == NULL) {
+      return 1;
+    }
+    inner->children[0] = tree->spare_inners == NULL ? NULL : &tree->spare_inners->header;
+    tree->spare_inners = inner;
+    tree->num_spare_inners++;
+  }
+  return 0;
+}
+
+static BTreeNode *take_node(BTree *tree, int leaf) {
+  BTreeNode *node;
+  if (leaf) {
+    BTreeLeaf *spare = tree->spare_leaf;
+    tree->spare_leaf = NULL;
+    memset(spare, 0, sizeof(BTreeLeaf));
+    node = &spare->header;
+  } else {
+    BTreeInner *spare = tree->spare_inners;
+    tree->spare_inners = INNER(spare->children[0]);
+    tree->num_spare_inners--;
+    memset(spare, 0, sizeof(BTreeInner));
+    node = &spare->header;
+  }
+  node->leaf = leaf;
+  return node;
+}
+
+// Splits the overflowing child i of parent in two.
+static void split_child(BTree *tree, BTreeInner *parent, int i) {
+  BTreeNode *child = parent->children[i];
+  BTreeNode *right = take_node(tree, child->leaf);
+  int mid = child->count / 2;
+  int pcount = parent->header.count;
+
+  memmove(parent->keys[i + 1], parent->keys[i], (size_t)(pcount - i) * BTREE_KEY_SIZE);
+  memmove(parent->children + i + 2, parent->children + i + 1,
+          (size_t)(pcount - i) * sizeof(BTreeNode *));
+  parent->children[i + 1] = right;
+  parent->header.count++;
+
+  if (child->leaf) {
+    BTreeLeaf *left_leaf = LEAF(child), *right_leaf = LEAF(right);
+    right->count = child->count - mid;
+    memcpy(right_leaf->keys, left_leaf->keys + mid, (size_t)right->count * sizeof(char *));
+    memcpy(right_leaf->values, left_leaf->values + mid, (size_t)right->count * sizeof(void *));
+    right_leaf->next = left_leaf->next;
+    left_leaf->next = right_leaf;
+    child->count = mid;
+    strcpy(parent->keys[i], right_leaf->keys[0]);
+  } else {
+    // The middle key moves up
+    BTreeInner *left_inner = INNER(child), *right_inner = INNER(right);
+    right->count = child->count - mid - 1;
+    memcpy(right_inner->keys, left_inner->keys[mid + 1], (size_t)right->count * BTREE_KEY_SIZE);
+    memcpy(right_inner->children, left_inner->children + mid + 1,
+           (size_t)(right->count + 1) * sizeof(BTreeNode *));
+    child->count = mid;
+    strcpy(parent->keys[i], left_inner->keys[mid]);
+  }
+}
+
+// @return 1 if the key was added, 0 if its value was replaced.
+static int insert_rec(BTree *tree, BTreeNode *node, const char *key, void *value) {
+  if (node->leaf) {
+    BTreeLeaf *leaf = LEAF(node);
+    int pos = lower_bound(leaf, key);
+    if (pos < node->count && strcmp(leaf->keys[pos], key) == 0) {
+      leaf->keys[pos] = key;
+      leaf->values[pos] = value;
+      return 0;
+    }
+    memmove(leaf->keys + pos + 1, leaf->keys + pos, (size_t)(node->count - pos) * sizeof(char *));
+    memmove(leaf->values + pos + 1, leaf->values + pos,
+            (size_t)(node->count - pos) * sizeof(void *));
+    leaf->keys[pos] = key;
+    leaf->values[pos] = value;
+    node->count++;
+    return 1;
+  }
+
+  BTreeInner *inner = INNER(node);
+  int i = child_index(inner, key);
+  int result = insert_rec(tree, inner->children[i], key, value);
+  if (inner->children[i]->count > BTREE_MAX_KEYS) {
+    split_child(tree, inner, i);
+  }
+  return result;
+}
+
+int btree_insert(BTree *tree, const char *key, void *value) {
+  if (strlen(key) >= BTREE_KEY_SIZE || reserve_nodes(tree) != 0) {
+    return 1;
+  }
+
+  if (insert_rec(tree, tree->root, key, value) == 1) {
+    tree->size++;
+  }
+
+  if (tree->root->count > BTREE_MAX_KEYS) {
+    BTreeInner *root = INNER(take_node(tree, 0));
+    root->children[0] = tree->root;
+    split_child(tree, root, 0);
+    tree->root = &root->header;
+    tree->height++;
+  }
+  return 0;
+}
+
+// Moves the last entry of the left sibling to the front of child i.
+static void borrow_left(BTreeInner *parent, int i) {
+  BTreeNode *child = parent->children[i];
+  BTreeNode *left = parent->children[i - 1];
+
+  if (child->leaf) {
+    BTreeLeaf *child_leaf = LEAF(child), *left_leaf = LEAF(left);
+    memmove(child_leaf->keys + 1, child_leaf->keys, (size_t)child->count * sizeof(char *));
+    memmove(child_leaf->values + 1, child_leaf->values, (size_t)child->count * sizeof(void *));
+    child_leaf->keys[0] = left_leaf->keys[left->count - 1];
+    child_leaf->values[0] = left_leaf->values[left->count - 1];
+    strcpy(parent->keys[i - 1], child_leaf->keys[0]);
+  } else {
+    BTreeInner *child_inner = INNER(child), *left_inner = INNER(left);
+    memmove(child_inner->keys[1], child_inner->keys[0], (size_t)child->count * BTREE_KEY_SIZE);
+    memmove(child_inner->children + 1, child_inner->children,
+            (size_t)(child->count + 1) * sizeof(BTreeNode *));
+    strcpy(child_inner->keys[0], parent->keys[i - 1]);
+    child_inner->children[0] = left_inner->children[left->count];
+    strcpy(parent->keys[i - 1], left_inner->keys[left->count - 1]);
+  }
+  child->count++;
+  left->count--;
+}
+
+// Moves the first entry of the right sibling to the end of child i.
+static void borrow_right(BTreeInner *parent, int i) {
+  BTreeNode *child = parent->children[i];
+  BTreeNode *right = parent->children[i + 1];
+
+  if (child->leaf) {
+    BTreeLeaf *child_leaf = LEAF(child), *right_leaf = LEAF(right);
+    child_leaf->keys[child->count] = right_leaf->keys[0];
+    child_leaf->values[child->count] = right_leaf->values[0];
+    memmove(right_leaf->keys, right_leaf->keys + 1, (size_t)(right->count - 1) * sizeof(char *));
+    memmove(right_leaf->values, right_leaf->values + 1,
+            (size_t)(right->count - 1) * sizeof(void *));
+    strcpy(parent->keys[i], right_leaf->keys[0]);
+  } else {
+    BTreeInner *child_inner = INNER(child), *right_inner = INNER(right);
+    strcpy(child_inner->keys[child->count], parent->keys[i]);
+    child_inner->children[child->count + 1] = right_inner->children[0];
+    strcpy(parent->keys[i], right_inner->keys[0]);
+    memmove(right_inner->keys[0], right_inner->keys[1], (size_t)(right->count - 1) * BTREE_KEY_SIZE);
+    memmove(right_inner->children, right_inner->children + 1,
+            (size_t)right->count * sizeof(BTreeNode *));
+  }
+  child->count++;
+  right->count--;
+}
+
+// Merges child i + 1 into child i and removes the separator between them.
+static void merge(BTreeInner *parent, int i) {
+  BTreeNode *left = parent->children[i];
+  BTreeNode *right = parent->children[i + 1];
+
+  if (left->leaf) {
+    BTreeLeaf *left_leaf = LEAF(left), *right_leaf = LEAF(right);
+    memcpy(left_leaf->keys + left->count, right_leaf->keys, (size_t)right->count * sizeof(char *));
+    memcpy(left_leaf->values + left->count, right_leaf->values,
+           (size_t)right->count * sizeof(void *));
+    left->count += right->count;
+    left_leaf->next = right_leaf->next;
+  } else {
+    BTreeInner *left_inner = INNER(left), *right_inner = INNER(right);
+    strcpy(left_inner->keys[left->count], parent->keys[i]);
+    memcpy(left_inner->keys[left->count + 1], right_inner->keys[0],
+           (size_t)right->count * BTREE_KEY_SIZE);
+    memcpy(left_inner->children + left->count + 1, right_inner->children,
+           (size_t)(right->count + 1) * sizeof(BTreeNode *));
+    left->count += right->count + 1;
+  }
+  free(right);
+
+  int pcount = parent->header.count;
+  memmove(parent->keys[i], parent->keys[i + 1], (size_t)(pcount - i - 1) * BTREE_KEY_SIZE);
+  memmove(parent->children + i + 1, parent->children + i + 2,
+          (size_t)(pcount - i - 1) * sizeof(BTreeNode *));
+  parent->header.count--;
+}
+
+static void rebalance(BTreeInner *parent, int i) {
+  if (i > 0 && parent->children[i - 1]->count > BTREE_MIN_KEYS) {
+    borrow_left(parent, i);
+  } else if (i < parent->header.count && parent->children[i + 1]->count > BTREE_MIN_KEYS) {
+    borrow_right(parent, i);
+  } else if (i > 0) {
+    merge(parent, i - 1);
+  } else {
+    merge(parent, i);
+  }
+}
+
+static int delete_rec(BTreeNode *node, const char *key) {
+  if (node->leaf) {
+    BTreeLeaf *leaf = LEAF(node);
+    int pos = lower_bound(leaf, key);
+    if (pos == node->count || strcmp(leaf->keys[pos], key) != 0) {
+      return 1;
+    }
+    memmove(leaf->keys + pos, leaf->keys + pos + 1, (size_t)(node->count - pos - 1) * sizeof(char *));
+    memmove(leaf->values + pos, leaf->values + pos + 1,
+            (size_t)(node->count - pos - 1) * sizeof(void *));
+    node->count--;
+    return 0;
+  }
+
+  BTreeInner *inner = INNER(node);
+  int i = child_index(inner, key);
+  if (delete_rec(inner->children[i], key) != 0) {
+    return 1;
+  }
+  if (inner->children[i]->count < BTREE_MIN_KEYS) {
+    rebalance(inner, i);
+  }
+  return 0;
+}
+
+int btree_delete(BTree *tree, const char *key) {
+  if (delete_rec(tree->root, key) != 0) {
+    return 1;
+  }
+  tree->size--;
+
+  if (!tree->root->leaf && tree->root->count == 0) {
+    BTreeNode *root = tree->root;
+    tree->root = INNER(root)->children[0];
+    tree->height--;
+    free(root);
+  }
+  return 0;
+}
+
+void btree_seek(BTree *tree, const char *key, BTreeIter *iter) {
+  BTreeNode *node = tree->root;
+  while (!node->leaf) {
+    node = INNER(node)->children[key == NULL ? 0 : child_index(INNER(node), key)];
+  }
+  iter->leaf = LEAF(node);
+  iter->index = key == NULL ? 0 : lower_bound(iter->leaf, key);
+}
+
+int btree_next(BTreeIter *iter, const char **key, void **value) {
+  while (iter->leaf != NULL && iter->index >= iter->leaf->header.count) {
+    iter->leaf = iter->leaf->next;
+    iter->index = 0;
+  }
+  if (iter->leaf == NULL) {
+    return 0;
+  }
+  *key = iter->leaf->keys[iter->index];
+  *value = iter->leaf->values[iter->index];
+  iter->index++;
+  return 1;
+}
+
+static void destroy_rec(BTreeNode *node) {
+  if (!node->leaf) {
+    for (int i = 0; i <= node->count; i++) {
+      destroy_rec(INNER(node)->children[i]);
+    }
+  }
+  free(node);
+}
+
+void btree_destroy(BTree *tree) {
+  if (tree->root != NULL) {
+    destroy_rec(tree->root);
+  }
+  free(tree->spare_leaf);
+  while (tree->spare_inners != NULL) {
+    BTreeInner *inner = tree->spare_inners;
+    tree->spare_inners = INNER(inner->children[0]);
+    free(inner);
+  }
+  memset(tree, 0, sizeof(BTree));
+}
@@ -0,0 +1,88 @@
+#ifndef KVS_BTREE_H
+#define KVS_BTREE_H
+
+#include <stddef.h>
+
+#include "src/common/constants.h"
+
+// B+-tree of string keys, used as the ordered index of the table.
+// Leaves hold the keys as given to btree_insert (they are not copied, so
+// they must outlive their entry) and are linked for in-order scans. Inner
+// nodes keep their own copies of the separators, so keys are limited to
+// BTREE_KEY_SIZE - 1 characters.
+#define BTREE_ORDER 32  // Maximum children of an inner node
+#define BTREE_MAX_KEYS (BTREE_ORDER - 1)
+#define BTREE_MIN_KEYS (BTREE_MAX_KEYS / 2)
+#define BTREE_KEY_SIZE MAX_KEY_SIZE
+
+typedef struct BTreeNode {
+  int leaf;
+  int count;  // Keys in the node
+} BTreeNode;
+
+// The arrays have a spare slot so a node can overflow before it is split.
+typedef struct BTreeLeaf {
+  BTreeNode header;
+  const char *keys[BTREE_ORDER];
+  void *values[BTREE_ORDER];
+  struct BTreeLeaf *next;
+} BTreeLeaf;
+
+typedef struct BTreeInner {
+  BTreeNode header;
+  char keys[BTREE_ORDER][BTREE_KEY_SIZE];
+  BTreeNode *children[BTREE_ORDER + 1];
+} BTreeInner;
+
+typedef struct BTree {
+  BTreeNode *root;
+  int height;  // Levels of inner nodes
+  size_t size;
+  // Nodes allocated ahead of an insertion, so it cannot fail halfway
+  BTreeLeaf *spare_leaf;
+  BTreeInner *spare_inners;  // Linked through children[0]
+  int num_spare_inners;
+} BTree;
+
+// Position in the leaves. Only valid until the tree is changed.
+typedef struct BTreeIter {
+  BTreeLeaf *leaf;
+  int index;
+} BTreeIter;
+
+/// Initializes an empty tree.
+/// @param tree The tree.
+/// @return 0 if successful, 1 otherwise.
+int btree_init(BTree *tree);
+
+/// Adds a key, or replaces its value if it is already in the tree.
+/// @param tree The tree.
+/// @param key The key. Must stay valid while it is in the tree.
+/// @param value The value.
+/// @return 0 if successful, 1 otherwise (the tree is left unchanged).
+int btree_insert(BTree *tree, const char *key, void *value);
+
+/// Removes a key.
+/// @param tree The tree.
+/// @param key The key.
+/// @return 0 if the key was removed, 1 if it was not in the tree.
+int btree_delete(BTree *tree, const char *key);
+
+/// Positions an iterator at the first key greater than or equal to key.
+/// @param tree The tree.
+/// @param key Lower bound, or NULL to start at the smallest key.
+/// @param iter The iterator.
+void btree_seek(BTree *tree, const char *key, BTreeIter *iter);
+
+/// Gets the entry at the iterator and advances it.
+/// @param iter The iterator.
+/// @param key Where to store the key.
+/// @param value Where to store the value.
+/// @return 1 if there was an entry, 0 at the end of the tree.
+int btree_next(BTreeIter *iter, const char **key, void **value);
+
+/// Frees the tree. Keys and values are not freed.
+/// @param tree The tree.
+void btree_destroy(BTree *tree);
+
+#endif  // KVS_BTREE_H
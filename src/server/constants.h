@@ -1,3 +1,7 @@
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
+#define SHOW_CHUNK_SIZE 65536 // Output bytes SHOW and RANGE produce per chunk
+#define GC_MIN_GARBAGE 1024 // Old versions kept at least before they are collected
+#define MAX_VALUE_SIZE (1 << 20) // Longest value accepted by default
+#define REQUEST_BUFFER_SIZE 512 // Bytes of client requests a session reads ahead
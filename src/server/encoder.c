@@ -0,0 +1,136 @@
+#include "encoder.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "aio.h"
+
+// Nothing here may allocate or lock: the encoder also runs in the forked
+// backup process.
+
+int enc_parse_mode(const char *name) {
+  if (strcmp(name, "text") == 0) {
+    return ENC_TEXT;
+  }
+  if (strcmp(name, "binary") == 0) {
+    return ENC_BINARY;
+  }
+  if (strcmp(name, "binary-lz") == 0) {
+    return ENC_BINARY_LZ;
+  }
+  return -1;
+}
+
+void enc_init(Encoder *enc, int fd, int mode, char *buffer, size_t cap) {
+  enc->fd = fd;
+  enc->mode = mode;
+  enc->data = buffer;
+  enc->len = 0;
+  enc->cap = cap;
+  enc->failed = 0;
+}
+
+int enc_flush(Encoder *enc) {
+  if (enc->len > 0 && !enc->failed && aio_write(enc->fd, enc->data, enc->len) != 0) {
+    enc->failed = 1;
+  }
+  enc->len = 0;
+  return enc->failed ? -1 : 0;
+}
+
+static void put(Encoder *enc, const void *src, size_t size) {
+  const char *bytes = src;
+  while (size > 0) {
+    if (enc->len == enc->cap) {
+      enc_flush(enc);
+    }
+    size_t count = enc->cap - enc->len;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(enc->data + enc->len, bytes, count);
+    enc->len += count;
+    bytes += count;
+    size -= count;
+  }
+}
+
+static void put_char(Encoder *enc, char ch) {
+  if (enc->len == enc->cap) {
+    enc_flush(enc);
+  }
+  enc->data[enc->len++] = ch;
+}
+
+static void put_u32(Encoder *enc, size_t value) {
+  unsigned char bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (unsigned char)((uint32_t)value >> (8 * i));
+  }
+  put(enc, bytes, sizeof(bytes));
+}
+
+static void put_record(Encoder *enc, char tag, const char *key, size_t key_len,
+                       const char *value, size_t value_len) {
+  put_char(enc, tag);
+  put_u32(enc, key_len);
+  put_u32(enc, value_len);
+  put(enc, key, key_len);
+  put(enc, value, value_len);
+}
+
+void enc_list_begin(Encoder *enc) {
+  put_char(enc, '[');
+}
+
+void enc_list_end(Encoder *enc) {
+  if (enc->mode == ENC_TEXT) {
+    put(enc, "]\n", 2);
+  } else {
+    put_char(enc, ']');
+  }
+}
+
+void enc_pair(Encoder *enc, const char *key, size_t key_len, const char *value, size_t value_len) {
+  if (enc->mode != ENC_TEXT) {
+    put_record(enc, ENC_TAG_PAIR, key, key_len, value, value_len);
+    return;
+  }
+  put_char(enc, '(');
+  put(enc, key, key_len);
+  put_char(enc, ',');
+  put(enc, value, value_len);
+  put_char(enc, ')');
+}
+
+void enc_status(Encoder *enc, const char *key, size_t key_len, char tag) {
+  if (enc->mode != ENC_TEXT) {
+    put_record(enc, tag, key, key_len, NULL, 0);
+    return;
+  }
+  const char *status = tag == ENC_TAG_MISSING ? "KVSMISSING" : "KVSERROR";
+  enc_pair(enc, key, key_len, status, strlen(status));
+}
+
+void enc_entry(Encoder *enc, const char *key, size_t key_len, const char *value,
+               size_t value_len) {
+  if (enc->mode != ENC_TEXT) {
+    put_record(enc, ENC_TAG_PAIR, key, key_len, value, value_len);
+    return;
+  }
+  put_char(enc, '(');
+  put(enc, key, key_len);
+  put(enc, ", ", 2);
+  put(enc, value, value_len);
+  put(enc, ")\n", 2);
+}
+
+void enc_compressed(Encoder *enc, const char *key, size_t key_len, const char *data,
+                    size_t data_len, size_t value_len) {
+  put_char(enc, ENC_TAG_COMPRESSED);
+  put_u32(enc, key_len);
+  put_u32(enc, data_len + 4);
+  put(enc, key, key_len);
+  put_u32(enc, value_len);
+  put(enc, data, data_len);
+}
@@ -0,0 +1,81 @@
+#ifndef KVS_ENCODER_H
+#define KVS_ENCODER_H
+
+#include <stddef.h>
+
+// Output formats of the results written to .out files.
+// Text:   [(key,value)(key,KVSERROR)]\n for lists, (key, value)\n for SHOW.
+// Binary: every pair is a record <tag:1><key_len:4><value_len:4><key><value>
+//         with little-endian lengths, and lists are framed by '[' and ']'.
+// Binary-lz: binary, except compressed values are passed through as they are
+//         stored, in records tagged ENC_TAG_COMPRESSED whose value is the
+//         length of the original value (4 bytes, little-endian) followed by
+//         its LZ4 block (see lz.h).
+#define ENC_TEXT 0
+#define ENC_BINARY 1
+#define ENC_BINARY_LZ 2
+
+// Record tags of the binary format.
+#define ENC_TAG_PAIR 'P'
+#define ENC_TAG_ERROR 'E'
+#define ENC_TAG_MISSING 'M'
+#define ENC_TAG_COMPRESSED 'Z'
+
+// Upper bound of the bytes a record adds to its key and value in any format.
+#define ENC_RECORD_OVERHEAD 12
+// Length of the longest status written in place of a value ("KVSMISSING").
+#define ENC_STATUS_MAX_SIZE 10
+
+#define ENC_BUFFER_SIZE 16384
+
+typedef struct Encoder {
+  int fd;
+  int mode;
+  char *data;
+  size_t len;
+  size_t cap;
+  int failed;  // 1 once a flush failed
+} Encoder;
+
+/// Gets the output format from its name ("text", "binary" or "binary-lz").
+/// @return ENC_TEXT, ENC_BINARY or ENC_BINARY_LZ, -1 if the name is not valid.
+int enc_parse_mode(const char *name);
+
+/// Prepares an encoder. The encoder does not allocate: results accumulate in
+/// buffer and are written to fd whenever it fills up or on enc_flush.
+/// @param enc The encoder.
+/// @param fd File descriptor the results are written to.
+/// @param mode ENC_TEXT, ENC_BINARY or ENC_BINARY_LZ.
+/// @param buffer Storage for the pending output.
+/// @param cap Size of buffer.
+void enc_init(Encoder *enc, int fd, int mode, char *buffer, size_t cap);
+
+/// Opens a list of results (READ and DELETE lines).
+void enc_list_begin(Encoder *enc);
+
+/// Closes a list of results.
+void enc_list_end(Encoder *enc);
+
+/// Adds a pair to the current list.
+void enc_pair(Encoder *enc, const char *key, size_t key_len, const char *value, size_t value_len);
+
+/// Adds a key that could not be served to the current list.
+/// @param tag ENC_TAG_ERROR (KVSERROR) or ENC_TAG_MISSING (KVSMISSING).
+void enc_status(Encoder *enc, const char *key, size_t key_len, char tag);
+
+/// Adds a pair as a line of its own (SHOW and backups).
+void enc_entry(Encoder *enc, const char *key, size_t key_len, const char *value, size_t value_len);
+
+/// Adds a pair whose value is compressed, to the current list or as a line
+/// of its own. Only valid in ENC_BINARY_LZ mode.
+/// @param data The LZ4 block.
+/// @param data_len Length of the block.
+/// @param value_len Length of the value once decompressed.
+void enc_compressed(Encoder *enc, const char *key, size_t key_len, const char *data,
+                    size_t data_len, size_t value_len);
+
+/// Writes everything that is pending.
+/// @return 0 if all the output so far was written, -1 otherwise.
+int enc_flush(Encoder *enc);
+
+#endif  // KVS_ENCODER_H
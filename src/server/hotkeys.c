@@ -0,0 +1,278 @@
+#include "hotkeys.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aio.h"
+#include "constants.h"
+#include "metrics.h"
+
+#define LINE_SIZE 256
+
+typedef struct HotKey {
+  uint64_t hash;  // Compared before the key
+  uint64_t count;
+  uint64_t error;  // Count of the key it replaced
+  uint64_t reads;
+  uint64_t writes;
+  char key[MAX_STRING_SIZE];
+} HotKey;
+
+// The sketch of one thread. Its owner makes seq odd while it changes it, so
+// a reader copies it again if seq changed or was odd. Sketches are never
+// freed, so the keys of threads that are gone still count.
+typedef struct Sketch {
+  unsigned seq;
+  size_t used;
+  HotKey keys[HOTKEYS_CAPACITY];
+  struct Sketch *next;
+} Sketch;
+
+static Sketch *sketches = NULL;  // Every sketch, pushed without a lock
+static _Thread_local Sketch *local_sketch = NULL;
+static HotkeysSubscribersFn subscribers_fn = NULL;
+
+// FNV-1a
+static uint64_t hash_key(const char *key) {
+  uint64_t h = 14695981039346656037ULL;
+  for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+    h = (h ^ *c) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static Sketch *get_local_sketch(void) {
+  if (local_sketch == NULL) {
+    Sketch *sketch = calloc(1, sizeof(Sketch));
+    if (sketch == NULL) {
+      return NULL;
+    }
+    sketch->next = __atomic_load_n(&sketches, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sketches, &sketch->next, sketch, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+      // Another thread pushed its sketch first, sketch->next was refreshed
+    }
+    local_sketch = sketch;
+  }
+  return local_sketch;
+}
+
+void hotkeys_touch(const char *key, int is_write) {
+  Sketch *sketch = get_local_sketch();
+  if (sketch == NULL) {
+    return;
+  }
+  uint64_t hash = hash_key(key);
+
+  // One pass finds the key, or the least counted one in case it is not there
+  size_t found = sketch->used;
+  size_t least = 0;
+  for (size_t i = 0; i < sketch->used; i++) {
+    if (sketch->keys[i].hash == hash && strcmp(sketch->keys[i].key, key) == 0) {
+      found = i;
+      break;
+    }
+    if (sketch->keys[i].count < sketch->keys[least].count) {
+      least = i;
+    }
+  }
+
+  __atomic_store_n(&sketch->seq, sketch->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (found == sketch->used) {
+    if (sketch->used < HOTKEYS_CAPACITY) {
+      sketch->keys[sketch->used++] = (HotKey){.hash = hash};
+    } else {
+      found = least;
+      HotKey *replaced = &sketch->keys[least];
+      replaced->error = replaced->count;
+      replaced->reads = 0;
+      replaced->writes = 0;
+      replaced->hash = hash;
+    }
+    strncpy(sketch->keys[found].key, key, MAX_STRING_SIZE - 1);
+    sketch->keys[found].key[MAX_STRING_SIZE - 1] = '\0';
+  }
+  HotKey *entry = &sketch->keys[found];
+  entry->count++;
+  if (is_write) {
+    entry->writes++;
+  } else {
+    entry->reads++;
+  }
+  __atomic_store_n(&sketch->seq, sketch->seq + 1, __ATOMIC_RELEASE);
+}
+
+void hotkeys_set_subscribers_fn(HotkeysSubscribersFn fn) {
+  subscribers_fn = fn;
+}
+
+// Copies a sketch while its owner may be changing it.
+static void copy_sketch(const Sketch *sketch, HotKey *keys, size_t *used) {
+  while (1) {
+    unsigned seq = __atomic_load_n(&sketch->seq, __ATOMIC_ACQUIRE);
+    if (seq % 2 == 0) {
+      *used = sketch->used;
+      memcpy(keys, sketch->keys, *used * sizeof(HotKey));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&sketch->seq, __ATOMIC_RELAXED) == seq) {
+        return;
+      }
+    }
+  }
+}
+
+// A key of a sketch, while the sketches are merged.
+typedef struct Counted {
+  HotKey key;
+  size_t sketch;
+} Counted;
+
+static int by_key(const void *a, const void *b) {
+  const HotKey *first = &((const Counted *)a)->key;
+  const HotKey *second = &((const Counted *)b)->key;
+  if (first->hash != second->hash) {
+    return first->hash < second->hash ? -1 : 1;
+  }
+  return strcmp(first->key, second->key);
+}
+
+static int by_count(const void *a, const void *b) {
+  const HotKey *first = a;
+  const HotKey *second = b;
+  if (first->count != second->count) {
+    return first->count < second->count ? 1 : -1;
+  }
+  return strcmp(first->key, second->key);
+}
+
+// Merges the sketches of every thread. A key a full sketch does not count
+// may have been used there as often as its least counted key, which is added
+// to the count and error of the key.
+// @param num_keys Set to the number of keys.
+// @return The keys, most used first, NULL if out of memory.
+static HotKey *merge_sketches(size_t *num_keys) {
+  size_t num_sketches = 0;
+  for (Sketch *sketch = __atomic_load_n(&sketches, __ATOMIC_ACQUIRE); sketch != NULL;
+       sketch = sketch->next) {
+    num_sketches++;
+  }
+  Counted *all = malloc((num_sketches * HOTKEYS_CAPACITY + 1) * sizeof(Counted));
+  HotKey *merged = malloc((num_sketches * HOTKEYS_CAPACITY + 1) * sizeof(HotKey));
+  uint64_t *least = calloc(num_sketches + 1, sizeof(uint64_t));
+  if (all == NULL || merged == NULL || least == NULL) {
+    free(all);
+    free(merged);
+    free(least);
+    return NULL;
+  }
+
+  // Sketches pushed since they were counted are left for the next report
+  size_t total = 0;
+  size_t s = 0;
+  uint64_t least_sum = 0;
+  HotKey copy[HOTKEYS_CAPACITY];
+  for (Sketch *sketch = __atomic_load_n(&sketches, __ATOMIC_ACQUIRE);
+       sketch != NULL && s < num_sketches; sketch = sketch->next, s++) {
+    size_t used;
+    copy_sketch(sketch, copy, &used);
+    for (size_t i = 0; i < used; i++) {
+      all[total++] = (Counted){copy[i], s};
+      if (used == HOTKEYS_CAPACITY && (i == 0 || copy[i].count < least[s])) {
+        least[s] = copy[i].count;
+      }
+    }
+    least_sum += least[s];
+  }
+
+  qsort(all, total, sizeof(Counted), by_key);
+  size_t count = 0;
+  for (size_t i = 0; i < total;) {
+    size_t first = i;
+    HotKey *key = &merged[count++];
+    *key = all[first].key;
+    key->count = 0;
+    key->error = 0;
+    key->reads = 0;
+    key->writes = 0;
+    uint64_t missing = least_sum;  // Least counts of the full sketches without the key
+    for (; i < total && by_key(&all[i], &all[first]) == 0; i++) {
+      key->count += all[i].key.count;
+      key->error += all[i].key.error;
+      key->reads += all[i].key.reads;
+      key->writes += all[i].key.writes;
+      missing -= least[all[i].sketch];
+    }
+    key->count += missing;
+    key->error += missing;
+  }
+  free(all);
+  free(least);
+
+  qsort(merged, count, sizeof(HotKey), by_count);
+  *num_keys = count;
+  return merged;
+}
+
+// Copies a key into a JSON string, escaping what must be.
+static void json_key(char *dst, const char *key) {
+  size_t len = 0;
+  for (; *key != '\0'; key++) {
+    if (*key == '"' || *key == '\\') {
+      dst[len++] = '\\';
+    }
+    dst[len++] = *key;
+  }
+  dst[len] = '\0';
+}
+
+int hotkeys_write(int fd, int format) {
+  size_t num_keys;
+  HotKey *keys = merge_sketches(&num_keys);
+  if (keys == NULL) {
+    return -1;
+  }
+  if (num_keys > HOTKEYS_TOP) {
+    num_keys = HOTKEYS_TOP;
+  }
+
+  char line[LINE_SIZE];
+  char key[2 * MAX_STRING_SIZE];
+  int result = 0;
+  int len;
+  if (format == METRICS_JSON) {
+    len = snprintf(line, sizeof(line), "\"hot_keys\":[");
+  } else {
+    len = snprintf(line, sizeof(line), "%-4s %-40s %10s %10s %10s %10s %11s\n", "rank", "key",
+                   "count", "error", "reads", "writes", "subscribers");
+  }
+  result |= aio_write(fd, line, (size_t)len);
+
+  for (size_t i = 0; i < num_keys && result == 0; i++) {
+    const HotKey *hot = &keys[i];
+    size_t subscribers = subscribers_fn == NULL ? 0 : subscribers_fn(hot->key);
+    if (format == METRICS_JSON) {
+      json_key(key, hot->key);
+      len = snprintf(line, sizeof(line),
+                     "%s{\"key\":\"%s\",\"count\":%llu,\"error\":%llu,\"reads\":%llu,"
+                     "\"writes\":%llu,\"subscribers\":%zu}",
+                     i == 0 ? "" : ",", key, (unsigned long long)hot->count,
+                     (unsigned long long)hot->error, (unsigned long long)hot->reads,
+                     (unsigned long long)hot->writes, subscribers);
+    } else {
+      len = snprintf(line, sizeof(line), "%-4zu %-40s %10llu %10llu %10llu %10llu %11zu\n", i + 1,
+                     hot->key, (unsigned long long)hot->count, (unsigned long long)hot->error,
+                     (unsigned long long)hot->reads, (unsigned long long)hot->writes,
+                     subscribers);
+    }
+    result |= aio_write(fd, line, (size_t)len);
+  }
+  if (format == METRICS_JSON && result == 0) {
+    result |= aio_write(fd, "]", 1);
+  }
+
+  free(keys);
+  return result == 0 ? 0 : -1;
+}
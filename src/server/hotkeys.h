@@ -0,0 +1,36 @@
+#ifndef KVS_HOTKEYS_H
+#define KVS_HOTKEYS_H
+
+#include <stddef.h>
+
+// The most used keys, found with the Space-Saving sketch: every thread counts
+// the HOTKEYS_CAPACITY keys it has seen most, and a key it has not counted
+// takes the place of the least counted one, starting from its count. So a
+// count is never below the real one, and is over by at most its error; a key
+// used more than 1/HOTKEYS_CAPACITY of the time is always counted. A thread
+// only writes its own sketch, so counting takes no lock; the sketches are
+// merged when the keys are reported.
+#define HOTKEYS_CAPACITY 64
+#define HOTKEYS_TOP 10  // Keys reported
+
+/// Gets the number of clients subscribed to a key.
+typedef size_t (*HotkeysSubscribersFn)(const char *key);
+
+/// Counts a use of a key.
+/// @param key The key.
+/// @param is_write 1 if it was written (or deleted), 0 if it was read.
+void hotkeys_touch(const char *key, int is_write);
+
+/// Sets how the report counts the subscribers of a key.
+void hotkeys_set_subscribers_fn(HotkeysSubscribersFn fn);
+
+/// Writes the HOTKEYS_TOP most used keys, with their count, its error, the
+/// reads and writes counted since the key was last taken in, and their
+/// subscribers.
+/// @param fd File descriptor to write to (through aio_write).
+/// @param format METRICS_TEXT (a table) or METRICS_JSON (a "hot_keys" member,
+///               to be put in an object).
+/// @return 0 if successful, -1 otherwise.
+int hotkeys_write(int fd, int format);
+
+#endif  // KVS_HOTKEYS_H
@@ -3,11 +3,10 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "aio.h"
+
 void write_str(int fd, const char *str) {
-  size_t len = strlen(str);
-  while (len > 0) {
-    len -= (size_t)write(fd, str, len);
-  }
+  aio_write(fd, str, strlen(str));
 }
 
 void write_uint(int fd, int value) {
@@ -22,9 +21,7 @@ void write_uint(int fd, int value) {
     buffer[--i] = '0';
   }
 
-  while (i < 16) {
-    i += (size_t)write(fd, buffer + i, 16 - i);
-  }
+  aio_write(fd, buffer + i, 16 - i);
 }
 
 size_t strn_memcpy(char* dest, const char* src, size_t n) {
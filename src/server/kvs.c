@@ -3,11 +3,27 @@
 #include "string.h"
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sched.h>
 
 #include "src/common/io.h"
 #include "src/common/constants.h"
+#include "src/common/protocol.h"
+#include "lz.h"
+#include "metrics.h"
+#include "trace.h"
+#include "ttl.h"
+#include "values.h"
 #include <stdlib.h>
 
+#define NOTIFY_MAX_FDS 65536  // Descriptors with a notification lock of their own
+
+// Locks of the notification streams by descriptor, made when one is first
+// subscribed and kept for the clients that reuse it. Streams past the table
+// share the last lock.
+static pthread_mutex_t *notify_locks[NOTIFY_MAX_FDS];
+static pthread_mutex_t shared_notify_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Hash function based on key initial.
 // @param key Lowercase alphabetical string.
 // @return hash.
@@ -28,53 +44,318 @@ struct HashTable* create_hash_table() {
 	for (int i = 0; i < TABLE_SIZE; i++) {
 		ht->table[i] = NULL;
 	}
+	if (btree_init(&ht->index) != 0) {
+		free(ht);
+		return NULL;
+	}
 	pthread_rwlock_init(&ht->tablelock, NULL);
+	ht->next_seq = 0;
+	ht->commit_seq = 0;
+	pthread_mutex_init(&ht->readers_lock, NULL);
+	ht->readers = NULL;
+	ht->garbage = 0;
+	ht->gc_threshold = GC_MIN_GARBAGE;
+	ht->retired = NULL;
+	ht->memory_used = 0;
+	ht->evictions = 0;
+	table_cursor_init(&ht->clock_hand);
 	return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
+uint64_t commit_begin(HashTable *ht) {
+    return __atomic_add_fetch(&ht->next_seq, 1, __ATOMIC_ACQ_REL);
+}
+
+void commit_end(HashTable *ht, uint64_t seq) {
+    // Commits on other keys run in parallel, but are published in order
+    while (__atomic_load_n(&ht->commit_seq, __ATOMIC_ACQUIRE) != seq - 1) {
+        sched_yield();
+    }
+    __atomic_store_n(&ht->commit_seq, seq, __ATOMIC_RELEASE);
+}
+
+void snapshot_begin(HashTable *ht, Snapshot *snapshot) {
+    // Under the lock so collect_garbage never misses a snapshot older than
+    // the ones it sees
+    pthread_mutex_lock(&ht->readers_lock);
+    snapshot->seq = __atomic_load_n(&ht->commit_seq, __ATOMIC_ACQUIRE);
+    snapshot->now_ms = ttl_now_ms();
+    snapshot->prev = NULL;
+    snapshot->next = ht->readers;
+    if (ht->readers != NULL) {
+        ht->readers->prev = snapshot;
+    }
+    ht->readers = snapshot;
+    pthread_mutex_unlock(&ht->readers_lock);
+}
+
+void snapshot_end(HashTable *ht, Snapshot *snapshot) {
+    pthread_mutex_lock(&ht->readers_lock);
+    if (snapshot->prev != NULL) {
+        snapshot->prev->next = snapshot->next;
+    } else {
+        ht->readers = snapshot->next;
+    }
+    if (snapshot->next != NULL) {
+        snapshot->next->prev = snapshot->prev;
+    }
+    pthread_mutex_unlock(&ht->readers_lock);
+}
+
+int version_live(const Version *version, uint64_t now_ms) {
+    return version->value != NULL && (version->expires_at == 0 || version->expires_at > now_ms);
+}
+
+Version *version_at(KeyNode *keyNode, const Snapshot *snapshot) {
+    Version *version = __atomic_load_n(&keyNode->versions, __ATOMIC_ACQUIRE);
+    while (version != NULL && version->seq > snapshot->seq) {
+        version = __atomic_load_n(&version->older, __ATOMIC_ACQUIRE);
+    }
+    return version != NULL && version_live(version, snapshot->now_ms) ? version : NULL;
+}
+
+Version *latest_version(KeyNode *keyNode, uint64_t now_ms) {
+    Version *version = __atomic_load_n(&keyNode->versions, __ATOMIC_ACQUIRE);
+    return version_live(version, now_ms) ? version : NULL;
+}
+
+Version *new_version(const char *value, size_t value_len) {
+    // Long values are compressed into a spare buffer first, and copied into
+    // their own one if that saved enough
+    char *compressed = NULL;
+    size_t compressed_len = 0;
+    if (value != NULL && value_len >= VALUE_INLINE_SIZE && (compressed = value_alloc(value_len)) != NULL) {
+        compressed_len = value_compress(value, value_len, compressed);
+    }
+    const char *stored = compressed_len != 0 ? compressed : value;
+    size_t stored_len = compressed_len != 0 ? compressed_len : value_len;
+
+    // Short values are stored right after the version, so both go in one free
+    int inline_value = value != NULL && stored_len < VALUE_INLINE_SIZE;
+    Version *version = malloc(sizeof(Version) + (inline_value ? stored_len + 1 : 0));
+    if (version != NULL) {
+        version->value = NULL;
+        if (inline_value) {
+            version->value = (char *)(version + 1);
+        } else if (value != NULL && (version->value = value_alloc(stored_len + 1)) == NULL) {
+            free(version);
+            version = NULL;
+        }
+    }
+    if (version != NULL) {
+        if (value != NULL) {
+            memcpy(version->value, stored, stored_len);
+            version->value[stored_len] = '\0';
+        }
+        version->value_len = value_len;
+        version->compressed_len = compressed_len;
+        version->seq = 0;
+        version->expires_at = 0;
+        version->older = NULL;
+    }
+
+    if (compressed != NULL) {
+        value_free(compressed, value_len);
+    }
+    return version;
+}
+
+// Bytes stored in the value of a version, terminator included.
+static size_t stored_size(const Version *version) {
+    return (version->compressed_len != 0 ? version->compressed_len : version->value_len) + 1;
+}
+
+int version_copy(const Version *version, char *dst) {
+    if (version->compressed_len == 0) {
+        memcpy(dst, version->value, version->value_len);
+        return 0;
+    }
+    return lz_decompress(version->value, version->compressed_len, dst, version->value_len);
+}
+
+const char *version_value(const Version *version, char **scratch, size_t *scratch_cap) {
+    if (version->compressed_len == 0) {
+        return version->value;
+    }
+    if (*scratch_cap < version->value_len) {
+        char *grown = realloc(*scratch, version->value_len);
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to allocate memory to decompress a value\n");
+            return NULL;
+        }
+        *scratch = grown;
+        *scratch_cap = version->value_len;
+    }
+    if (version_copy(version, *scratch) != 0) {
+        fprintf(stderr, "Failed to decompress a value\n");
+        return NULL;
+    }
+    return *scratch;
+}
+
+// Whether the value of a version is stored out of line.
+static int value_out_of_line(const Version *version) {
+    return version->value != NULL && version->value != (const char *)(version + 1);
+}
+
+void free_version(Version *version) {
+    if (value_out_of_line(version)) {
+        value_free(version->value, stored_size(version));
+    }
+    free(version);
+}
+
+// Bytes a version takes, its value included.
+static size_t version_size(const Version *version) {
+    if (value_out_of_line(version)) {
+        return sizeof(Version) + value_alloc_size(stored_size(version));
+    }
+    return sizeof(Version) + (version->value == NULL ? 0 : stored_size(version));
+}
+
+// Gets the first active subscriber of a pair, NULL if there is none.
+static Subscribers *first_subscriber(KeyNode *keyNode) {
+    Subscribers *subNode = keyNode->subs;
+    while (subNode != NULL && subNode->ativo != 1) {
+        subNode = subNode->next;
+    }
+    return subNode;
+}
+
+// Gets the lock the writers of a notification stream take turns on.
+static pthread_mutex_t *notify_lock(int fd) {
+    if (fd < 0 || fd >= NOTIFY_MAX_FDS) {
+        return &shared_notify_lock;
+    }
+    pthread_mutex_t *lock = __atomic_load_n(&notify_locks[fd], __ATOMIC_ACQUIRE);
+    if (lock != NULL) {
+        return lock;
+    }
+    pthread_mutex_t *created = malloc(sizeof(pthread_mutex_t));
+    if (created == NULL) {
+        return &shared_notify_lock;
+    }
+    pthread_mutex_init(created, NULL);
+    if (!__atomic_compare_exchange_n(&notify_locks[fd], &lock, created, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_destroy(created); // Another subscriber made it first
+        free(created);
+        return lock;
+    }
+    return created;
+}
+
+// Tells the active subscribers of a pair about its new value (see
+// NOTIF_HEADER_SIZE). Other pairs may be notified at the same time, so every
+// notification goes out in a single write, under the lock of its stream:
+// sockets may split any write, and FIFOs the ones longer than PIPE_BUF.
+// @param deactivate Whether the subscriptions end, because the pair is gone.
+// @return 0 if successful, -1 if a write failed.
+static int notify(KeyNode *keyNode, const char *value, size_t value_len, int deactivate) {
+    Subscribers *subNode = first_subscriber(keyNode);
+    if (subNode == NULL) {
+        return 0;
+    }
+
+    char small[NOTIF_HEADER_SIZE + VALUE_INLINE_SIZE];
+    size_t size = NOTIF_HEADER_SIZE + value_len;
+    char *notification = size <= sizeof(small) ? small : malloc(size);
+    if (notification == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a notification\n");
+        return -1;
+    }
+    memset(notification, '\0', MAX_KEY_SIZE);
+    strcpy(notification, keyNode->key);
+    for (int i = 0; i < 4; i++) {
+        notification[MAX_KEY_SIZE + i] = (char)(unsigned char)((uint32_t)value_len >> (8 * i));
+    }
+    memcpy(notification + NOTIF_HEADER_SIZE, value, value_len);
+
+    int result = 0;
+    for (; subNode != NULL; subNode = subNode->next) {
+        if (subNode->ativo != 1) {
+            continue;
+        }
+        uint64_t started = metrics_now();
+        pthread_mutex_t *lock = notify_lock(subNode->fd_notif);
+        pthread_mutex_lock(lock);
+        int written = write_all(subNode->fd_notif, notification, size);
+        pthread_mutex_unlock(lock);
+        if (written == -1) {
+            metrics_record(METRIC_NOTIFY, started, 1, 1);
+            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
+            result = -1;
+            break;
+        }
+        metrics_record(METRIC_NOTIFY, started, 1, 0);
+        trace_span("notify", started, trace_now(), keyNode->key, subNode->fd_notif);
+        if (deactivate) {
+            subNode->ativo = 0;
+        }
+    }
+
+    if (notification != small) {
+        free(notification);
+    }
+    return result;
+}
+
+// Tells the active subscribers of a pair about a new version. Compressed
+// values are only decompressed if someone is subscribed.
+// @return 0 if successful, -1 on failure.
+static int notify_version(KeyNode *keyNode, const Version *version) {
+    if (version->compressed_len == 0) {
+        return notify(keyNode, version->value, version->value_len, 0);
+    }
+    if (first_subscriber(keyNode) == NULL) {
+        return 0;
+    }
+    char *scratch = NULL;
+    size_t scratch_cap = 0;
+    const char *value = version_value(version, &scratch, &scratch_cap);
+    int result = value == NULL ? -1 : notify(keyNode, value, version->value_len, 0);
+    free(scratch);
+    return result;
+}
+
+// Bytes a node takes, its key and every version included.
+static size_t node_size(const KeyNode *keyNode) {
+    size_t size = sizeof(KeyNode) + keyNode->key_len + 1;
+    for (Version *version = keyNode->versions; version != NULL; version = version->older) {
+        size += version_size(version);
+    }
+    return size;
+}
+
+// Makes version the newest one of a node.
+static void push_version(HashTable *ht, KeyNode *keyNode, Version *version, uint64_t seq) {
+    version->seq = seq;
+    version->older = keyNode->versions;
+    __atomic_store_n(&keyNode->versions, version, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ht->garbage, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ht->memory_used, version_size(version), __ATOMIC_RELAXED);
+}
+
+int write_pair(HashTable *ht, const char *key, Version *version, uint64_t seq) {
     int index = hash(key);
-    char key_buffer[MAX_KEY_SIZE];
-    char value_buffer[MAX_KEY_SIZE];
-    memset(key_buffer, '\0', MAX_STRING_SIZE);
-    memset(value_buffer, '\0', MAX_STRING_SIZE);
-    
+    if (index < 0) {
+        free_version(version);
+        return 1;
+    }
+
     // CHANGEME quando fazemos isto temos que tambem percorrer os clientes a procura de novas chaves a serem adicionadas
     // Search for the key node
 	KeyNode *keyNode = ht->table[index];
-    Subscribers *subNode;
 
     while (keyNode != NULL) {
         // WE found the key we are looking to replace
         if (strcmp(keyNode->key, key) == 0) {
-            // overwrite value
-            free(keyNode->value); // Overwrite value
-            keyNode->value = strdup(value);
-
-            // Se a fila de subscritores nao for nula
-            // Ativo condicao
-            if ((keyNode->subs != NULL)){ // se entra aqui significa que não é nula, ou
-                subNode = keyNode->subs;
-
-                // Percorremos a fila de subscritores
-                while(subNode != NULL){
-                    if(subNode->ativo == 1){
-                        strcpy(key_buffer, key);
-                        strcpy(value_buffer, value);
-                        if (write_all(subNode->fd_notif, key_buffer, sizeof(char) * MAX_KEY_SIZE) == -1) {
-                            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
-                            return -1;
-                        }
-                        if (write_all(subNode->fd_notif, value_buffer, sizeof(char) * MAX_KEY_SIZE) == -1) {
-                            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
-                            return -1;
-                        }
-                    }   
-                    
-                    subNode = subNode->next;
-                }
-            }
-            return 0;
+            // overwrite value (readers of older snapshots keep the old one)
+            push_version(ht, keyNode, version, seq);
+            keyNode->referenced = 1;
+            trace_instant("pair written", key, (int64_t)version->value_len);
+
+            return notify_version(keyNode, version);
         }
         keyNode = keyNode->next; // Move to the next node
     }
@@ -82,9 +363,25 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
     
     keyNode = malloc(sizeof(KeyNode));
     keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
+    keyNode->key_len = strlen(key);
+    version->seq = seq;
+    keyNode->versions = version;
+    keyNode->subs = NULL;
+    keyNode->referenced = 1;
+    keyNode->retired_at = 0;
+    keyNode->retired_next = NULL;
+    if (btree_insert(&ht->index, keyNode->key, keyNode) != 0) {
+        free(keyNode->key);
+        free_version(version);
+        free(keyNode);
+        return 1;
+    }
+    pthread_mutex_init(&keyNode->lock, NULL);
+    __atomic_add_fetch(&ht->memory_used, node_size(keyNode), __ATOMIC_RELAXED);
     keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    // Place new key node at the start of the list, once it is complete
+    __atomic_store_n(&ht->table[index], keyNode, __ATOMIC_RELEASE);
+    trace_instant("pair written", key, (int64_t)version->value_len);
     return 0;
 }
 
@@ -97,7 +394,16 @@ char* read_pair(HashTable *ht, const char *key) {
 
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
+            Version *version = latest_version(keyNode, ttl_now_ms());
+            if (version == NULL) {
+                return NULL; // Deleted or expired
+            }
+            value = malloc(version->value_len + 1);
+            if (value == NULL || version_copy(version, value) != 0) {
+                free(value);
+                return NULL;
+            }
+            value[version->value_len] = '\0';
             return value; // Return the value if found
         }
         previousNode = keyNode;
@@ -107,107 +413,321 @@ char* read_pair(HashTable *ht, const char *key) {
     return NULL; // Key not found
 }
 
-int delete_pair(HashTable *ht, const char *key) {
+void update_value(HashTable *ht, KeyNode *keyNode, Version *version, uint64_t seq) {
+    push_version(ht, keyNode, version, seq);
+    __atomic_store_n(&keyNode->referenced, 1, __ATOMIC_RELAXED);
+    notify_version(keyNode, version);
+}
+
+// Looks up at most MAX_WRITE_SIZE keys (see read_pairs).
+static void read_batch(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], KeyNode **nodes) {
+    int buckets[MAX_WRITE_SIZE];
+    size_t order[MAX_WRITE_SIZE];
+    size_t bucket_start[TABLE_SIZE + 1];
+    KeyNode *heads[TABLE_SIZE];
+
+    // Hash everything first and count the keys of each bucket
+    memset(bucket_start, 0, sizeof(bucket_start));
+    for (size_t i = 0; i < num_keys; i++) {
+        buckets[i] = hash(keys[i]);
+        nodes[i] = NULL;
+        if (buckets[i] >= 0) {
+            bucket_start[buckets[i] + 1]++;
+        }
+    }
+
+    // Counting sort of the keys by bucket, keeping the request order inside a bucket
+    for (int b = 0; b < TABLE_SIZE; b++) {
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    size_t num_valid = bucket_start[TABLE_SIZE];
+    size_t next[TABLE_SIZE];
+    memcpy(next, bucket_start, sizeof(next));
+    for (size_t i = 0; i < num_keys; i++) {
+        if (buckets[i] >= 0) {
+            order[next[buckets[i]]++] = i;
+        }
+    }
+
+    // Issue the loads of every chain head (and its key) before walking any of them
+    for (int b = 0; b < TABLE_SIZE; b++) {
+        heads[b] = __atomic_load_n(&ht->table[b], __ATOMIC_ACQUIRE);
+        if (bucket_start[b] != bucket_start[b + 1] && heads[b] != NULL) {
+            __builtin_prefetch(heads[b]);
+        }
+    }
+    for (int b = 0; b < TABLE_SIZE; b++) {
+        if (bucket_start[b] != bucket_start[b + 1] && heads[b] != NULL) {
+            __builtin_prefetch(heads[b]->key);
+        }
+    }
+
+    for (size_t j = 0; j < num_valid; j++) {
+        size_t i = order[j];
+        KeyNode *keyNode = heads[buckets[i]];
+        while (keyNode != NULL) {
+            KeyNode *following = __atomic_load_n(&keyNode->next, __ATOMIC_ACQUIRE);
+            if (following != NULL) {
+                __builtin_prefetch(following);
+            }
+            if (strcmp(keyNode->key, keys[i]) == 0) {
+                nodes[i] = keyNode;
+                // Only stored when it changes, so hot keys are not written by every read
+                if (!__atomic_load_n(&keyNode->referenced, __ATOMIC_RELAXED)) {
+                    __atomic_store_n(&keyNode->referenced, 1, __ATOMIC_RELAXED);
+                }
+                break;
+            }
+            keyNode = following;
+        }
+    }
+}
+
+void read_pairs(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], KeyNode **nodes) {
+    for (size_t done = 0; done < num_keys; done += MAX_WRITE_SIZE) {
+        size_t count = num_keys - done < MAX_WRITE_SIZE ? num_keys - done : MAX_WRITE_SIZE;
+        read_batch(ht, count, keys + done, nodes + done);
+    }
+}
+
+// Finds the node of a key, deleted pairs included.
+// @return The node, NULL if there is none.
+static KeyNode *find_node(HashTable *ht, const char *key) {
     int index = hash(key);
-    char key_buffer[MAX_KEY_SIZE];
-    char value_buffer[MAX_KEY_SIZE];
-    memset(key_buffer, '\0', MAX_STRING_SIZE);
-    memset(value_buffer, '\0', MAX_STRING_SIZE);
+    if (index < 0) {
+        return NULL;
+    }
 
-    // Search for the key node
     KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
-    Subscribers *subNode;
-    Subscribers *prevSub;
+    while (keyNode != NULL && strcmp(keyNode->key, key) != 0) {
+        keyNode = keyNode->next;
+    }
+    return keyNode;
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                subNode = keyNode->subs;
-                while(subNode != NULL){
-                    if(subNode->ativo == 1){
-                        strcpy(key_buffer, key);
-                        strcpy(value_buffer, "DELETED");
-                        if (write_all(subNode->fd_notif, key_buffer, sizeof(char) * MAX_KEY_SIZE) == -1) {
-                            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
-                            return -1;
-                        }
-                        if (write_all(subNode->fd_notif, value_buffer, sizeof(char) * MAX_KEY_SIZE) == -1) {
-                            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
-                            return -1;
-                        }
-                        subNode->ativo = 0;
-                    }
-                    prevSub = subNode;
-                    subNode = prevSub->next;
+// Pushes a tombstone in front of a pair and tells its subscribers why.
+// @param reason Sent to the subscribers in place of the value.
+// @return 0 if successful.
+static int remove_pair(HashTable *ht, KeyNode *keyNode, const char *reason, uint64_t seq) {
+    Version *tombstone = new_version(NULL, 0);
+    if (tombstone == NULL) {
+        return 1;
+    }
+
+    if (notify(keyNode, reason, strlen(reason), 1) != 0) {
+        free_version(tombstone);
+        return -1;
+    }
+
+    // Older snapshots still see the value, so the node stays in the
+    // table until collect_garbage finds that nobody does
+    push_version(ht, keyNode, tombstone, seq);
+    return 0;
+}
+
+int delete_pair(HashTable *ht, const char *key, uint64_t seq) {
+    KeyNode *keyNode = find_node(ht, key);
+    if (keyNode == NULL || latest_version(keyNode, ttl_now_ms()) == NULL) {
+        return 1; // Missing, already deleted or expired
+    }
+
+    return remove_pair(ht, keyNode, "DELETED", seq);
+}
+
+int expire_pair(HashTable *ht, const char *key, uint64_t expires_at, uint64_t seq) {
+    KeyNode *keyNode = find_node(ht, key);
+    if (keyNode == NULL) {
+        return 1;
+    }
+
+    // A later write or delete replaced the version the entry was made for
+    Version *version = keyNode->versions;
+    if (version->value == NULL || version->expires_at != expires_at) {
+        return 1;
+    }
+
+    return remove_pair(ht, keyNode, "EXPIRED", seq);
+}
+
+size_t evict_pairs(HashTable *ht, size_t bytes, uint64_t seq) {
+    // Each node is passed at most twice: once to clear its bit, once to evict it
+    size_t released = 0;
+    uint64_t now_ms = ttl_now_ms();
+    for (size_t visited = 0; released < bytes && visited <= 2 * ht->index.size; visited++) {
+        KeyNode *keyNode = table_cursor_next(ht, &ht->clock_hand);
+        if (keyNode == NULL) {
+            table_cursor_init(&ht->clock_hand);
+            if ((keyNode = table_cursor_next(ht, &ht->clock_hand)) == NULL) {
+                break;
+            }
+        }
+
+        if (!version_live(keyNode->versions, now_ms)) {
+            // Deleted already, collect_garbage takes care of it; or expired,
+            // and the reaper removes it as EXPIRED
+            continue;
+        }
+        if (keyNode->referenced) {
+            keyNode->referenced = 0; // Second chance
+            continue;
+        }
+
+        size_t size = node_size(keyNode);
+        if (remove_pair(ht, keyNode, "EVICTED", seq) == 0) {
+            released += size;
+            __atomic_add_fetch(&ht->evictions, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return released;
+}
+
+// Frees a node that is no longer linked to the table.
+static void free_node(HashTable *ht, KeyNode *keyNode) {
+    __atomic_sub_fetch(&ht->memory_used, node_size(keyNode), __ATOMIC_RELAXED);
+
+    Subscribers *subNode = keyNode->subs;
+    while(subNode != NULL){
+        Subscribers *subTemp = subNode;
+        subNode = subNode->next;
+        free(subTemp->sub_clients);
+        free(subTemp);
+    }
+
+    Version *version = keyNode->versions;
+    while (version != NULL) {
+        Version *older = version->older;
+        free_version(version);
+        version = older;
+    }
+
+    pthread_mutex_destroy(&keyNode->lock);
+    free(keyNode->key);
+    free(keyNode);
+}
+
+void collect_garbage(HashTable *ht) {
+    // Every current and future snapshot sees at least the commits up to horizon
+    pthread_mutex_lock(&ht->readers_lock);
+    uint64_t horizon = __atomic_load_n(&ht->commit_seq, __ATOMIC_ACQUIRE);
+    for (Snapshot *snapshot = ht->readers; snapshot != NULL; snapshot = snapshot->next) {
+        if (snapshot->seq < horizon) {
+            horizon = snapshot->seq;
+        }
+    }
+    int has_readers = ht->readers != NULL;
+    pthread_mutex_unlock(&ht->readers_lock);
+
+    // Nodes unlinked before the oldest reader started cannot be reached anymore
+    KeyNode **retired = &ht->retired;
+    while (*retired != NULL) {
+        KeyNode *keyNode = *retired;
+        if (!has_readers || keyNode->retired_at < horizon) {
+            *retired = keyNode->retired_next;
+            free_node(ht, keyNode);
+        } else {
+            retired = &keyNode->retired_next;
+        }
+    }
+
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        KeyNode **link = &ht->table[i];
+        while (*link != NULL) {
+            KeyNode *keyNode = *link;
+
+            // Versions older than the one seen at horizon are seen by nobody
+            Version *seen = keyNode->versions;
+            while (seen != NULL && seen->seq > horizon) {
+                seen = seen->older;
+            }
+            if (seen != NULL) {
+                Version *version = seen->older;
+                __atomic_store_n(&seen->older, NULL, __ATOMIC_RELEASE);
+                while (version != NULL) {
+                    Version *older = version->older;
+                    __atomic_sub_fetch(&ht->memory_used, version_size(version), __ATOMIC_RELAXED);
+                    free_version(version);
+                    version = older;
                 }
+            }
 
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                subNode = keyNode->subs;
-                
-                while(subNode != NULL){
-                    if(subNode->ativo == 1){
-                        strcpy(key_buffer, key);
-                        strcpy(value_buffer, "DELETED");
-                        if (write_all(subNode->fd_notif, key_buffer, sizeof(char) * MAX_KEY_SIZE) == -1) {
-                            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
-                            return -1;
-                        }
-                        if (write_all(subNode->fd_notif, value_buffer, sizeof(char) * MAX_KEY_SIZE) == -1) {
-                            fprintf(stderr, "Failed to write to the notification FIFO about writing in subscription!");
-                            return -1;
-                        }
-                        subNode->ativo = 0;
-                    }
-
-                    prevSub = subNode;
-                    subNode = prevSub->next;
+            // Deleted for everyone: unlink it, readers may still be on it
+            if (seen != NULL && seen == keyNode->versions && seen->value == NULL) {
+                __atomic_store_n(link, keyNode->next, __ATOMIC_RELEASE);
+                btree_delete(&ht->index, keyNode->key);
+                if (ht->clock_hand.node == keyNode) {
+                    ht->clock_hand.node = NULL; // Back to the start of the bucket
                 }
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+                keyNode->retired_at = __atomic_load_n(&ht->commit_seq, __ATOMIC_ACQUIRE);
+                keyNode->retired_next = ht->retired;
+                ht->retired = keyNode;
+                continue;
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+            link = &keyNode->next;
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
     }
 
-    return 1;
+    __atomic_store_n(&ht->garbage, 0, __ATOMIC_RELAXED);
+    size_t threshold = ht->index.size > GC_MIN_GARBAGE ? ht->index.size : GC_MIN_GARBAGE;
+    __atomic_store_n(&ht->gc_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void table_cursor_init(TableCursor *cursor) {
+    cursor->bucket = 0;
+    cursor->node = NULL;
+}
+
+KeyNode *table_cursor_next(HashTable *ht, TableCursor *cursor) {
+    KeyNode *next = NULL;
+    if (cursor->node != NULL) {
+        next = __atomic_load_n(&cursor->node->next, __ATOMIC_ACQUIRE);
+    } else if (cursor->bucket < TABLE_SIZE) {
+        next = __atomic_load_n(&ht->table[cursor->bucket], __ATOMIC_ACQUIRE);
+    }
+
+    while (next == NULL) {
+        cursor->bucket++;
+        if (cursor->bucket >= TABLE_SIZE) {
+            cursor->bucket = TABLE_SIZE;
+            cursor->node = NULL;
+            return NULL;
+        }
+        next = __atomic_load_n(&ht->table[cursor->bucket], __ATOMIC_ACQUIRE);
+    }
+
+    cursor->node = next;
+    return next;
 }
 
 void free_table(HashTable *ht) {
     for (int i = 0; i < TABLE_SIZE; i++) {
         KeyNode *keyNode = ht->table[i];
-        Subscribers *subNode;
-
         while (keyNode != NULL) {
-            subNode = keyNode->subs;
-
-            while(subNode != NULL){
-                Subscribers *subTemp = subNode;
-                subNode = subNode->next;
-                free(subTemp->sub_clients);
-                free(subTemp);
-            }
-            
             KeyNode *temp = keyNode;
             keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+            free_node(ht, temp);
         }
     }
+    while (ht->retired != NULL) {
+        KeyNode *temp = ht->retired;
+        ht->retired = temp->retired_next;
+        free_node(ht, temp);
+    }
+    btree_destroy(&ht->index);
+    pthread_mutex_destroy(&ht->readers_lock);
     pthread_rwlock_destroy(&ht->tablelock);
     free(ht);
 }
 
+size_t count_subscribers(HashTable *ht, const char *key) {
+    KeyNode *keyNode = find_node(ht, key);
+    size_t count = 0;
+    for (Subscribers *subNode = keyNode == NULL ? NULL : keyNode->subs; subNode != NULL;
+         subNode = subNode->next) {
+        count += subNode->ativo == 1;
+    }
+    return count;
+}
+
 int sub_key(HashTable *ht, const char * key, const char * client_id, int fd_notif){
     int index = hash(key);
     
@@ -216,6 +736,9 @@ int sub_key(HashTable *ht, const char * key, const char * client_id, int fd_noti
 
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
+            if (latest_version(keyNode, ttl_now_ms()) == NULL) {
+                return 0; // Deleted or expired, only kept for older snapshots
+            }
             subNode = keyNode->subs;
 
             // If we dont have subscribers inside the certain index of the hashtable
@@ -241,7 +764,7 @@ int sub_key(HashTable *ht, const char * key, const char * client_id, int fd_noti
             }
 
             // Se chegamos aqui significa que o cliente não estava subscrito e vamos inscrevê-lo
-            subNode = malloc(sizeof(subNode));
+            subNode = malloc(sizeof(Subscribers));
             subNode->sub_clients = strdup(client_id);
             subNode->fd_notif = fd_notif;
             subNode->ativo = 1;
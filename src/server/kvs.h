@@ -3,8 +3,11 @@
 #define TABLE_SIZE 26
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
 #include "src/common/constants.h"
+#include "btree.h"
 
 
 typedef struct Subscribers{
@@ -14,11 +17,29 @@ typedef struct Subscribers{
     struct Subscribers *next;
 } Subscribers;
 
+// A value of a key as of a commit. Versions never change once published;
+// a newer commit pushes a new one in front of them.
+typedef struct Version {
+    char *value; // NULL if the commit deleted the key, right after the version if short (see VALUE_INLINE_SIZE)
+    size_t value_len;
+    size_t compressed_len; // Bytes stored in value if it is compressed (see lz.h), 0 otherwise
+    uint64_t seq; // Commit that wrote it
+    uint64_t expires_at; // See ttl_now_ms, 0 if it never expires
+    struct Version *older;
+} Version;
+
 typedef struct KeyNode {
     char *key;
-    char *value;
+    size_t key_len;
+    Version *versions; // Newest first
+    // Serializes the commits that update the node in place, holding the
+    // table lock only for reading (see update_value)
+    pthread_mutex_t lock;
     Subscribers *subs;
     struct KeyNode *next;
+    unsigned char referenced; // Used since the eviction hand last passed
+    uint64_t retired_at; // Commit sequence when it was unlinked
+    struct KeyNode *retired_next;
 } KeyNode;
 
 typedef struct Chaves_subscritas{
@@ -34,34 +55,103 @@ typedef struct Client{
     int response_fd;
     int notification_fd;
     int active; // 1 if the session is active, 0 otherwise
+    pid_t peer_pid; // Credentials of the client process, over unix sockets only
+    uid_t peer_uid;
     struct Client* next;
     Chaves_subscritas *sub_keys;
 } Client;
 
+// A reader of the table. While it is registered, every version it can see
+// and every node it can reach stay allocated.
+typedef struct Snapshot {
+    uint64_t seq; // Sees the commits up to this one
+    uint64_t now_ms; // Sees the pairs that had not expired by then
+    struct Snapshot *prev;
+    struct Snapshot *next;
+} Snapshot;
+
+// Position of a walk over every node of the table.
+typedef struct TableCursor {
+    int bucket;
+    KeyNode *node; // Last node visited
+} TableCursor;
+
+// Nodes are only linked into the buckets (and unlinked by
+// collect_garbage) with the table lock held for writing, and their versions
+// are published atomically, so the buckets can be read under a snapshot
+// without the table lock. The index does need the lock for reading.
 typedef struct HashTable {
     KeyNode *table[TABLE_SIZE];
+    BTree index; // Every node of the table, ordered by key
     pthread_rwlock_t tablelock;
+    uint64_t next_seq; // Last commit sequence handed out
+    uint64_t commit_seq; // Every commit up to this one is visible
+    pthread_mutex_t readers_lock;
+    Snapshot *readers;
+    size_t garbage; // Versions superseded since the last collection
+    size_t gc_threshold; // Garbage that calls for the next collection
+    KeyNode *retired; // Unlinked nodes that readers may still reach
+    size_t memory_used; // Bytes of the nodes and versions allocated
+    uint64_t evictions; // Pairs evicted to stay within the memory budget
+    TableCursor clock_hand; // Where evict_pairs stopped
 } HashTable;
 
-typedef struct {
-    Client* clients[MAX_SESSION_COUNT];
-    int prodptr; // Buffer insertion index
-    int consptr; // Buffer extraction index
-    int count;
-} Buffer;
-
 /// Creates a new KVS hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
 int hash(const char *key); 
 
-// Writes a key value pair in the hash table.
+/// Starts a commit. The versions it writes are only seen by the snapshots
+/// taken after commit_end.
+/// @param ht The hash table.
+/// @return The sequence of the commit.
+uint64_t commit_begin(HashTable *ht);
+
+/// Publishes a commit, after every commit started before it.
+/// @param ht The hash table.
+/// @param seq The sequence of the commit.
+void commit_end(HashTable *ht, uint64_t seq);
+
+/// Registers a reader at the last published commit.
+/// @param ht The hash table.
+/// @param snapshot The snapshot.
+void snapshot_begin(HashTable *ht, Snapshot *snapshot);
+
+/// Unregisters a reader.
+/// @param ht The hash table.
+/// @param snapshot The snapshot.
+void snapshot_end(HashTable *ht, Snapshot *snapshot);
+
+/// Checks whether a version holds a value that has not expired.
+/// @param version The version.
+/// @param now_ms The current time (see ttl_now_ms).
+/// @return 1 if it does, 0 otherwise.
+int version_live(const Version *version, uint64_t now_ms);
+
+/// Gets the value of a pair as of a snapshot. Pairs expire as soon as their
+/// time is up, whether or not the reaper has deleted them yet.
+/// @param keyNode The pair.
+/// @param snapshot The snapshot.
+/// @return The version, NULL if the key did not exist then or had expired.
+Version *version_at(KeyNode *keyNode, const Snapshot *snapshot);
+
+/// Gets the last committed value of a pair. Commits may replace it unless
+/// the node lock or the table write lock is held.
+/// @param keyNode The pair.
+/// @param now_ms The current time (see ttl_now_ms).
+/// @return The version, NULL if the key was deleted or has expired.
+Version *latest_version(KeyNode *keyNode, uint64_t now_ms);
+
+// Writes a key value pair in the hash table. Must be called with the table
+// lock held for writing.
 // @param ht The hash table.
 // @param key The key.
-// @param value The value.
+// @param version The value (see new_version), with its expiration set. Owned
+//                by the table now, and freed if the pair cannot be written.
+// @param seq The commit writing it (see commit_begin).
 // @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, const char *key, Version *version, uint64_t seq);
 
 // Reads the value of a given key.
 // @param ht The hash table.
@@ -69,16 +159,112 @@ int write_pair(HashTable *ht, const char *key, const char *value);
 // return the value if found, NULL otherwise.
 char* read_pair(HashTable *ht, const char *key);
 
-/// Deletes a pair from the table.
+/// Looks up several keys at once. Nodes of deleted keys may be found, see
+/// version_at. Safe without the table lock while a snapshot is held. The
+/// keys are hashed up front and the buckets are visited in bucket order,
+/// prefetching each chain before it is walked, so every chain is brought
+/// into the cache once per batch.
+/// @param ht The hash table.
+/// @param num_keys Number of keys.
+/// @param keys The keys.
+/// @param nodes Stores the node of keys[i] in nodes[i], or NULL if the key
+///              does not exist. The nodes belong to the table and stay valid
+///              while the snapshot is registered (see snapshot_begin).
+void read_pairs(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], KeyNode **nodes);
+
+/// Allocates a version, with a copy of its value, compressed if it is long
+/// and compresses well (see value_compress).
+/// @param value The value, NULL for a deletion.
+/// @param value_len Length of the value.
+/// @return The version, NULL on failure.
+Version *new_version(const char *value, size_t value_len);
+
+/// Copies the value of a version, decompressing it if needed. Does not
+/// allocate.
+/// @param version The version, which holds a value.
+/// @param dst Room for value_len bytes.
+/// @return 0 if successful, 1 if the compressed value is not valid.
+int version_copy(const Version *version, char *dst);
+
+/// Gets the value of a version, decompressing it if needed.
+/// @param version The version, which holds a value.
+/// @param scratch Buffer the value is decompressed into, grown as needed and
+///                freed by the caller.
+/// @param scratch_cap Size of scratch.
+/// @return The value (value_len bytes), NULL on failure.
+const char *version_value(const Version *version, char **scratch, size_t *scratch_cap);
+
+/// Frees a version and its value.
+/// @param version The version.
+void free_version(Version *version);
+
+/// Pushes a new version of an existing pair and notifies its subscribers.
+/// Must be called with either the table lock held for writing, or the table
+/// lock held for reading and the node lock held.
+/// @param ht The hash table.
+/// @param keyNode The pair.
+/// @param version The new version (see new_version), owned by the node now.
+/// @param seq The commit writing it (see commit_begin).
+void update_value(HashTable *ht, KeyNode *keyNode, Version *version, uint64_t seq);
+
+/// Deletes a pair from the table. The node stays in the table for the
+/// snapshots that still see the pair, until collect_garbage unlinks it. Must
+/// be called with the table lock held for writing.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
+/// @param seq The commit deleting it (see commit_begin).
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+int delete_pair(HashTable *ht, const char *key, uint64_t seq);
+
+/// Deletes a pair whose time to live is up, telling its subscribers it
+/// expired. Must be called with the table lock held for writing.
+/// @param ht The hash table.
+/// @param key Key of the pair.
+/// @param expires_at Expiration the pair was written with, so a pair written
+///                   again since then is left alone.
+/// @param seq The commit deleting it (see commit_begin).
+/// @return 0 if the pair was deleted, 1 otherwise.
+int expire_pair(HashTable *ht, const char *key, uint64_t expires_at, uint64_t seq);
+
+/// Evicts pairs until about the given number of bytes can be freed, picking
+/// them with the CLOCK approximation of LRU: a hand goes round the table and
+/// evicts the first pairs that were not read or written since it last passed
+/// them. Reads only set a bit of the node. Subscribers are told the pair was
+/// evicted; the memory is freed by the next collect_garbage. Must be called
+/// with the table lock held for writing.
+/// @param ht The hash table.
+/// @param bytes Bytes to free.
+/// @param seq The commit deleting the pairs (see commit_begin).
+/// @return Bytes the evicted pairs take.
+size_t evict_pairs(HashTable *ht, size_t bytes, uint64_t seq);
+
+/// Frees the versions no snapshot can see anymore, unlinks the deleted pairs
+/// and frees the unlinked nodes no reader can reach anymore. Must be called
+/// with the table lock held for writing.
+/// @param ht The hash table.
+void collect_garbage(HashTable *ht);
+
+/// Starts a walk over the table.
+/// @param cursor The cursor.
+void table_cursor_init(TableCursor *cursor);
+
+/// Moves to the next node of the table, deleted pairs included. Safe without
+/// the table lock while a snapshot is held.
+/// @param ht The hash table.
+/// @param cursor The cursor.
+/// @return The next node, NULL once every bucket was visited.
+KeyNode *table_cursor_next(HashTable *ht, TableCursor *cursor);
 
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
+/// Counts the clients subscribed to a pair.
+/// @param ht Hash table of the pair.
+/// @param key Key of the pair.
+/// @return The active subscriptions, 0 if there is no such pair.
+size_t count_subscribers(HashTable *ht, const char *key);
+
 int sub_key(HashTable *ht, const char * key, const char * client_id, int fd_notif);
 int unsub_key(HashTable *ht, const char * key, const char * client_id);
 int iniciar_subscricao(Client *client, const char* key);
@@ -0,0 +1,305 @@
+#include "lockprof.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/common/io.h"
+#include "trace.h"
+
+#define LINE_SIZE 256
+
+typedef enum { LOCK_MUTEX, LOCK_READ, LOCK_WRITE } LockKind;
+
+static const char *kind_names[] = {"mutex", "read", "write"};
+
+// The counters of one call site.
+typedef struct LockSite {
+  int state;  // SITE_FREE, SITE_FILLING or SITE_READY
+  const char *name;
+  const char *file;
+  int line;
+  LockKind kind;
+  uint64_t acquired;
+  uint64_t contended;  // Times the lock was taken by another thread
+  uint64_t wait_ns;
+  uint64_t max_wait_ns;
+  uint64_t hold_ns;
+  uint64_t max_hold_ns;
+} LockSite;
+
+#define SITE_FREE 0
+#define SITE_FILLING 1
+#define SITE_READY 2
+
+// A lock the calling thread holds.
+typedef struct Held {
+  void *lock;
+  LockSite *site;
+  uint64_t since_ns;
+} Held;
+
+static int enabled = 0;
+static int stopping = 0;
+static pthread_t reporter_thread;
+static LockSite sites[LOCKPROF_MAX_SITES];
+static _Thread_local Held held[LOCKPROF_MAX_HELD];
+static _Thread_local size_t num_held = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void store_max(uint64_t *max, uint64_t value) {
+  uint64_t seen = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > seen &&
+         !__atomic_compare_exchange_n(max, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // seen was refreshed
+  }
+}
+
+// Finds the site of a call, claiming a free one the first time.
+// @return The site, NULL if every site is taken.
+static LockSite *find_site(const char *name, const char *file, int line, LockKind kind) {
+  size_t start = ((uintptr_t)file * 31 + (size_t)line) % LOCKPROF_MAX_SITES;
+  for (size_t i = 0; i < LOCKPROF_MAX_SITES; i++) {
+    LockSite *site = &sites[(start + i) % LOCKPROF_MAX_SITES];
+    int state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+    if (state == SITE_FREE) {
+      int expected = SITE_FREE;
+      if (__atomic_compare_exchange_n(&site->state, &expected, SITE_FILLING, 0, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_ACQUIRE)) {
+        site->name = name;
+        site->file = file;
+        site->line = line;
+        site->kind = kind;
+        __atomic_store_n(&site->state, SITE_READY, __ATOMIC_RELEASE);
+        return site;
+      }
+      state = expected;
+    }
+    while (state == SITE_FILLING) {
+      state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+    }
+    if (site->file == file && site->line == line && site->kind == kind) {
+      return site;
+    }
+  }
+  return NULL;
+}
+
+static int try_lock(void *lock, LockKind kind) {
+  if (kind == LOCK_MUTEX) {
+    return pthread_mutex_trylock(lock);
+  } else if (kind == LOCK_READ) {
+    return pthread_rwlock_tryrdlock(lock);
+  }
+  return pthread_rwlock_trywrlock(lock);
+}
+
+static int block_lock(void *lock, LockKind kind) {
+  if (kind == LOCK_MUTEX) {
+    return pthread_mutex_lock(lock);
+  } else if (kind == LOCK_READ) {
+    return pthread_rwlock_rdlock(lock);
+  }
+  return pthread_rwlock_wrlock(lock);
+}
+
+// Takes a lock while profiling is off; the wait is still traced.
+static int plain_lock(void *lock, LockKind kind, const char *name) {
+  uint64_t traced = trace_now();
+  int result = block_lock(lock, kind);
+  if (result == 0) {
+    trace_span("lock", traced, trace_now(), name, kind);
+  }
+  return result;
+}
+
+static int acquire(void *lock, LockKind kind, const char *name, const char *file, int line) {
+  uint64_t traced = trace_now();
+  int result = try_lock(lock, kind);
+  int contended = result == EBUSY;
+  uint64_t wait = 0;
+  uint64_t now;
+  if (contended) {
+    uint64_t start = now_ns();
+    result = block_lock(lock, kind);
+    now = now_ns();
+    wait = now - start;
+  } else {
+    now = now_ns();
+  }
+  if (result != 0) {
+    return result;
+  }
+  trace_span("lock", traced, now, name, kind);
+
+  LockSite *site = find_site(name, file, line, kind);
+  if (site != NULL) {
+    __atomic_add_fetch(&site->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+      __atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&site->wait_ns, wait, __ATOMIC_RELAXED);
+      store_max(&site->max_wait_ns, wait);
+    }
+  }
+  if (num_held < LOCKPROF_MAX_HELD) {
+    held[num_held++] = (Held){lock, site, now};
+  }
+  return 0;
+}
+
+// Records how long the calling thread held a lock it is about to release.
+static void release(void *lock) {
+  size_t i = num_held;
+  while (i > 0 && held[i - 1].lock != lock) {
+    i--;
+  }
+  if (i == 0) {
+    return;  // Taken while profiling was off or too many were held
+  }
+  Held *entry = &held[i - 1];
+  if (entry->site != NULL) {
+    uint64_t hold = now_ns() - entry->since_ns;
+    __atomic_add_fetch(&entry->site->hold_ns, hold, __ATOMIC_RELAXED);
+    store_max(&entry->site->max_hold_ns, hold);
+  }
+  memmove(entry, entry + 1, (num_held - i) * sizeof(Held));
+  num_held--;
+}
+
+int lockprof_mutex_lock(pthread_mutex_t *mutex, const char *name, const char *file, int line) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    return plain_lock(mutex, LOCK_MUTEX, name);
+  }
+  return acquire(mutex, LOCK_MUTEX, name, file, line);
+}
+
+int lockprof_mutex_unlock(pthread_mutex_t *mutex) {
+  if (__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    release(mutex);
+  }
+  return pthread_mutex_unlock(mutex);
+}
+
+int lockprof_rdlock(pthread_rwlock_t *rwlock, const char *name, const char *file, int line) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    return plain_lock(rwlock, LOCK_READ, name);
+  }
+  return acquire(rwlock, LOCK_READ, name, file, line);
+}
+
+int lockprof_wrlock(pthread_rwlock_t *rwlock, const char *name, const char *file, int line) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    return plain_lock(rwlock, LOCK_WRITE, name);
+  }
+  return acquire(rwlock, LOCK_WRITE, name, file, line);
+}
+
+int lockprof_rwunlock(pthread_rwlock_t *rwlock) {
+  if (__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    release(rwlock);
+  }
+  return pthread_rwlock_unlock(rwlock);
+}
+
+static int by_wait(const void *a, const void *b) {
+  const LockSite *first = *(LockSite *const *)a;
+  const LockSite *second = *(LockSite *const *)b;
+  uint64_t wait_a = __atomic_load_n(&first->wait_ns, __ATOMIC_RELAXED);
+  uint64_t wait_b = __atomic_load_n(&second->wait_ns, __ATOMIC_RELAXED);
+  if (wait_a != wait_b) {
+    return wait_a < wait_b ? 1 : -1;
+  }
+  uint64_t hold_a = __atomic_load_n(&first->hold_ns, __ATOMIC_RELAXED);
+  uint64_t hold_b = __atomic_load_n(&second->hold_ns, __ATOMIC_RELAXED);
+  return hold_a < hold_b ? 1 : hold_a > hold_b ? -1 : 0;
+}
+
+void lockprof_report(int fd) {
+  LockSite *ranked[LOCKPROF_MAX_SITES];
+  size_t count = 0;
+  for (size_t i = 0; i < LOCKPROF_MAX_SITES; i++) {
+    if (__atomic_load_n(&sites[i].state, __ATOMIC_ACQUIRE) == SITE_READY) {
+      ranked[count++] = &sites[i];
+    }
+  }
+  qsort(ranked, count, sizeof(ranked[0]), by_wait);
+
+  char line[LINE_SIZE];
+  int len = snprintf(line, sizeof(line), "%-4s %-22s %-5s %-28s %10s %10s %10s %10s %10s %10s %10s\n",
+                     "rank", "lock", "kind", "site", "acquired", "contended", "wait_ms", "max_wait_us",
+                     "hold_ms", "avg_hold_us", "max_hold_us");
+  write_all(fd, line, (size_t)len);
+  for (size_t i = 0; i < count; i++) {
+    const LockSite *site = ranked[i];
+    uint64_t acquired = __atomic_load_n(&site->acquired, __ATOMIC_RELAXED);
+    uint64_t hold_ns = __atomic_load_n(&site->hold_ns, __ATOMIC_RELAXED);
+    const char *file = strrchr(site->file, '/');
+    char where[64];
+    snprintf(where, sizeof(where), "%s:%d", file == NULL ? site->file : file + 1, site->line);
+    len = snprintf(line, sizeof(line),
+                   "%-4zu %-22s %-5s %-28s %10llu %10llu %10.3f %10.1f %10.3f %10.1f %10.1f\n", i + 1,
+                   site->name, kind_names[site->kind], where, (unsigned long long)acquired,
+                   (unsigned long long)__atomic_load_n(&site->contended, __ATOMIC_RELAXED),
+                   (double)__atomic_load_n(&site->wait_ns, __ATOMIC_RELAXED) / 1e6,
+                   (double)__atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED) / 1e3,
+                   (double)hold_ns / 1e6, acquired == 0 ? 0.0 : (double)hold_ns / (double)acquired / 1e3,
+                   (double)__atomic_load_n(&site->max_hold_ns, __ATOMIC_RELAXED) / 1e3);
+    write_all(fd, line, (size_t)len);
+  }
+}
+
+static void *reporter_loop(void *arg) {
+  (void)arg;
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR2);
+  while (1) {
+    int sig;
+    if (sigwait(&sigset, &sig) != 0) {
+      continue;
+    }
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    lockprof_report(STDERR_FILENO);
+  }
+  return NULL;
+}
+
+int lockprof_enable(void) {
+  // Inherited by every thread created from now on, so only the reporter
+  // takes the signal
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR2);
+  if (pthread_sigmask(SIG_BLOCK, &sigset, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR2\n");
+    return 1;
+  }
+  if (pthread_create(&reporter_thread, NULL, reporter_loop, NULL) != 0) {
+    fprintf(stderr, "Failed to create the lock profile thread\n");
+    return 1;
+  }
+  __atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void lockprof_stop(void) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_kill(reporter_thread, SIGUSR2);
+  pthread_join(reporter_thread, NULL);
+  lockprof_report(STDERR_FILENO);
+}
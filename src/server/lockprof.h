@@ -0,0 +1,61 @@
+#ifndef KVS_LOCKPROF_H
+#define KVS_LOCKPROF_H
+
+#include <pthread.h>
+
+// Optional profile of the busiest locks of the server (see lockprof_enable).
+// Their lock and unlock calls go through the macros below, which cost one
+// branch while profiling is off (and trace the waits as "lock" spans while
+// tracing is on, see trace.h). Once it is on, every call site keeps how
+// often it took its lock, how often it found it taken, and how long it
+// waited for and held it. Taking a free lock costs a trylock and a clock
+// read; the clock is only read twice more for locks that were taken.
+//
+// Sites are ranked by the time waited there, in the report written on
+// SIGUSR2 and by lockprof_stop.
+#define LOCKPROF_MAX_SITES 128
+#define LOCKPROF_MAX_HELD 80  // Locks a thread can hold and still be timed
+
+#define prof_mutex_lock(mutex, name) lockprof_mutex_lock(mutex, name, __FILE__, __LINE__)
+#define prof_mutex_unlock(mutex) lockprof_mutex_unlock(mutex)
+#define prof_rdlock(rwlock, name) lockprof_rdlock(rwlock, name, __FILE__, __LINE__)
+#define prof_wrlock(rwlock, name) lockprof_wrlock(rwlock, name, __FILE__, __LINE__)
+#define prof_rwunlock(rwlock) lockprof_rwunlock(rwlock)
+
+/// Turns profiling on and starts the thread that reports on SIGUSR2. Must be
+/// called before any other thread is created, so they all leave SIGUSR2 to
+/// that thread.
+/// @return 0 if successful, 1 otherwise.
+int lockprof_enable(void);
+
+/// Writes the report and stops the reporting thread, if profiling is on.
+void lockprof_stop(void);
+
+/// Writes the ranked report of every site seen so far.
+/// @param fd File descriptor to write to.
+void lockprof_report(int fd);
+
+/// Locks a mutex (see prof_mutex_lock).
+/// @param name Name of the lock in the report.
+/// @param file Source file of the call.
+/// @param line Line of the call.
+/// @return The result of pthread_mutex_lock.
+int lockprof_mutex_lock(pthread_mutex_t *mutex, const char *name, const char *file, int line);
+
+/// Unlocks a mutex taken with prof_mutex_lock.
+/// @return The result of pthread_mutex_unlock.
+int lockprof_mutex_unlock(pthread_mutex_t *mutex);
+
+/// Locks a rwlock for reading (see prof_rdlock).
+/// @return The result of pthread_rwlock_rdlock.
+int lockprof_rdlock(pthread_rwlock_t *rwlock, const char *name, const char *file, int line);
+
+/// Locks a rwlock for writing (see prof_wrlock).
+/// @return The result of pthread_rwlock_wrlock.
+int lockprof_wrlock(pthread_rwlock_t *rwlock, const char *name, const char *file, int line);
+
+/// Unlocks a rwlock taken with prof_rdlock or prof_wrlock.
+/// @return The result of pthread_rwlock_unlock.
+int lockprof_rwunlock(pthread_rwlock_t *rwlock);
+
+#endif  // KVS_LOCKPROF_H
@@ -0,0 +1,177 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LAST_LITERALS 5  // A block ends with at least this many literals
+#define MATCH_LIMIT 12   // and no match starts in its last bytes
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static size_t hash4(uint32_t value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the bytes that follow a nibble of 15.
+// @param len The length, minus 15.
+// @return 0 if successful, 1 if the block is full.
+static int put_length(unsigned char **out, const unsigned char *end, size_t len) {
+  while (len >= 255) {
+    if (*out == end) {
+      return 1;
+    }
+    *(*out)++ = 255;
+    len -= 255;
+  }
+  if (*out == end) {
+    return 1;
+  }
+  *(*out)++ = (unsigned char)len;
+  return 0;
+}
+
+// Writes a sequence of literals followed by a match (none if match_len is 0).
+// @return 0 if successful, 1 if the block is full.
+static int put_sequence(unsigned char **out, const unsigned char *end, const unsigned char *literals,
+                        size_t num_literals, size_t offset, size_t match_len) {
+  if (*out == end) {
+    return 1;
+  }
+  unsigned char *token = (*out)++;
+  *token = (unsigned char)((num_literals >= 15 ? 15 : num_literals) << 4);
+  if (num_literals >= 15 && put_length(out, end, num_literals - 15) != 0) {
+    return 1;
+  }
+  if ((size_t)(end - *out) < num_literals) {
+    return 1;
+  }
+  memcpy(*out, literals, num_literals);
+  *out += num_literals;
+
+  if (match_len == 0) {
+    return 0;
+  }
+  if (end - *out < 2) {
+    return 1;
+  }
+  *(*out)++ = (unsigned char)offset;
+  *(*out)++ = (unsigned char)(offset >> 8);
+  size_t code = match_len - LZ_MIN_MATCH;
+  *token |= (unsigned char)(code >= 15 ? 15 : code);
+  if (code >= 15 && put_length(out, end, code - 15) != 0) {
+    return 1;
+  }
+  return 0;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap) {
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  const unsigned char *out_end = out + cap;
+  if (len >= UINT32_MAX) {
+    return 0;
+  }
+
+  // Position + 1 of the last 4 bytes seen with each hash, 0 if none
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  size_t anchor = 0;  // First byte not written yet
+  size_t pos = 0;
+  while (pos + MATCH_LIMIT <= len) {
+    uint32_t bytes = read32(in + pos);
+    size_t h = hash4(bytes);
+    size_t ref = table[h];
+    table[h] = (uint32_t)(pos + 1);
+    if (ref == 0 || pos - (ref - 1) > MAX_OFFSET || read32(in + ref - 1) != bytes) {
+      // Skip faster through data that does not compress
+      pos += 1 + ((pos - anchor) >> 6);
+      continue;
+    }
+    ref--;
+
+    size_t match_len = LZ_MIN_MATCH;
+    while (pos + match_len < len - LAST_LITERALS && in[ref + match_len] == in[pos + match_len]) {
+      match_len++;
+    }
+    if (put_sequence(&out, out_end, in + anchor, pos - anchor, pos - ref, match_len) != 0) {
+      return 0;
+    }
+    pos += match_len;
+    anchor = pos;
+  }
+
+  if (put_sequence(&out, out_end, in + anchor, len - anchor, 0, 0) != 0) {
+    return 0;
+  }
+  return (size_t)(out - (unsigned char *)dst);
+}
+
+// Reads the bytes that follow a nibble of 15 and adds them to len.
+// @return 0 if successful, 1 if the block ends first.
+static int get_length(const unsigned char **in, const unsigned char *end, size_t *len) {
+  unsigned char byte;
+  do {
+    if (*in == end) {
+      return 1;
+    }
+    byte = *(*in)++;
+    *len += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int lz_decompress(const char *src, size_t len, char *dst, size_t out_len) {
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *in_end = in + len;
+  unsigned char *out = (unsigned char *)dst;
+  size_t written = 0;
+
+  while (in < in_end) {
+    unsigned char token = *in++;
+    size_t num_literals = (size_t)(token >> 4);
+    if (num_literals == 15 && get_length(&in, in_end, &num_literals) != 0) {
+      return 1;
+    }
+    if ((size_t)(in_end - in) < num_literals || out_len - written < num_literals) {
+      return 1;
+    }
+    memcpy(out + written, in, num_literals);
+    in += num_literals;
+    written += num_literals;
+    if (in == in_end) {
+      break;  // The last sequence has no match
+    }
+
+    if (in_end - in < 2) {
+      return 1;
+    }
+    size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && get_length(&in, in_end, &match_len) != 0) {
+      return 1;
+    }
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > written || out_len - written < match_len) {
+      return 1;
+    }
+
+    if (offset >= match_len) {
+      memcpy(out + written, out + written - offset, match_len);
+    } else {
+      // The match overlaps the bytes it produces
+      for (size_t i = 0; i < match_len; i++) {
+        out[written + i] = out[written - offset + i];
+      }
+    }
+    written += match_len;
+  }
+
+  return written == out_len ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+
+// Compression of values in the LZ4 block format: a series of sequences, each
+// a token (literal count in the high nibble, match length - 4 in the low
+// one), more literal count bytes if the nibble is 15, the literals, a 2 byte
+// little-endian match offset and more match length bytes if that nibble is
+// 15. The last sequence only has literals. Blocks carry no length, so the
+// original length is stored next to them.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+/// Compresses a buffer.
+/// @param src Bytes to compress.
+/// @param len Number of bytes.
+/// @param dst Where to store the block.
+/// @param cap Size of dst.
+/// @return Length of the block, 0 if it does not fit in cap bytes.
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+
+/// Decompresses a block.
+/// @param src The block.
+/// @param len Length of the block.
+/// @param dst Where to store the bytes.
+/// @param out_len Number of bytes the block decompresses to.
+/// @return 0 if successful, 1 if the block is not valid.
+int lz_decompress(const char *src, size_t len, char *dst, size_t out_len);
+
+#endif  // KVS_LZ_H
@@ -9,18 +9,29 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
-#include <semaphore.h>
 #include <signal.h>
 
+#include "aio.h"
+#include "encoder.h"
+#include "hotkeys.h"
 #include "kvs.h"
 #include "constants.h"
 #include "parser.h"
 #include "operations.h"
 #include "io.h"
+#include "lockprof.h"
+#include "metrics.h"
+#include "mpmc.h"
+#include "numa.h"
 #include "pthread.h"
+#include "shard.h"
+#include "trace.h"
+#include "transport.h"
+#include "watch.h"
 #include "src/common/io.h"
 #include "src/common/protocol.h"
 #include "src/common/constants.h"
+#include "src/common/shm.h"
 
 struct SharedData {
   DIR* dir;
@@ -34,50 +45,48 @@ pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 size_t active_backups = 0;          // Number of active backups 
 size_t max_backups;                // Maximum allowed simultaneous backups
 size_t max_threads;               // Maximum allowed simultaneous threads  
+size_t max_sessions = MAX_SESSION_COUNT;  // Clients served at the same time
 char register_fifo_name[MAX_PIPE_PATH_LENGTH] = "/tmp/";     // Register FIFO name
 char* jobs_directory = NULL;        // Jobs directory                      
 Client *clients;                   // Array of clients                    
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;  // Host and session threads change clients
 int session_count = 0;            // Number of active sessions           
+int watch_mode = 0;               // 1 to keep picking up new job files  
 
 
-// New stuff
-Buffer shared_buffer = {.consptr = 0, .prodptr = 0}; // Data structure buffer that host sends to a client 
-sem_t semPodeProd; // Tracks empty slots in the buffer
-sem_t semPodeCons; // Tracks filled slots in the buffer
-pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for buffer operations
-int buffer_index = 0; // Helps tracking
+MpmcQueue session_queue;          // Clients registered by the host, waiting for a session thread
 
 
-void sigusr1_handler(int sig) {
+static volatile sig_atomic_t disconnect_requested = 0;  // Set by SIGUSR1, for the host thread
 
+void sigusr1_handler(int sig) {
+  if (sig == SIGUSR1) {
+    disconnect_requested = 1;
+  }
+}
 
+// Ends every subscription and tells every client to go, as SIGUSR1 asks.
+// Runs on the host thread: writing and closing a ring may take locks and
+// sleep, which a signal handler must not.
+static void disconnect_clients(void) {
   char buffer[MAX_KEY_SIZE];
   strcpy(buffer, "disconnect_sigma");
-  
-  if(sig == SIGUSR1) {
-    delete_subscriptions(clients);
-    while (clients != NULL){
-      if (clients->notification_fd != 0){
-        if (write_all(clients->notification_fd, buffer, MAX_KEY_SIZE) == -1) {
-          fprintf(stderr, "Failed to write to the response FIFO\n");
-          return;
-        }
-        close(clients->notification_fd);
-        close(clients->response_fd);
+
+  pthread_mutex_lock(&clients_lock);
+  delete_subscriptions(clients);
+  while (clients != NULL){
+    if (clients->notification_fd != 0){
+      if (write_all(clients->notification_fd, buffer, MAX_KEY_SIZE) == -1) {
+        fprintf(stderr, "Failed to write to the response FIFO\n");
+        break;
       }
-      clients = clients->next;
+      shm_close(clients->notification_fd);
+      shm_close(clients->response_fd);
     }
-    session_count = 0;
+    clients = clients->next;
   }
-}
-
-void initialize_buffer() {
-    sem_init(&semPodeProd, 0, MAX_SESSION_COUNT);  // Buffer starts empty
-    sem_init(&semPodeCons, 0, 0);            // No sessions to process initially
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-      shared_buffer.clients[i] = NULL;
-    }
-    pthread_mutex_init(&buffer_mutex, NULL); // Mutex for buffer access
+  pthread_mutex_unlock(&clients_lock);
+  session_count = 0;
 }
 
 int filter_job_files(const struct dirent* entry) {
@@ -88,20 +97,20 @@ int filter_job_files(const struct dirent* entry) {
     return 0;
 }
 
-static int entry_files(const char* dir, struct dirent* entry, char* in_path, char* out_path) {
-  const char* dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 || strcmp(dot, ".job")) {
+static int entry_files(const char* dir, const char* name, char* in_path, char* out_path) {
+  const char* dot = strrchr(name, '.');
+  if (dot == NULL || dot == name || strlen(dot) != 4 || strcmp(dot, ".job")) {
     return 1;
   }
 
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
+  if (strlen(name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", dir, name);
     return 1;
   }
 
   strcpy(in_path, dir);
   strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
+  strcat(in_path, name);
 
   strcpy(out_path, in_path);
   strcpy(strrchr(out_path, '.'), ".out");
@@ -109,24 +118,44 @@ static int entry_files(const char* dir, struct dirent* entry, char* in_path, cha
   return 0;
 }
 
-static int run_job(int in_fd, int out_fd, char* filename) {
+// Names of the commands in traces, by enum Command
+static const char* command_names[] = {
+    "WRITE", "READ", "DELETE", "RANGE", "PREFIX", "CAS", "TXN", "SHOW", "SHOW SORTED",
+    "STATS", "STATS JSON", "TRACE ON", "TRACE OFF", "HOTKEYS", "WAIT", "BACKUP", "HELP", "EMPTY",
+    "INVALID", "EOC",
+};
+
+// Runs the commands of a job file.
+// @param values Storage for the values of a command, reused by the next one.
+// @param expected Storage for the expected values of CAS and TXN.
+static int run_commands(int in_fd, int out_fd, char* filename, ValueList* values, ValueList* expected) {
   size_t file_backups = 0;
+  // Keys of the write set of TXN, filled by its parser
+  char write_keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
 
   while (1) {
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
     unsigned int delay;
+    unsigned int ttl_ms;
     size_t num_pairs;
+    size_t num_reads;
+    uint64_t started = 0;  // Set by the commands that run an operation
+    int failed;
+    uint64_t parsing = trace_now();
+    enum Command cmd = get_next(in_fd);
 
-    switch (get_next(in_fd)) {
+    switch (cmd) {
       case CMD_WRITE:
-        num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE, &ttl_ms);
         if (num_pairs == 0) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (kvs_write(num_pairs, keys, values)) {
+        started = metrics_now();
+        failed = kvs_write(num_pairs, keys, values, ttl_ms);
+        metrics_record(METRIC_WRITE, started, num_pairs, failed);
+        if (failed) {
           write_str(STDERR_FILENO, "Failed to write pair\n");
         }
         break;
@@ -139,7 +168,10 @@ static int run_job(int in_fd, int out_fd, char* filename) {
           continue;
         }
 
-        if (kvs_read(num_pairs, keys, out_fd)) {
+        started = metrics_now();
+        failed = kvs_read(num_pairs, keys, out_fd);
+        metrics_record(METRIC_READ, started, num_pairs, failed);
+        if (failed) {
           write_str(STDERR_FILENO, "Failed to read pair\n");
         }
         break;
@@ -152,13 +184,104 @@ static int run_job(int in_fd, int out_fd, char* filename) {
           continue;
         }
 
-        if (kvs_delete(num_pairs, keys, out_fd)) {
+        started = metrics_now();
+        failed = kvs_delete(num_pairs, keys, out_fd);
+        metrics_record(METRIC_DELETE, started, num_pairs, failed);
+        if (failed) {
           write_str(STDERR_FILENO, "Failed to delete pair\n");
         }
         break;
 
+      case CMD_CAS:
+        num_pairs = parse_cas(in_fd, keys, expected, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        if (num_pairs == 0) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        started = metrics_now();
+        failed = kvs_cas(num_pairs, keys, expected, values, out_fd);
+        metrics_record(METRIC_CAS, started, num_pairs, failed);
+        if (failed) {
+          write_str(STDERR_FILENO, "Failed to compare and swap pair\n");
+        }
+        break;
+
+      case CMD_TXN:
+        num_pairs = parse_txn(in_fd, keys, expected, &num_reads, write_keys, values, MAX_WRITE_SIZE,
+                              MAX_STRING_SIZE);
+
+        if (num_pairs == 0) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        started = metrics_now();
+        failed = kvs_txn(num_reads, keys, expected, num_pairs, write_keys, values, out_fd);
+        metrics_record(METRIC_TXN, started, num_reads + num_pairs, failed);
+        if (failed) {
+          write_str(STDERR_FILENO, "Failed to commit transaction\n");
+        }
+        break;
+
+      case CMD_RANGE:
+        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        if (num_pairs != 2) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        started = metrics_now();
+        kvs_range(keys[0], keys[1], out_fd);
+        metrics_record(METRIC_SCAN, started, 0, 0);
+        break;
+
+      case CMD_PREFIX:
+        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        if (num_pairs != 1) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        started = metrics_now();
+        kvs_prefix(keys[0], out_fd);
+        metrics_record(METRIC_SCAN, started, 0, 0);
+        break;
+
       case CMD_SHOW:
+        started = metrics_now();
         kvs_show(out_fd);
+        metrics_record(METRIC_SHOW, started, 0, 0);
+        break;
+
+      case CMD_SHOW_SORTED:
+        started = metrics_now();
+        kvs_show_sorted(out_fd);
+        metrics_record(METRIC_SHOW, started, 0, 0);
+        break;
+
+      case CMD_STATS:
+      case CMD_STATS_JSON:
+        if (metrics_write(out_fd, cmd == CMD_STATS ? METRICS_TEXT : METRICS_JSON) != 0) {
+          write_str(STDERR_FILENO, "Failed to write stats\n");
+        }
+        break;
+
+      case CMD_HOTKEYS:
+        if (hotkeys_write(out_fd, METRICS_TEXT) != 0) {
+          write_str(STDERR_FILENO, "Failed to write hot keys\n");
+        }
+        break;
+
+      case CMD_TRACE_ON:
+        trace_start();
+        break;
+
+      case CMD_TRACE_OFF:
+        trace_stop();
         break;
 
       case CMD_WAIT:
@@ -168,20 +291,27 @@ static int run_job(int in_fd, int out_fd, char* filename) {
         }
 
         if (delay > 0) {
+          // Make the output so far visible while the job sleeps
+          aio_flush(out_fd);
           printf("Waiting %d seconds\n", delay / 1000);
           kvs_wait(delay);
         }
         break;
 
       case CMD_BACKUP:
-        pthread_mutex_lock(&n_current_backups_lock);
+        // Includes the wait for a backup to finish when too many are running
+        started = metrics_now();
+        prof_mutex_lock(&n_current_backups_lock, "n_current_backups_lock");
         if (active_backups >= max_backups) {
           wait(NULL);
         } else {
           active_backups++;
         }
-        pthread_mutex_unlock(&n_current_backups_lock);
+        prof_mutex_unlock(&n_current_backups_lock);
         int aux = kvs_backup(++file_backups, filename, jobs_directory);
+        if (aux != 1) {
+          metrics_record(METRIC_BACKUP, started, 0, aux < 0);
+        }
 
         if (aux < 0) {
             write_str(STDERR_FILENO, "Failed to do backup\n");
@@ -197,10 +327,17 @@ static int run_job(int in_fd, int out_fd, char* filename) {
       case CMD_HELP:
         write_str(STDOUT_FILENO,
             "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
+            "  WRITE [(key,value)(key2,value2),...] [TTL <ms>]\n"
             "  READ [key,key2,...]\n"
             "  DELETE [key,key2,...]\n"
-            "  SHOW\n"
+            "  RANGE [first,last]\n"
+            "  PREFIX [prefix]\n"
+            "  CAS [(key,expected,value)(key2,expected2,value2),...]\n"
+            "  TXN [(key,expected),...] [(key,value),...]\n"
+            "  SHOW [SORTED]\n"
+            "  STATS [JSON]\n"
+            "  HOTKEYS\n"
+            "  TRACE ON|OFF\n"
             "  WAIT <delay_ms>\n"
             "  BACKUP\n" // Not implemented
             "  HELP\n");
@@ -214,9 +351,67 @@ static int run_job(int in_fd, int out_fd, char* filename) {
         printf("EOF\n");
         return 0;
     }
+    if (parsing != 0 && started != 0) {
+      trace_span("parse", parsing, started, NULL, 0);
+      trace_span(command_names[cmd], started, trace_now(), NULL, 0);
+    }
   }
 }
 
+static int run_job(int in_fd, int out_fd, char* filename) {
+  ValueList values, expected;
+  value_list_init(&values);
+  value_list_init(&expected);
+
+  int result = run_commands(in_fd, out_fd, filename, &values, &expected);
+
+  value_list_free(&values);
+  value_list_free(&expected);
+  return result;
+}
+
+
+// Requests read ahead from a client, so that most of them take one read.
+typedef struct RequestBuffer {
+  int fd;
+  size_t start;
+  size_t end;
+  char data[REQUEST_BUFFER_SIZE];
+} RequestBuffer;
+
+// Reads the next bytes of the requests, like read_all.
+// @return 1 if successful, 0 on end of file, -1 on error.
+static int read_request(RequestBuffer* requests, char* dst, size_t size, int* intr) {
+  size_t copied = 0;
+  while (copied < size) {
+    if (requests->start == requests->end) {
+      ssize_t got = shm_read(requests->fd, requests->data, sizeof(requests->data));
+      if (got == -1) {
+        if (errno == EINTR) {
+          *intr = 1;
+          if (copied == 0) {
+            return -1;
+          }
+          continue;
+        }
+        return -1;
+      }
+      if (got == 0) {
+        return 0;
+      }
+      requests->start = 0;
+      requests->end = (size_t)got;
+    }
+    size_t n = requests->end - requests->start;
+    if (n > size - copied) {
+      n = size - copied;
+    }
+    memcpy(dst + copied, requests->data + requests->start, n);
+    requests->start += n;
+    copied += n;
+  }
+  return 1;
+}
 
 void handle_client_commands(Client * client){
 
@@ -226,15 +421,19 @@ void handle_client_commands(Client * client){
   // Basicamente meti um loop infinito no registration fifo e sempre que lia informacao sobre um cliente crio logo numa thread esta funcao
   // nao tenho a certeza que funciona mas agora conseguimos fazer isto
 
-  char op[1]; 
+  char op[2];
   char buffer[MAX_KEY_SIZE];
   int result;
+  uint64_t started;
+  uint64_t traced;
   int intr = 0;
   int killed = 0;
+  RequestBuffer requests = {.fd = client->request_fd};
   memset(buffer, '\0', MAX_KEY_SIZE);
   while (!killed){
 
-    if (read_all(client->request_fd, op, 1, &intr) == -1) {
+    int status = read_request(&requests, op, 1, &intr);
+    if (status == -1) {
       if (intr){
         fprintf(stderr, "Reading from request FIFO was interrupted\n");
       } else {
@@ -242,6 +441,13 @@ void handle_client_commands(Client * client){
       }
       return;
     }
+    if (status == 0) {
+      // The client is gone without disconnecting, its subscriptions go too
+      disconnect(client);
+      trace_instant("client gone", client->id, 0);
+      transport_close(client);
+      return;
+    }
     op[1] = '\0';
     switch(atoi(op)){
       case 9: // Caso especifico para quando der kill com o signal
@@ -252,6 +458,7 @@ void handle_client_commands(Client * client){
         break;
       case OP_CODE_DISCONNECT:
 
+        traced = trace_now();
         result = disconnect(client);
         if(result == 1){
           fprintf(stderr, "Failed to disconnect client\n");
@@ -261,24 +468,15 @@ void handle_client_commands(Client * client){
           fprintf(stderr, "Failed to write to the response FIFO\n");
           return;
         }
-
-        if (close(client->request_fd) == -1){
-          fprintf(stderr, "Failed to close fifo\n");
-        }
-
-        if (close(client->response_fd) == -1){
-          fprintf(stderr, "Failed to close fifo\n");
-        }
-      
-        if (close(client->notification_fd) == -1){
-          fprintf(stderr, "Failed to close fifo\n");
-        }
+        trace_span("disconnect", traced, trace_now(), client->id, result);
+        trace_instant("response sent", "disconnect", result);
+        transport_close(client);
         return;
         break;
 
       case OP_CODE_SUBSCRIBE:
 
-        if (read_all(client->request_fd, buffer, MAX_KEY_SIZE, &intr) == -1) {
+        if (read_request(&requests, buffer, MAX_KEY_SIZE, &intr) == -1) {
           if (intr){
             fprintf(stderr, "Reading from request FIFO was interrupted\n");
           } else {
@@ -286,7 +484,11 @@ void handle_client_commands(Client * client){
           }
         }
         
+        started = metrics_now();
         result = subscribe(buffer, client->id, client->response_fd, client->notification_fd);
+        metrics_record(METRIC_SUBSCRIBE, started, 1, result == -1);
+        trace_span("subscribe", started, trace_now(), buffer, result);
+        trace_instant("response sent", "subscribe", result);
 
         if (result == 1){
           if (iniciar_subscricao(client, buffer) == 1){
@@ -296,8 +498,20 @@ void handle_client_commands(Client * client){
         
         break;
 
+      case OP_CODE_RESET:
+        traced = trace_now();
+        result = reset_subscriptions(client);
+        snprintf(buffer, 3, "%s%d", op, result);
+        if (write_all(client->response_fd, buffer, 3) == -1) {
+          fprintf(stderr, "Failed to write to the response FIFO\n");
+          return;
+        }
+        trace_span("reset", traced, trace_now(), client->id, result);
+        trace_instant("response sent", "reset", result);
+        break;
+
       case OP_CODE_UNSUBSCRIBE:
-        if (read_all(client->request_fd, buffer, MAX_KEY_SIZE, &intr) == -1) {
+        if (read_request(&requests, buffer, MAX_KEY_SIZE, &intr) == -1) {
           if (intr){
             fprintf(stderr, "Reading from request FIFO was interrupted\n");
           } else {
@@ -305,7 +519,11 @@ void handle_client_commands(Client * client){
           }
           return;
         }
+        started = metrics_now();
         result = unsubscribe(buffer, client->id, client->response_fd);
+        metrics_record(METRIC_UNSUBSCRIBE, started, 1, result == -1);
+        trace_span("unsubscribe", started, trace_now(), buffer, result);
+        trace_instant("response sent", "unsubscribe", result);
 
         if (result == 0){
           if (apagar_subscricao(client->sub_keys, buffer) == 1){
@@ -335,32 +553,20 @@ void* run_client(void* args) {
       fprintf(stderr, "Error blocking the SIGUSR1 signal\n");
       pthread_exit(NULL);
   }
+  numa_pin(numa_next_slot());
+  trace_thread_name("session");
    while (1) {
-      sem_wait(&semPodeCons);  // Wait until a client is available
-      pthread_mutex_lock(&buffer_mutex);
-
-        // Access the client at the `out` index
-        Client* current_client = shared_buffer.clients[shared_buffer.consptr];
-
-        if (current_client == NULL) {
-            fprintf(stderr, "Error: NULL client at index %d\n", shared_buffer.consptr);
-            pthread_mutex_unlock(&buffer_mutex);
-            sem_post(&semPodeProd);  // Mark slot as empty
-            continue;              // Skip processing and retry
-        }
-
-        shared_buffer.consptr = (shared_buffer.consptr+1) % MAX_SESSION_COUNT;
-
-        pthread_mutex_unlock(&buffer_mutex);
-
-        sem_post(&semPodeProd);
-
+        // Waits until a client is available
+        Client* current_client = mpmc_pop(&session_queue);
 
         // Process the client outside the critical section
         // Process the client's request (this could be handling commands or something else)
         handle_client_commands(current_client);
 
         // Free the client memory after processing
+        pthread_mutex_lock(&clients_lock);
+        remove_client(&clients, current_client);
+        pthread_mutex_unlock(&clients_lock);
         free(current_client);
     }
     if (pthread_sigmask(SIG_UNBLOCK, &sigset, NULL) != 0) {
@@ -372,6 +578,67 @@ void* run_client(void* args) {
 
 
 
+// Runs a single job file, writing its results to the matching .out file.
+// @return 0 if the job ran until the end, 1 if the thread must exit, -1 if
+//         the job or its .out file could not be opened.
+static int process_job(const char* in_path, const char* out_path, char* filename) {
+  int in_fd = open(in_path, O_RDONLY);
+  if (in_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open input file: ");
+    write_str(STDERR_FILENO, in_path);
+    write_str(STDERR_FILENO, "\n");
+    return -1;
+  }
+
+  int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open output file: ");
+    write_str(STDERR_FILENO, out_path);
+    write_str(STDERR_FILENO, "\n");
+    close(in_fd);
+    return -1;
+  }
+
+  if (aio_open(in_fd, AIO_INPUT) != 0 || aio_open(out_fd, AIO_OUTPUT) != 0) {
+    write_str(STDERR_FILENO, "Failed to set up buffered I/O, using direct I/O\n");
+  }
+
+  int out = run_job(in_fd, out_fd, filename);
+
+  aio_close(in_fd);
+  aio_close(out_fd);
+  close(in_fd);
+  close(out_fd);
+  return out;
+}
+
+// Keeps feeding the job files reported by the directory watcher to this
+// thread until the watcher is stopped.
+static void watch_jobs(const char* dir_name) {
+  char name[MAX_JOB_FILE_NAME_SIZE];
+  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
+
+  while (watch_next(name, sizeof(name))) {
+    if (entry_files(dir_name, name, in_path, out_path)) {
+      watch_job_done(name);
+      continue;
+    }
+
+    // run_job may change the name it is given (kvs_backup tokenizes it)
+    char filename[MAX_JOB_FILE_NAME_SIZE];
+    strcpy(filename, name);
+    int out = process_job(in_path, out_path, filename);
+    if (out == 1) {
+      exit(0);  // A backup child, which must leave the watcher of the server alone
+    }
+    if (out == -1) {
+      watch_job_failed(name);  // It never ran, so it gets no marker
+      continue;
+    }
+    watch_job_done(name);
+  }
+}
+
 //frees arguments
 static void* get_file(void* arguments) {
   struct SharedData* thread_data = (struct SharedData*) arguments;
@@ -386,8 +653,15 @@ static void* get_file(void* arguments) {
       fprintf(stderr, "Error blocking the SIGUSR1 signal\n");
       pthread_exit(NULL);
   }
+  numa_pin(numa_next_slot());
+  trace_thread_name("job");
+
+  if (watch_mode) {
+    watch_jobs(dir_name);
+    pthread_exit(NULL);
+  }
 
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
+  if (prof_mutex_lock(&thread_data->directory_mutex, "directory_mutex") != 0) {
     fprintf(stderr, "Thread failed to lock directory_mutex\n");
     return NULL;
   }
@@ -395,36 +669,20 @@ static void* get_file(void* arguments) {
   struct dirent* entry;
   char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
   while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
+    if (entry_files(dir_name, entry->d_name, in_path, out_path)) {
       continue;
     }
 
-    if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
+    if (prof_mutex_unlock(&thread_data->directory_mutex) != 0) {
       fprintf(stderr, "Thread failed to unlock directory_mutex\n");
       return NULL;
     }
 
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
-      write_str(STDERR_FILENO, "\n");
+    int out = process_job(in_path, out_path, entry->d_name);
+    if (out == -1) {
       pthread_exit(NULL);
     }
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (out_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
-
-    int out = run_job(in_fd, out_fd, entry->d_name);
-
-    close(in_fd);
-    close(out_fd);
-
     if (out) {
       if (closedir(dir) == -1) {
         fprintf(stderr, "Failed to close directory\n");
@@ -434,13 +692,13 @@ static void* get_file(void* arguments) {
       exit(0);
     }
 
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
+    if (prof_mutex_lock(&thread_data->directory_mutex, "directory_mutex") != 0) {
       fprintf(stderr, "Thread failed to lock directory_mutex\n");
       return NULL;
     }
   }
 
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
+  if (prof_mutex_unlock(&thread_data->directory_mutex) != 0) {
     fprintf(stderr, "Thread failed to unlock directory_mutex\n");
     return NULL;
   }
@@ -457,114 +715,56 @@ static void* get_file(void* arguments) {
 
 // Function to be executed by the host thread
 /*
-  The host thread reads from the register fifo and registers clients while opening its fifos
+  The host thread takes the clients that register (see transport.h) and hands them to the session threads
 */
 void* get_register(void* arg){
 
-  initialize_buffer();
-  int intr = 0;
+  numa_pin(numa_next_slot());
+  trace_thread_name("host");
 
   if (arg != NULL){
     fprintf(stderr, "Invalid argument\n");
     return NULL;
   }
-  char buffer[BUFFER_SIZE];
-  struct sigaction sa;
-  sa.sa_handler = &sigusr1_handler;
+  // Without SA_RESTART, so a SIGUSR1 ends the wait for a client
+  struct sigaction sa = {.sa_handler = &sigusr1_handler};
+  sigemptyset(&sa.sa_mask);
   sigaction(SIGUSR1, &sa, NULL);
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
 
-  if (mkfifo(register_fifo_name, 0666) == -1 && errno != EEXIST){
-      fprintf(stderr, "Failed to create fifo\n");
-      return NULL;
+  if (transport_listen(register_fifo_name) != 0){
+    return NULL;
   }
-  
-  while (1){
-    int fd = open(register_fifo_name, O_RDONLY);
 
-    while ((errno == EINTR) && (fd == -1)){
-      errno = 0;
-      fd = open(register_fifo_name, O_RDONLY);
-    }
-    
-    if (fd == -1){
-      fprintf(stderr, "Failed to open register fifo\n");
-      return NULL;
+  while (1){
+    if (disconnect_requested) {
+      disconnect_requested = 0;
+      disconnect_clients();
     }
-    Client* client = (Client*)malloc(sizeof(Client));
-    client->id = malloc(sizeof(char)*MAX_KEY_SIZE);
 
+    Client* client = (Client*)calloc(1, sizeof(Client));  // No subscriptions yet
+    client->id = malloc(sizeof(char)*MAX_KEY_SIZE);
 
-    if (read_all(fd, buffer, BUFFER_SIZE, &intr) == -1){
-      if (intr == 1){
-        fprintf(stderr, "Reading from register FIFO was interrupted\n");
-      } else {
-        fprintf(stderr, "Failed to read from register fifo\n");
+    int result = transport_accept(client);
+    if (result != 0){
+      free(client->id);
+      free(client);
+      if (result == -1){
+        return NULL;
       }
-      return NULL;
-    }
-
-    // Handle Op-code
-    char *token = strtok(buffer, " ");
-
-
-    if (strcmp(token, "0") != 0){
-      fprintf(stderr, "Invalid command\n");
-      return NULL;
-    }
-    // Opens requests pipe for reading
-    token = strtok(NULL, " ");
-
-    int fd_req_pipe = open(token, O_RDONLY);
-    if (fd_req_pipe == -1){
-      fprintf(stderr, "Failed to open request fifo\n");
-      return NULL;
-    }
-    client->request_fd = fd_req_pipe;
-    // Opens response pipe for writing
-    token = strtok(NULL, " ");
-
-    int fd_resp_pipe = open(token, O_WRONLY);
-    if (fd_resp_pipe == -1){
-      fprintf(stderr, "Failed to open response fifo\n");
-      close(fd_req_pipe);
-      return NULL;
-    }
-    client->response_fd = fd_resp_pipe;
-
-    // Opens notification pipe for writing
-    token = strtok(NULL, " ");
-   
-    int fd_notif_pipe = open(token, O_WRONLY);
-    if (fd_notif_pipe == -1){
-      fprintf(stderr, "Failed to open notifications fifo\n");
-      close(fd_req_pipe);
-      close(fd_resp_pipe);
-      return NULL;
+      continue;
     }
-    client->notification_fd = fd_notif_pipe;
-
-    // Assigns an id to the client
-    token = strtok(NULL, " ");
-
-    strcpy(client->id, token);
+    trace_instant("client registered", client->id, client->peer_pid);
 
+    pthread_mutex_lock(&clients_lock);
     add_client(&clients, client);
+    pthread_mutex_unlock(&clients_lock);
   	
-    // Waits until writing to the buffer is available
-    sem_wait(&semPodeProd); 
-    pthread_mutex_lock(&buffer_mutex);
-
-    // Add client to the buffer
-
-    shared_buffer.clients[shared_buffer.prodptr] = client;
-
-    shared_buffer.prodptr = (shared_buffer.prodptr+1) % MAX_SESSION_COUNT;
-
-    pthread_mutex_unlock(&buffer_mutex);
-    sem_post(&semPodeCons); // Client is ready 
-
-    close(fd);
-  
+    // Hands the client to a session thread, waiting while the queue is full
+    mpmc_push(&session_queue, client);
   }
 
   return NULL;
@@ -573,24 +773,44 @@ void* get_register(void* arg){
 static void dispatch_threads(DIR* dir) {
   pthread_t* threads = malloc(max_threads * sizeof(pthread_t));
   pthread_t host_thread; // Tarefa Anfitriã
-  pthread_t client_threads[MAX_SESSION_COUNT];
+  pthread_t* client_threads = malloc(max_sessions * sizeof(pthread_t));
 
-  if (threads == NULL) {
+  if (threads == NULL || client_threads == NULL) {
     fprintf(stderr, "Failed to allocate memory for threads\n");
+    free(threads);
+    free(client_threads);
     return;
   }
 
   struct SharedData thread_data = {dir, jobs_directory, PTHREAD_MUTEX_INITIALIZER};
 
+  // The watch must exist before any worker asks for a job
+  if (watch_mode && watch_start(jobs_directory) != 0) {
+    pthread_mutex_destroy(&thread_data.directory_mutex);
+    free(threads);
+    free(client_threads);
+    return;
+  }
+
+  // The queue must exist before the session threads wait on it
+  if (mpmc_init(&session_queue, max_sessions) != 0) {
+    fprintf(stderr, "Failed to create the session queue\n");
+    pthread_mutex_destroy(&thread_data.directory_mutex);
+    free(threads);
+    free(client_threads);
+    return;
+  }
+
   // Create host thread
   if (pthread_create(&host_thread, NULL, get_register, NULL) != 0){
       fprintf(stderr, "Failed to create host task\n");
       pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
+      free(client_threads);
       return; 
   }
 
-  for (size_t i = 0; i < MAX_SESSION_COUNT; i++){
+  for (size_t i = 0; i < max_sessions; i++){
     if (pthread_create(&client_threads[i], NULL, run_client, NULL)) {
         fprintf(stderr, "Failed to create client thread %zu\n", i);
         pthread_mutex_destroy(&thread_data.directory_mutex);
@@ -603,6 +823,7 @@ static void dispatch_threads(DIR* dir) {
       fprintf(stderr, "Failed to create thread %zu\n", i);
       pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
+      free(client_threads);
       return;
     }
   }
@@ -614,6 +835,7 @@ static void dispatch_threads(DIR* dir) {
       fprintf(stderr, "Failed to join thread %u\n", i);
       pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
+      free(client_threads);
       return;
     }
   }
@@ -621,6 +843,7 @@ static void dispatch_threads(DIR* dir) {
     fprintf(stderr, "Failed to join host thread\n");
     pthread_mutex_destroy(&thread_data.directory_mutex);
     free(threads);
+    free(client_threads);
     return;
   }
 
@@ -629,34 +852,201 @@ static void dispatch_threads(DIR* dir) {
   }
 
   free(threads);
+  free(client_threads);
+}
+
+
+static void print_usage(const char* program) {
+  write_str(STDERR_FILENO, "Usage: ");
+  write_str(STDERR_FILENO, program);
+  write_str(STDERR_FILENO, " [-w] [-i sync|uring] [-o text|binary|binary-lz] [-m bytes] [-l bytes] [-z bytes] [-s shards] [-p] [-S stats_fifo] [-L] [-c sessions] [-T trace_file] [-t fifo|unix|tcp]");
+  write_str(STDERR_FILENO, " <jobs_dir>");
+  write_str(STDERR_FILENO, " <max_threads>");
+  write_str(STDERR_FILENO, " <max_backups>");
+  write_str(STDERR_FILENO, " <register_fifo> \n");
+  write_str(STDERR_FILENO, "  -w  keep watching <jobs_dir> for new .job files\n");
+  write_str(STDERR_FILENO, "  -i  I/O engine for job and output files (default: sync)\n");
+  write_str(STDERR_FILENO, "  -o  format of the .out files (default: text); binary-lz passes\n"
+                           "      compressed values through, backups included\n");
+  write_str(STDERR_FILENO, "  -m  memory budget of the pairs, with an optional k, m or g suffix;\n"
+                           "      the least recently used ones are evicted past it (default: none)\n");
+  write_str(STDERR_FILENO, "  -l  longest value accepted, with the same suffixes (default: 1m)\n");
+  write_str(STDERR_FILENO, "  -z  shortest value compressed, with the same suffixes, 0 for none\n"
+                           "      (default: 256)\n");
+  write_str(STDERR_FILENO, "  -s  split the keys in this many shards, each with an owner thread\n"
+                           "      (default: 1, no owner threads)\n");
+  write_str(STDERR_FILENO, "  -p  pin job, session and shard threads to CPUs across the NUMA nodes,\n"
+                           "      keeping the memory of every shard on the node of its owner\n");
+  write_str(STDERR_FILENO, "  -S  FIFO every reader of gets the operation metrics as JSON\n");
+  write_str(STDERR_FILENO, "  -L  profile the waits for the busiest locks, reported on SIGUSR2\n"
+                           "      and at exit\n");
+  write_str(STDERR_FILENO, "  -c  clients served at the same time, the others wait to be\n"
+                           "      (default: 1)\n");
+  write_str(STDERR_FILENO, "  -T  record a trace of the requests from the start; TRACE OFF in a job\n"
+                           "      writes it to this file as Chrome trace-event JSON, TRACE ON\n"
+                           "      records a new one\n");
+  write_str(STDERR_FILENO, "  -t  how clients connect at <register_fifo>: fifo (default), unix,\n"
+                           "      a socket with one connection per client, or tcp, with\n"
+                           "      <register_fifo> a [host:]port (loopback if no host is given)\n");
 }
 
+// Parses a size in bytes, with an optional k, m or g suffix.
+// @return 0 if successful, 1 otherwise.
+static int parse_size(const char* str, size_t* size) {
+  char* endptr;
+  unsigned long long value = strtoull(str, &endptr, 10);
+  if (endptr == str) {
+    return 1;
+  }
+
+  unsigned int shift = 0;
+  switch (*endptr) {
+    case 'k':
+    case 'K':
+      shift = 10;
+      break;
+    case 'm':
+    case 'M':
+      shift = 20;
+      break;
+    case 'g':
+    case 'G':
+      shift = 30;
+      break;
+    case '\0':
+      break;
+    default:
+      return 1;
+  }
+  if (shift != 0 && *++endptr != '\0') {
+    return 1;
+  }
+  if (value > SIZE_MAX >> shift) {
+    return 1;
+  }
+
+  *size = (size_t)value << shift;
+  return 0;
+}
 
 int main(int argc, char** argv) {
-  
-  if (argc < 4) {
-    write_str(STDERR_FILENO, "Usage: ");
-    write_str(STDERR_FILENO, argv[0]);
-    write_str(STDERR_FILENO, " <jobs_dir>");
-		write_str(STDERR_FILENO, " <max_threads>");
-		write_str(STDERR_FILENO, " <max_backups> \n");
+  int opt;
+  int output_mode;
+  size_t memory_budget;
+  size_t max_value_size;
+  size_t compress_threshold;
+  unsigned long num_shards;
+  const char* stats_fifo = NULL;
+  char* end;
+  while ((opt = getopt(argc, argv, "wi:o:m:l:z:s:pS:Lc:T:t:")) != -1) {
+    switch (opt) {
+      case 'w':
+        watch_mode = 1;
+        break;
+      case 'i':
+        if (aio_set_engine(optarg) != 0) {
+          fprintf(stderr, "Invalid I/O engine: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'o':
+        if ((output_mode = enc_parse_mode(optarg)) == -1) {
+          fprintf(stderr, "Invalid output format: %s\n", optarg);
+          return 1;
+        }
+        set_output_mode(output_mode);
+        break;
+      case 'm':
+        if (parse_size(optarg, &memory_budget) != 0) {
+          fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+          return 1;
+        }
+        set_memory_budget(memory_budget);
+        break;
+      case 'l':
+        if (parse_size(optarg, &max_value_size) != 0 || max_value_size == 0) {
+          fprintf(stderr, "Invalid value size limit: %s\n", optarg);
+          return 1;
+        }
+        set_max_value_size(max_value_size);
+        break;
+      case 'z':
+        if (parse_size(optarg, &compress_threshold) != 0) {
+          fprintf(stderr, "Invalid compression threshold: %s\n", optarg);
+          return 1;
+        }
+        set_compress_threshold(compress_threshold);
+        break;
+      case 's':
+        num_shards = strtoul(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || num_shards == 0 || num_shards > MAX_SHARDS) {
+          fprintf(stderr, "Invalid number of shards: %s\n", optarg);
+          return 1;
+        }
+        set_num_shards(num_shards);
+        break;
+      case 'p':
+        if (numa_enable() != 0) {
+          return 1;
+        }
+        break;
+      case 'S':
+        stats_fifo = optarg;
+        break;
+      case 'L':
+        if (lockprof_enable() != 0) {
+          return 1;
+        }
+        break;
+      case 'T':
+        if (trace_open(optarg) != 0) {
+          return 1;
+        }
+        break;
+      case 't':
+        if (transport_set(optarg) != 0) {
+          fprintf(stderr, "Invalid transport: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'c':
+        max_sessions = strtoul(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || max_sessions == 0) {
+          fprintf(stderr, "Invalid number of sessions: %s\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  char** args = argv + optind;
+  if (argc - optind < 4) {
+    print_usage(argv[0]);
     return 1;
   }
   
-  clients = malloc(MAX_SESSION_COUNT * sizeof(Client));
-
-  jobs_directory = argv[1];
-  strcat(register_fifo_name, argv[4]);
+  clients = NULL;
+
+  jobs_directory = args[0];
+  if (transport_get() == TRANSPORT_TCP) {
+    // An address rather than a FIFO name
+    snprintf(register_fifo_name, sizeof(register_fifo_name), "%s", args[3]);
+  } else {
+    strcat(register_fifo_name, args[3]);
+  }
 
   char* endptr;
-  max_backups = strtoul(argv[3], &endptr, 10);
+  max_backups = strtoul(args[2], &endptr, 10);
 
   if (*endptr != '\0') {
     fprintf(stderr, "Invalid max_proc value\n");
     return 1;
   }
 
-  max_threads = strtoul(argv[2], &endptr, 10);
+  max_threads = strtoul(args[1], &endptr, 10);
 
   if (*endptr != '\0') {
     fprintf(stderr, "Invalid max_threads value\n");
@@ -673,14 +1063,28 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+  // A client that is gone fails the writes to its FIFOs or socket instead
+  signal(SIGPIPE, SIG_IGN);
+  // Only the host thread takes SIGUSR1 (get_register), every thread started
+  // from here on blocks it
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
   if (kvs_init()) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
 
-  DIR* dir = opendir(argv[1]);
+  if (stats_fifo != NULL && metrics_fifo_start(stats_fifo) != 0) {
+    kvs_terminate();
+    return 1;
+  }
+
+  DIR* dir = opendir(jobs_directory);
   if (dir == NULL) {
-    fprintf(stderr, "Failed to open directory: %s\n", argv[1]);
+    fprintf(stderr, "Failed to open directory: %s\n", jobs_directory);
     return 0;
   }
 
@@ -696,6 +1100,9 @@ int main(int argc, char** argv) {
     active_backups--;
   }
 
+  watch_stop();
+  metrics_fifo_stop();
   kvs_terminate();
+  lockprof_stop();
   return 0;
 }
@@ -0,0 +1,292 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "hotkeys.h"
+
+#define LINE_SIZE 256
+
+typedef struct OpStats {
+  uint64_t count;
+  uint64_t failed;
+  uint64_t items;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[METRICS_BUCKETS];
+} OpStats;
+
+// The metrics of one thread. Slabs are never freed, so the operations of
+// threads that are gone still count.
+typedef struct Slab {
+  OpStats ops[METRIC_OPS];
+  struct Slab *next;
+} Slab;
+
+static const char *op_names[METRIC_OPS] = {
+    "write", "read", "delete", "cas", "txn", "scan",
+    "show", "backup", "subscribe", "unsubscribe", "notify",
+};
+
+static Slab *slabs = NULL;  // Every slab, pushed without a lock
+static _Thread_local Slab *local_slab = NULL;
+static uint64_t started_ns = 0;
+static MetricsMemoryFn memory_fn = NULL;
+
+static const char *fifo_path = NULL;
+static pthread_t fifo_thread;
+static int fifo_running = 0;
+static int fifo_stopped = 0;
+
+uint64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t ns) {
+  if (ns < METRICS_SUB_BUCKETS) {
+    return (size_t)ns;
+  }
+  int bits = 63 - __builtin_clzll(ns);  // Index of the highest bit set
+  if (bits >= METRICS_MAX_BITS) {
+    return METRICS_BUCKETS - 1;
+  }
+  size_t sub = (size_t)(ns >> (bits - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+  return (size_t)(bits - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+// Highest latency a bucket holds.
+static uint64_t bucket_max(size_t bucket) {
+  if (bucket < METRICS_SUB_BUCKETS) {
+    return bucket;
+  }
+  size_t shift = bucket / METRICS_SUB_BUCKETS - 1;
+  uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+  return ((METRICS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+// Adds to a counter of the slab of the calling thread. It is the only writer,
+// the stores are atomic only so readers never see half of one.
+static void bump(uint64_t *counter, uint64_t by) {
+  __atomic_store_n(counter, *counter + by, __ATOMIC_RELAXED);
+}
+
+static Slab *get_local_slab(void) {
+  if (local_slab == NULL) {
+    Slab *slab = calloc(1, sizeof(Slab));
+    if (slab == NULL) {
+      return NULL;
+    }
+    slab->next = __atomic_load_n(&slabs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slabs, &slab->next, slab, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+      // Another thread pushed its slab first, slab->next was refreshed
+    }
+    // elapsed_ms counts from the first operation recorded
+    uint64_t unset = 0;
+    __atomic_compare_exchange_n(&started_ns, &unset, metrics_now(), 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+    local_slab = slab;
+  }
+  return local_slab;
+}
+
+void metrics_record(MetricOp op, uint64_t start_ns, size_t items, int failed) {
+  Slab *slab = get_local_slab();
+  if (slab == NULL) {
+    return;
+  }
+  uint64_t now = metrics_now();
+  uint64_t ns = now > start_ns ? now - start_ns : 0;
+  OpStats *stats = &slab->ops[op];
+  bump(&stats->count, 1);
+  bump(&stats->failed, failed ? 1 : 0);
+  bump(&stats->items, items);
+  bump(&stats->total_ns, ns);
+  if (ns > stats->max_ns) {
+    __atomic_store_n(&stats->max_ns, ns, __ATOMIC_RELAXED);
+  }
+  bump(&stats->buckets[bucket_of(ns)], 1);
+}
+
+// Sums the slabs of every thread.
+static void sum_slabs(OpStats *total) {
+  memset(total, 0, METRIC_OPS * sizeof(OpStats));
+  for (Slab *slab = __atomic_load_n(&slabs, __ATOMIC_ACQUIRE); slab != NULL; slab = slab->next) {
+    for (int op = 0; op < METRIC_OPS; op++) {
+      const OpStats *stats = &slab->ops[op];
+      total[op].count += __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+      total[op].failed += __atomic_load_n(&stats->failed, __ATOMIC_RELAXED);
+      total[op].items += __atomic_load_n(&stats->items, __ATOMIC_RELAXED);
+      total[op].total_ns += __atomic_load_n(&stats->total_ns, __ATOMIC_RELAXED);
+      uint64_t max_ns = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+      if (max_ns > total[op].max_ns) {
+        total[op].max_ns = max_ns;
+      }
+      for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        total[op].buckets[i] += __atomic_load_n(&stats->buckets[i], __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+// Gets the latency under which a share of the operations fall.
+// @param per_mille The share, out of 1000.
+static uint64_t percentile(const OpStats *stats, uint64_t per_mille) {
+  // The buckets were read one at a time, so they may add up to a bit more
+  // or less than count
+  uint64_t seen = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+    seen += stats->buckets[i];
+  }
+  uint64_t rank = (seen * per_mille + 999) / 1000;
+  seen = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+    seen += stats->buckets[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t ns = bucket_max(i);
+      return ns < stats->max_ns ? ns : stats->max_ns;
+    }
+  }
+  return 0;
+}
+
+static double us(uint64_t ns) {
+  return (double)ns / 1000.0;
+}
+
+void metrics_set_memory_fn(MetricsMemoryFn fn) {
+  memory_fn = fn;
+}
+
+int metrics_write(int fd, int format) {
+  OpStats *total = malloc(METRIC_OPS * sizeof(OpStats));
+  if (total == NULL) {
+    return -1;
+  }
+  sum_slabs(total);
+  uint64_t start = __atomic_load_n(&started_ns, __ATOMIC_RELAXED);
+  uint64_t elapsed_ms = start == 0 ? 0 : (metrics_now() - start) / 1000000;
+  uint64_t memory_used = 0;
+  uint64_t evictions = 0;
+  if (memory_fn != NULL) {
+    memory_fn(&memory_used, &evictions);
+  }
+
+  char line[LINE_SIZE];
+  int result = 0;
+  int len;
+  if (format == METRICS_JSON) {
+    len = snprintf(line, sizeof(line), "{\"elapsed_ms\":%llu,\"memory_used\":%llu,\"evictions\":%llu,\"ops\":{",
+                   (unsigned long long)elapsed_ms, (unsigned long long)memory_used,
+                   (unsigned long long)evictions);
+  } else {
+    len = snprintf(line, sizeof(line), "%-12s %10s %8s %10s %10s %10s %10s %10s %10s\n", "op",
+                   "count", "failed", "items", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+  }
+  result |= aio_write(fd, line, (size_t)len);
+
+  for (int op = 0; op < METRIC_OPS && result == 0; op++) {
+    const OpStats *stats = &total[op];
+    uint64_t mean = stats->count == 0 ? 0 : stats->total_ns / stats->count;
+    uint64_t p50 = percentile(stats, 500);
+    uint64_t p99 = percentile(stats, 990);
+    uint64_t p999 = percentile(stats, 999);
+    if (format == METRICS_JSON) {
+      len = snprintf(line, sizeof(line),
+                     "%s\"%s\":{\"count\":%llu,\"failed\":%llu,\"items\":%llu,\"mean_ns\":%llu,"
+                     "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+                     op == 0 ? "" : ",", op_names[op], (unsigned long long)stats->count,
+                     (unsigned long long)stats->failed, (unsigned long long)stats->items,
+                     (unsigned long long)mean, (unsigned long long)p50, (unsigned long long)p99,
+                     (unsigned long long)p999, (unsigned long long)stats->max_ns);
+    } else {
+      len = snprintf(line, sizeof(line), "%-12s %10llu %8llu %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                     op_names[op], (unsigned long long)stats->count,
+                     (unsigned long long)stats->failed, (unsigned long long)stats->items, us(mean),
+                     us(p50), us(p99), us(p999), us(stats->max_ns));
+    }
+    result |= aio_write(fd, line, (size_t)len);
+  }
+  // The keys used most come last, with their subscribers
+  if (format == METRICS_JSON && result == 0) {
+    result |= aio_write(fd, "},", 2);
+    result |= result == 0 ? hotkeys_write(fd, METRICS_JSON) : 0;
+    result |= result == 0 ? aio_write(fd, "}\n", 2) : 0;
+  } else if (result == 0) {
+    len = snprintf(line, sizeof(line), "\n%-12s %10llu\n%-12s %10llu\n\n", "memory_used",
+                   (unsigned long long)memory_used, "evictions", (unsigned long long)evictions);
+    result |= aio_write(fd, line, (size_t)len);
+    result |= result == 0 ? hotkeys_write(fd, METRICS_TEXT) : 0;
+  }
+
+  free(total);
+  return result == 0 ? 0 : -1;
+}
+
+static void *fifo_loop(void *arg) {
+  (void)arg;
+  // Signals are handled by the main thread
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  while (!__atomic_load_n(&fifo_stopped, __ATOMIC_ACQUIRE)) {
+    // Blocks until someone opens the FIFO to read
+    int fd = open(fifo_path, O_WRONLY);
+    if (fd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to open the stats FIFO\n");
+      break;
+    }
+    if (!__atomic_load_n(&fifo_stopped, __ATOMIC_ACQUIRE) && metrics_write(fd, METRICS_JSON) != 0) {
+      fprintf(stderr, "Failed to write to the stats FIFO\n");
+    }
+    close(fd);
+    // Lets the reader see the end of the file before the next open
+    nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 10000000}, NULL);
+  }
+  return NULL;
+}
+
+int metrics_fifo_start(const char *path) {
+  if (mkfifo(path, 0666) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create the stats FIFO %s\n", path);
+    return 1;
+  }
+  fifo_path = path;
+  fifo_stopped = 0;
+  if (pthread_create(&fifo_thread, NULL, fifo_loop, NULL) != 0) {
+    fprintf(stderr, "Failed to create the stats thread\n");
+    return 1;
+  }
+  fifo_running = 1;
+  return 0;
+}
+
+void metrics_fifo_stop(void) {
+  if (!fifo_running) {
+    return;
+  }
+  __atomic_store_n(&fifo_stopped, 1, __ATOMIC_RELEASE);
+  // Opening the other end wakes the thread if it waits for a reader
+  int fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
+  pthread_join(fifo_thread, NULL);
+  if (fd != -1) {
+    close(fd);
+  }
+  fifo_running = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef KVS_METRICS_H
+#define KVS_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters and latency histograms of the operations of the server. Every
+// thread records into a slab of its own that only it writes, so recording
+// takes no lock and shares no cache line; the slabs are summed when the
+// metrics are read. Histograms are log-linear like HDR ones: latencies are
+// grouped by power of two and every power of two is split in
+// METRICS_SUB_BUCKETS buckets, so a percentile is off by less than 1/16.
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 40  // Latencies are capped at 2^40 ns, about 18 minutes
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+// Output formats of metrics_write.
+#define METRICS_TEXT 0
+#define METRICS_JSON 1
+
+typedef enum MetricOp {
+  METRIC_WRITE,
+  METRIC_READ,
+  METRIC_DELETE,
+  METRIC_CAS,
+  METRIC_TXN,
+  METRIC_SCAN,  // RANGE and PREFIX
+  METRIC_SHOW,
+  METRIC_BACKUP,
+  METRIC_SUBSCRIBE,
+  METRIC_UNSUBSCRIBE,
+  METRIC_NOTIFY,  // One per notification written to a subscriber
+  METRIC_OPS
+} MetricOp;
+
+/// Gets the bytes the pairs take and how many pairs were evicted so far.
+typedef void (*MetricsMemoryFn)(uint64_t *memory_used, uint64_t *evictions);
+
+/// Gets the time operations are measured with.
+/// @return Nanoseconds of a monotonic clock.
+uint64_t metrics_now(void);
+
+/// Records an operation that is over.
+/// @param op The operation.
+/// @param start_ns metrics_now when it started.
+/// @param items Keys or pairs it covered.
+/// @param failed 1 if it failed, 0 otherwise.
+void metrics_record(MetricOp op, uint64_t start_ns, size_t items, int failed);
+
+/// Writes the count, failures, items, mean, p50, p99, p999 and maximum
+/// latency of every operation seen so far, the memory of the pairs and the
+/// evictions (see metrics_set_memory_fn), then the keys used most (see
+/// hotkeys_write).
+/// @param fd File descriptor to write to (through aio_write).
+/// @param format METRICS_TEXT (a table) or METRICS_JSON (one object, one line,
+///               with elapsed_ms, the time since the first operation).
+/// @return 0 if successful, -1 otherwise.
+int metrics_write(int fd, int format);
+
+/// Sets how the report gets the memory of the pairs.
+void metrics_set_memory_fn(MetricsMemoryFn fn);
+
+/// Starts a thread that writes the metrics as JSON to every reader of a FIFO,
+/// e.g. cat <path>.
+/// @param path Path of the FIFO, created if it does not exist.
+/// @return 0 if successful, 1 otherwise.
+int metrics_fifo_start(const char *path);
+
+/// Stops the FIFO thread, if it was started.
+void metrics_fifo_stop(void);
+
+#endif  // KVS_METRICS_H
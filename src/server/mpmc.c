@@ -0,0 +1,133 @@
+#define _GNU_SOURCE  // syscall()
+#include "mpmc.h"
+
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void futex_wait(uint32_t *word, uint32_t seen) {
+  // Returns at once if the word moved on, and may wake up for no reason
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+// Wakes a thread sleeping on a word, if there is one.
+static void wake_one(uint32_t *word, uint32_t *waiters) {
+  // Pairs with the fence of the waiter in mpmc_push and mpmc_pop: either it
+  // sees the change made before this call when it tries again, or this sees
+  // it waiting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+int mpmc_init(MpmcQueue *queue, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size *= 2;
+  }
+  // aligned_alloc takes whole multiples of the alignment
+  size_t bytes = (size * sizeof(MpmcCell) + MPMC_CACHE_LINE - 1) / MPMC_CACHE_LINE * MPMC_CACHE_LINE;
+  queue->cells = aligned_alloc(MPMC_CACHE_LINE, bytes);
+  if (queue->cells == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    queue->cells[i].seq = i;
+    queue->cells[i].item = NULL;
+  }
+  queue->mask = size - 1;
+  queue->head = 0;
+  queue->tail = 0;
+  queue->pushed = 0;
+  queue->popped = 0;
+  queue->pop_waiters = 0;
+  queue->push_waiters = 0;
+  return 0;
+}
+
+void mpmc_destroy(MpmcQueue *queue) {
+  free(queue->cells);
+  queue->cells = NULL;
+}
+
+int mpmc_try_push(MpmcQueue *queue, void *item) {
+  size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  MpmcCell *cell;
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 1;  // The cell still holds the item pushed a lap ago
+    } else {
+      pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+  }
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void *mpmc_try_pop(MpmcQueue *queue) {
+  size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  MpmcCell *cell;
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return NULL;  // Nothing pushed at this position yet
+    } else {
+      pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    }
+  }
+  void *item = cell->item;
+  // Ready for the push one lap ahead
+  __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+void mpmc_push(MpmcQueue *queue, void *item) {
+  while (mpmc_try_push(queue, item) != 0) {
+    uint32_t seen = __atomic_load_n(&queue->popped, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&queue->push_waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (mpmc_try_push(queue, item) == 0) {
+      __atomic_sub_fetch(&queue->push_waiters, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&queue->popped, seen);
+    __atomic_sub_fetch(&queue->push_waiters, 1, __ATOMIC_RELAXED);
+  }
+  wake_one(&queue->pushed, &queue->pop_waiters);
+}
+
+void *mpmc_pop(MpmcQueue *queue) {
+  void *item;
+  while ((item = mpmc_try_pop(queue)) == NULL) {
+    uint32_t seen = __atomic_load_n(&queue->pushed, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&queue->pop_waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((item = mpmc_try_pop(queue)) != NULL) {
+      __atomic_sub_fetch(&queue->pop_waiters, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&queue->pushed, seen);
+    __atomic_sub_fetch(&queue->pop_waiters, 1, __ATOMIC_RELAXED);
+  }
+  wake_one(&queue->popped, &queue->push_waiters);
+  return item;
+}
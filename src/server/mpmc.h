@@ -0,0 +1,63 @@
+#ifndef KVS_MPMC_H
+#define KVS_MPMC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free queue of pointers with any number of producers and
+// consumers (Vyukov's ring). Every cell carries a sequence number that tells
+// whether it is ready to be written or read at a given position, so a push
+// or a pop is a compare-and-swap on the tail or the head and nothing else.
+// Threads only sleep, on a futex, when the queue is full (mpmc_push) or
+// empty (mpmc_pop); while no one sleeps, the other side only reads a counter
+// to find out.
+#define MPMC_CACHE_LINE 64
+
+typedef struct MpmcCell {
+  size_t seq;  // Position the cell is ready for: to push at pos if pos, to pop at pos if pos + 1
+  void *item;
+} MpmcCell;
+
+typedef struct MpmcQueue {
+  _Alignas(MPMC_CACHE_LINE) size_t head;  // Next position to pop
+  _Alignas(MPMC_CACHE_LINE) size_t tail;  // Next position to push
+  _Alignas(MPMC_CACHE_LINE) MpmcCell *cells;
+  size_t mask;  // Capacity - 1
+  _Alignas(MPMC_CACHE_LINE) uint32_t pushed;  // Futex words, bumped to wake
+  uint32_t popped;                            // sleeping poppers and pushers
+  uint32_t pop_waiters;
+  uint32_t push_waiters;
+} MpmcQueue;
+
+/// Initializes an empty queue.
+/// @param queue The queue.
+/// @param capacity Items it holds, rounded up to a power of two.
+/// @return 0 if successful, 1 otherwise.
+int mpmc_init(MpmcQueue *queue, size_t capacity);
+
+/// Frees the memory of a queue. No thread may be using it.
+/// @param queue The queue.
+void mpmc_destroy(MpmcQueue *queue);
+
+/// Adds an item unless the queue is full.
+/// @param queue The queue.
+/// @param item The item, not NULL.
+/// @return 0 if successful, 1 if the queue is full.
+int mpmc_try_push(MpmcQueue *queue, void *item);
+
+/// Takes the oldest item unless the queue is empty.
+/// @param queue The queue.
+/// @return The item, NULL if the queue is empty.
+void *mpmc_try_pop(MpmcQueue *queue);
+
+/// Adds an item, waiting while the queue is full.
+/// @param queue The queue.
+/// @param item The item, not NULL.
+void mpmc_push(MpmcQueue *queue, void *item);
+
+/// Takes the oldest item, waiting while the queue is empty.
+/// @param queue The queue.
+/// @return The item.
+void *mpmc_pop(MpmcQueue *queue);
+
+#endif  // KVS_MPMC_H
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE  // sched_setaffinity(), syscall()
+#include "numa.h"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_PATH "/sys/devices/system/node/node%zu/cpulist"
+#define CPULIST_SIZE 4096
+
+typedef struct Node {
+  int id;           // Node number of the kernel
+  cpu_set_t cpus;   // Its CPUs the process may run on
+  size_t num_cpus;
+} Node;
+
+static Node nodes[NUMA_MAX_NODES];
+static size_t num_nodes = 0;
+static int enabled = 0;
+static int can_bind = 0;  // 0 if the kernel has no NUMA, memory is only touched
+static size_t next_slot = 0;
+static _Thread_local size_t local_node = 0;
+
+// Reads a list of CPUs such as "0-3,8,10-11" into a set, keeping the ones in
+// allowed.
+// @return The number of CPUs kept.
+static size_t parse_cpulist(const char *list, const cpu_set_t *allowed, cpu_set_t *cpus) {
+  CPU_ZERO(cpus);
+  const char *p = list;
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    unsigned long first = strtoul(p, &end, 10);
+    unsigned long last = first;
+    if (end == p) {
+      break;
+    }
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtoul(p, &end, 10);
+      p = end;
+    }
+    for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, allowed)) {
+        CPU_SET(cpu, cpus);
+      }
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return (size_t)CPU_COUNT(cpus);
+}
+
+// Reads the nodes with CPUs the process may run on. Nodes with memory only
+// are left out, their memory is still used through the default policy.
+static void read_nodes(const cpu_set_t *allowed) {
+  char path[64];
+  char list[CPULIST_SIZE];
+  for (size_t id = 0; id < NUMA_MAX_NODES; id++) {
+    snprintf(path, sizeof(path), NODE_PATH, id);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+    if (fgets(list, sizeof(list), file) != NULL) {
+      Node *node = &nodes[num_nodes];
+      node->num_cpus = parse_cpulist(list, allowed, &node->cpus);
+      if (node->num_cpus > 0) {
+        node->id = (int)id;
+        num_nodes++;
+      }
+    }
+    fclose(file);
+  }
+}
+
+int numa_enable(void) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    fprintf(stderr, "Failed to read the CPUs of the process\n");
+    return 1;
+  }
+
+  num_nodes = 0;
+  read_nodes(&allowed);
+  can_bind = num_nodes > 0;
+  if (num_nodes == 0) {
+    // No NUMA in the kernel, or no sysfs: one node with every CPU
+    nodes[0].id = 0;
+    nodes[0].cpus = allowed;
+    nodes[0].num_cpus = (size_t)CPU_COUNT(&allowed);
+    num_nodes = 1;
+  }
+  enabled = 1;
+  return 0;
+}
+
+int numa_enabled(void) {
+  return enabled;
+}
+
+size_t numa_num_nodes(void) {
+  return enabled ? num_nodes : 1;
+}
+
+size_t numa_next_slot(void) {
+  return __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+}
+
+int numa_pin(size_t slot) {
+  if (!enabled) {
+    return 0;
+  }
+
+  size_t index = slot % num_nodes;
+  const Node *node = &nodes[index];
+  size_t nth = (slot / num_nodes) % node->num_cpus;
+  size_t cpu = 0;
+  while (!CPU_ISSET(cpu, &node->cpus) || nth-- > 0) {
+    cpu++;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    fprintf(stderr, "Failed to pin a thread to CPU %zu\n", cpu);
+    return 1;
+  }
+  local_node = index;
+  return 0;
+}
+
+size_t numa_local_node(void) {
+  return local_node;
+}
+
+void *numa_alloc_local(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+  if (enabled && can_bind) {
+    // Preferred rather than bound, so a full node spills over instead of failing
+    unsigned long mask = 1UL << nodes[local_node].id;
+    if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+      can_bind = 0;  // Left to the first touch below from now on
+    }
+  }
+  // The pages are faulted in by this thread, on its node
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+void numa_free(void *ptr, size_t size) {
+  if (ptr != NULL) {
+    munmap(ptr, size);
+  }
+}
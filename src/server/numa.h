@@ -0,0 +1,54 @@
+#ifndef KVS_NUMA_H
+#define KVS_NUMA_H
+
+#include <stddef.h>
+
+// Placement of threads and memory on the NUMA nodes of the host, without
+// libnuma: the nodes and their CPUs are read from sysfs, threads are pinned
+// with sched_setaffinity and memory is bound with the mbind system call.
+// Hosts without NUMA look like a single node holding every CPU.
+//
+// Threads take slots in the order they start (see numa_next_slot). Slot i
+// goes to node i % num_nodes, on the next CPU of that node, so consecutive
+// slots, such as the owners of consecutive shards, land on different nodes.
+#define NUMA_MAX_NODES 16
+
+/// Turns placement on, reading the topology of the host. Until it is called,
+/// threads are not pinned and memory follows the default policy.
+/// @return 0 if successful, 1 otherwise.
+int numa_enable(void);
+
+/// Checks if placement is on.
+/// @return 1 if numa_enable succeeded, 0 otherwise.
+int numa_enabled(void);
+
+/// Gets the number of nodes seen.
+/// @return The number of nodes, 1 if placement is off.
+size_t numa_num_nodes(void);
+
+/// Takes the next slot. Slots are handed out once.
+/// @return The slot.
+size_t numa_next_slot(void);
+
+/// Pins the calling thread to the CPU of a slot. Does nothing if placement is
+/// off.
+/// @param slot The slot.
+/// @return 0 if successful or placement is off, 1 otherwise.
+int numa_pin(size_t slot);
+
+/// Gets the node the calling thread was pinned to.
+/// @return The node, 0 if the thread is not pinned.
+size_t numa_local_node(void);
+
+/// Allocates zeroed memory on the node of the calling thread. The pages are
+/// bound there and touched before returning.
+/// @param size Size in bytes.
+/// @return The memory, page aligned, NULL on failure.
+void *numa_alloc_local(size_t size);
+
+/// Frees memory from numa_alloc_local.
+/// @param ptr The memory, may be NULL.
+/// @param size Size given to numa_alloc_local.
+void numa_free(void *ptr, size_t size);
+
+#endif  // KVS_NUMA_H
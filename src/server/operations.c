@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,12 +8,28 @@
 #include <unistd.h>
 
 #include "constants.h"
+#include "encoder.h"
+#include "hotkeys.h"
 #include "io.h"
 #include "kvs.h"
+#include "lockprof.h"
+#include "metrics.h"
 #include "operations.h"
+#include "shard.h"
 #include "src/common/io.h"
+#include "ttl.h"
+#include "values.h"
 
-static struct HashTable *kvs_table = NULL;
+// One table per shard of the keyspace, a single one unless set_num_shards
+// asks for more
+static HashTable *tables[MAX_SHARDS];
+static size_t num_shards = 1;
+static int owned_shards = 0;  // Whether every shard has an owner thread
+static int output_mode = ENC_TEXT;
+static size_t memory_budget = 0;  // Split evenly between the shards
+// Where backups decompress values (see version_value), kept between them
+static char *backup_scratch = NULL;
+static size_t backup_scratch_cap = 0;
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -21,119 +38,1149 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+// Gets the shard a key belongs to (FNV-1a, unlike the first letter the
+// buckets go by, spreads keys that share a prefix).
+static size_t shard_of(const char *key) {
+  uint32_t h = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+    h = (h ^ *c) * 16777619u;
+  }
+  return h % num_shards;
+}
+
+static HashTable *table_of(const char *key) {
+  return tables[shard_of(key)];
+}
+
+// Counts the keys of a command in the hot keys sketch of the calling thread.
+static void touch_keys(size_t num_keys, char keys[][MAX_STRING_SIZE], int is_write) {
+  for (size_t i = 0; i < num_keys; i++) {
+    hotkeys_touch(keys[i], is_write);
+  }
+}
+
+// Frees the old versions once there are about as many as pairs, so the cost
+// of a collection is spread over the commits that made it necessary.
+static void maybe_collect_garbage(HashTable *table) {
+  if (__atomic_load_n(&table->garbage, __ATOMIC_RELAXED) <
+      __atomic_load_n(&table->gc_threshold, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  prof_wrlock(&table->tablelock, "tablelock");
+  if (table->garbage >= table->gc_threshold) {
+    collect_garbage(table);
+  }
+  prof_rwunlock(&table->tablelock);
+}
+
+// Brings a table back under its share of the memory budget: old versions
+// are freed first, and pairs are only evicted if that is not enough. Evicted
+// pairs are freed right away unless a snapshot still sees them.
+static void maybe_evict(HashTable *table) {
+  size_t budget = memory_budget / num_shards;
+  if (budget == 0 || __atomic_load_n(&table->memory_used, __ATOMIC_RELAXED) <= budget) {
+    return;
+  }
+
+  prof_wrlock(&table->tablelock, "tablelock");
+  if (table->memory_used > budget) {
+    collect_garbage(table);
+  }
+  if (table->memory_used > budget) {
+    uint64_t seq = commit_begin(table);
+    evict_pairs(table, table->memory_used - budget, seq);
+    commit_end(table, seq);
+    collect_garbage(table);
+  }
+  prof_rwunlock(&table->tablelock);
+}
+
+// Deletes the pairs whose time to live is up, as one commit per shard.
+// Called by the reaper thread (see ttl_start).
+static void expire_keys(TtlEntry *due) {
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    HashTable *table = tables[shard];
+    int locked = 0;
+    uint64_t seq = 0;
+    for (TtlEntry *entry = due; entry != NULL; entry = entry->next) {
+      if (shard_of(entry->key) != shard) {
+        continue;
+      }
+      if (!locked) {
+        prof_wrlock(&table->tablelock, "tablelock");
+        seq = commit_begin(table);
+        locked = 1;
+      }
+      expire_pair(table, entry->key, entry->expires_at, seq);
+    }
+    if (locked) {
+      commit_end(table, seq);
+      prof_rwunlock(&table->tablelock);
+      maybe_collect_garbage(table);
+    }
+  }
+}
+
+// Adds a pair to the current list, or as a line of its own if entry is set.
+// Compressed values are passed through in the binary-lz format and
+// decompressed (into scratch, see version_value) otherwise.
+static void encode_version(Encoder *enc, int entry, const char *key, size_t key_len,
+                           const Version *version, char **scratch, size_t *scratch_cap) {
+  if (version->compressed_len != 0 && enc->mode == ENC_BINARY_LZ) {
+    enc_compressed(enc, key, key_len, version->value, version->compressed_len, version->value_len);
+    return;
+  }
+  const char *value = version_value(version, scratch, scratch_cap);
+  if (value == NULL) {
+    enc_status(enc, key, key_len, ENC_TAG_ERROR);
+  } else if (entry) {
+    enc_entry(enc, key, key_len, value, version->value_len);
+  } else {
+    enc_pair(enc, key, key_len, value, version->value_len);
+  }
+}
+
+// Frees the tables created so far.
+static void free_tables(void) {
+  for (size_t i = 0; i < num_shards; i++) {
+    if (tables[i] != NULL) {
+      free_table(tables[i]);
+      tables[i] = NULL;
+    }
+  }
+}
+
+// Creates the table of a shard on its owner, so its memory is first touched
+// on the node of the thread that uses it most.
+static int create_shard_table(size_t shard) {
+  tables[shard] = create_hash_table();
+  return tables[shard] == NULL;
+}
+
 int kvs_init() {
-  if (kvs_table != NULL) {
+  if (tables[0] != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  if (owned_shards) {
+    if (shards_start(num_shards, create_shard_table) != 0) {
+      free_tables();
+      return 1;
+    }
+  } else if (create_shard_table(0) != 0) {
+    return 1;
+  }
+
+  if (ttl_start(expire_keys) != 0) {
+    if (owned_shards) {
+      shards_stop();
+    }
+    free_tables();
+    return 1;
+  }
+  hotkeys_set_subscribers_fn(kvs_subscribers);
+  metrics_set_memory_fn(kvs_memory);
+  return 0;
+}
+
+size_t kvs_subscribers(const char *key) {
+  HashTable *table = tables[0] == NULL ? NULL : table_of(key);
+  if (table == NULL) {
+    return 0;
+  }
+  prof_rdlock(&table->tablelock, "tablelock");
+  size_t count = count_subscribers(table, key);
+  prof_rwunlock(&table->tablelock);
+  return count;
+}
+
+void kvs_memory(uint64_t *memory_used, uint64_t *evictions) {
+  *memory_used = 0;
+  *evictions = 0;
+  for (size_t shard = 0; shard < num_shards && tables[shard] != NULL; shard++) {
+    *memory_used += __atomic_load_n(&tables[shard]->memory_used, __ATOMIC_RELAXED);
+    *evictions += __atomic_load_n(&tables[shard]->evictions, __ATOMIC_RELAXED);
+  }
+}
+
+void set_num_shards(size_t count) {
+  num_shards = count;
+  owned_shards = 1;
+}
+
+void set_output_mode(int mode) {
+  output_mode = mode;
+}
+
+void set_memory_budget(size_t bytes) {
+  memory_budget = bytes;
 }
 
 int kvs_terminate() {
-  if (kvs_table == NULL) {
+  if (tables[0] == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  free_table(kvs_table);
-  kvs_table = NULL;
+  if (owned_shards) {
+    shards_stop();
+  }
+  ttl_stop();
+  free_tables();
+  free(backup_scratch);
+  backup_scratch = NULL;
+  backup_scratch_cap = 0;
   return 0;
 }
 
+// The part of a WRITE, READ or DELETE with the keys of one shard.
+typedef struct ShardOp {
+  ShardTask task;
+  char (*keys)[MAX_STRING_SIZE];  // Keys of the whole command
+  const size_t *idx;              // Positions of the keys of the part
+  size_t count;
+  Version **versions;             // By position: new versions (WRITE) or versions read (READ)
+  const ValueList *values;        // WRITE
+  Snapshot *snapshots;            // READ: one per shard, released by the caller
+  unsigned char *missing;         // DELETE: set for the keys that did not exist
+} ShardOp;
+
+// Splits a command by shard and runs its parts, keeping the order of the
+// keys within each: by the owners of the shards if they have one (see
+// set_num_shards), in the calling thread otherwise.
+// @param num_keys Number of keys of the command.
+// @param op The command; every part is a copy with its own idx and count.
+// @param run Runs a part.
+// @return Mask of the shards that had keys.
+static uint64_t run_sharded(size_t num_keys, const ShardOp *op, void (*run)(ShardTask *, size_t)) {
+  size_t shard_ids[MAX_WRITE_SIZE];
+  size_t order[MAX_WRITE_SIZE];
+  size_t starts[MAX_SHARDS + 1] = {0};
+  size_t fill[MAX_SHARDS];
+  for (size_t i = 0; i < num_keys; i++) {
+    shard_ids[i] = num_shards == 1 ? 0 : shard_of(op->keys[i]);
+    starts[shard_ids[i] + 1]++;
+  }
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    starts[shard + 1] += starts[shard];
+    fill[shard] = starts[shard];
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    order[fill[shard_ids[i]]++] = i;
+  }
+
+  ShardOp parts[MAX_SHARDS];
+  ShardPort *port = owned_shards ? shard_port_acquire() : NULL;
+  size_t submitted = 0;
+  uint64_t mask = 0;
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    if (starts[shard + 1] == starts[shard]) {
+      continue;
+    }
+    parts[shard] = *op;
+    parts[shard].task.run = run;
+    parts[shard].idx = order + starts[shard];
+    parts[shard].count = starts[shard + 1] - starts[shard];
+    mask |= (uint64_t)1 << shard;
+    if (port != NULL) {
+      shard_submit(port, shard, &parts[shard].task);
+      submitted++;
+    } else {
+      run(&parts[shard].task, shard);
+    }
+  }
+  if (port != NULL) {
+    shard_wait(port, submitted);
+    shard_port_release(port);
+  }
+  return mask;
+}
+
+static void write_part(ShardTask *task, size_t shard) {
+  ShardOp *op = (ShardOp *)task;
+  HashTable *table = tables[shard];
+  prof_wrlock(&table->tablelock, "tablelock");
+
+  // The whole part is one commit: snapshots see all of it or none
+  uint64_t seq = commit_begin(table);
+  for (size_t j = 0; j < op->count; j++) {
+    size_t i = op->idx[j];
+    if (op->versions[i] == NULL || write_pair(table, op->keys[i], op->versions[i], seq) != 0) {
+      fprintf(stderr, "Failed to write key pair (%s,%s)\n", op->keys[i], op->values->values[i]);
+    }
+  }
+  commit_end(table, seq);
+
+  prof_rwunlock(&table->tablelock);
+
+  maybe_evict(table);
+  maybe_collect_garbage(table);
+}
+
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
+              const ValueList *values, unsigned int ttl_ms) {
+  if (tables[0] == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  touch_keys(num_pairs, keys, 1);
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
-
+  // Built, and compressed, before the lock is taken
+  uint64_t expires_at = ttl_ms == 0 ? 0 : ttl_now_ms() + ttl_ms;
+  Version *versions[MAX_WRITE_SIZE];
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    versions[i] = new_version(values->values[i], values->lens[i]);
+    if (versions[i] != NULL) {
+      versions[i]->expires_at = expires_at;
     }
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  ShardOp op = {.keys = keys, .versions = versions, .values = values};
+  run_sharded(num_pairs, &op, write_part);
+
+  // Reads already miss the pairs once they expire, the reaper frees them
+  for (size_t i = 0; expires_at != 0 && i < num_pairs; i++) {
+    if (ttl_schedule(keys[i], expires_at) != 0) {
+      fprintf(stderr, "Failed to schedule the expiration of key %s\n", keys[i]);
+    }
+  }
   return 0;
 }
 
+static void read_part(ShardTask *task, size_t shard) {
+  ShardOp *op = (ShardOp *)task;
+  HashTable *table = tables[shard];
+
+  // read_pairs takes the keys back to back, as they already are when the
+  // part has every key of the command
+  char (*keys)[MAX_STRING_SIZE] = op->keys;
+  char part_keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  if (op->idx[op->count - 1] != op->count - 1) {
+    for (size_t j = 0; j < op->count; j++) {
+      memcpy(part_keys[j], op->keys[op->idx[j]], MAX_STRING_SIZE);
+    }
+    keys = part_keys;
+  }
+
+  KeyNode *nodes[MAX_WRITE_SIZE];
+  Snapshot *snapshot = &op->snapshots[shard];
+  snapshot_begin(table, snapshot);
+  read_pairs(table, op->count, keys, nodes);
+  for (size_t j = 0; j < op->count; j++) {
+    op->versions[op->idx[j]] = nodes[j] == NULL ? NULL : version_at(nodes[j], snapshot);
+  }
+}
+
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+  if (tables[0] == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  touch_keys(num_pairs, keys, 0);
+
+  // Every key of a shard is read as of the same commit, and writers are not
+  // blocked. The snapshots are held until the line is encoded.
+  Version *versions[MAX_WRITE_SIZE];
+  Snapshot snapshots[MAX_SHARDS];
+  ShardOp op = {.keys = keys, .versions = versions, .snapshots = snapshots};
+  uint64_t mask = run_sharded(num_pairs, &op, read_part);
 
-  write_str(fd, "[");
+  // Sized so the whole line is encoded under the snapshots and written after them
+  // (compressed values passed through take less than value_len)
+  size_t key_lens[MAX_WRITE_SIZE];
+  size_t size = ENC_RECORD_OVERHEAD;
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
-    } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+    key_lens[i] = strlen(keys[i]);
+    size += key_lens[i] + ENC_RECORD_OVERHEAD +
+            (versions[i] == NULL ? ENC_STATUS_MAX_SIZE : versions[i]->value_len);
+  }
+
+  char *line = malloc(size);
+  Encoder enc;
+  char *scratch = NULL;
+  size_t scratch_cap = 0;
+  if (line != NULL) {
+    enc_init(&enc, fd, output_mode, line, size);
+    enc_list_begin(&enc);
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (versions[i] == NULL) {
+        enc_status(&enc, keys[i], key_lens[i], ENC_TAG_ERROR);
+      } else {
+        encode_version(&enc, 0, keys[i], key_lens[i], versions[i], &scratch, &scratch_cap);
+      }
+    }
+    enc_list_end(&enc);
+  }
+
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    if (mask & (uint64_t)1 << shard) {
+      snapshot_end(tables[shard], &snapshots[shard]);
     }
-    write_str(fd, aux);
-    free(result);
   }
-  write_str(fd, "]\n");
-  
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  if (line == NULL) {
+    fprintf(stderr, "Failed to allocate memory for the read results\n");
+    return 1;
+  }
+  enc_flush(&enc);
+  free(scratch);
+  free(line);
   return 0;
 }
 
+// Attempts at committing in place before a transaction takes the table
+// write lock, so a transaction that keeps losing races still finishes.
+#define TXN_MAX_RETRIES 8
+
+typedef struct Txn {
+  size_t num_reads;
+  char (*read_keys)[MAX_STRING_SIZE];
+  const char *const *expected;
+  const size_t *expected_lens;
+  size_t num_writes;
+  char (*write_keys)[MAX_STRING_SIZE];
+  const char *const *values;
+  const size_t *value_lens;
+} Txn;
+
+// Adds a key of the read set that did not have its expected value.
+static void list_mismatch(Encoder *enc, int *listed, const char *key, Version *version,
+                          char **scratch, size_t *scratch_cap) {
+  if (!*listed) {
+    enc_list_begin(enc);
+    *listed = 1;
+  }
+  if (version == NULL || version->value == NULL) {
+    enc_status(enc, key, strlen(key), ENC_TAG_MISSING);
+  } else {
+    encode_version(enc, 0, key, strlen(key), version, scratch, scratch_cap);
+  }
+}
+
+static int compare_nodes(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(KeyNode *const *)a;
+  uintptr_t y = (uintptr_t)*(KeyNode *const *)b;
+  return (x > y) - (x < y);
+}
+
+// Commits a transaction whose keys are all in one shard optimistically. The
+// newest version of every key of the read set is checked and remembered holding only the table read lock;
+// then the nodes of both sets are locked (in address order, so concurrent
+// commits cannot deadlock), the read set is validated against the versions
+// remembered and the new versions are pushed. Transactions on different keys
+// therefore commit in parallel. Creating a key changes the table itself, so
+// a write set with new keys (or a transaction that keeps failing validation)
+// commits under the table write lock instead.
+// @param table The table of the shard.
+// @param nodes Room for the nodes of both sets.
+// @param locked Room for the nodes of both sets.
+// @param seen Room for the versions of the read set.
+// @param new_versions The versions of the write set (see new_version); the
+//                     ones pushed are taken over by the table and set to NULL.
+// @return 0 if committed, 1 if a key of the read set did not match.
+static int commit_txn(HashTable *table, const Txn *txn, Encoder *enc, int *listed, KeyNode **nodes,
+                      KeyNode **locked, Version **seen, Version **new_versions) {
+  size_t num_nodes = txn->num_reads + txn->num_writes;
+  char *scratch = NULL;  // Decompressed values of the read set
+  size_t scratch_cap = 0;
+  int result = 0;
+  for (int attempt = 0; attempt <= TXN_MAX_RETRIES; attempt++) {
+    int exclusive = attempt == TXN_MAX_RETRIES;
+    if (exclusive) {
+      prof_wrlock(&table->tablelock, "tablelock");
+    } else {
+      prof_rdlock(&table->tablelock, "tablelock");
+    }
+
+    KeyNode **write_nodes = nodes + txn->num_reads;
+    read_pairs(table, txn->num_reads, txn->read_keys, nodes);
+    read_pairs(table, txn->num_writes, txn->write_keys, write_nodes);
+
+    if (!exclusive) {
+      int creates = 0;
+      for (size_t i = 0; i < txn->num_writes; i++) {
+        creates |= write_nodes[i] == NULL;
+      }
+      if (creates) {
+        prof_rwunlock(&table->tablelock);
+        attempt = TXN_MAX_RETRIES - 1;
+        continue;
+      }
+    }
+
+    // Read phase: versions are immutable, so no node lock is needed
+    int matched = 1;
+    uint64_t now_ms = ttl_now_ms();
+    for (size_t i = 0; i < txn->num_reads; i++) {
+      seen[i] = nodes[i] == NULL ? NULL : __atomic_load_n(&nodes[i]->versions, __ATOMIC_ACQUIRE);
+      int live = seen[i] != NULL && version_live(seen[i], now_ms);
+      const char *value = live && seen[i]->value_len == txn->expected_lens[i]
+                              ? version_value(seen[i], &scratch, &scratch_cap)
+                              : NULL;
+      if (value == NULL || memcmp(value, txn->expected[i], seen[i]->value_len) != 0) {
+        list_mismatch(enc, listed, txn->read_keys[i], live ? seen[i] : NULL, &scratch, &scratch_cap);
+        matched = 0;
+      }
+    }
+    if (!matched) {
+      prof_rwunlock(&table->tablelock);
+      result = 1;
+      break;
+    }
+
+    if (exclusive) {
+      uint64_t seq = commit_begin(table);
+      for (size_t i = 0; i < txn->num_writes; i++) {
+        if (write_pair(table, txn->write_keys[i], new_versions[i], seq) != 0) {
+          fprintf(stderr, "Failed to write key pair (%s,%s)\n", txn->write_keys[i], txn->values[i]);
+        }
+        new_versions[i] = NULL;
+      }
+      commit_end(table, seq);
+      prof_rwunlock(&table->tablelock);
+      result = 0;
+      break;
+    }
+
+    // Validation and write phase
+    memcpy(locked, nodes, num_nodes * sizeof(KeyNode *));
+    qsort(locked, num_nodes, sizeof(KeyNode *), compare_nodes);
+    size_t num_locked = 0;
+    for (size_t i = 0; i < num_nodes; i++) {
+      if (num_locked == 0 || locked[num_locked - 1] != locked[i]) {
+        locked[num_locked++] = locked[i];
+        pthread_mutex_lock(&locked[i]->lock);
+      }
+    }
+
+    int valid = 1;
+    for (size_t i = 0; i < txn->num_reads; i++) {
+      valid &= nodes[i]->versions == seen[i];
+    }
+    if (valid) {
+      uint64_t seq = commit_begin(table);
+      for (size_t i = 0; i < txn->num_writes; i++) {
+        update_value(table, write_nodes[i], new_versions[i], seq);
+        new_versions[i] = NULL;
+      }
+      commit_end(table, seq);
+    }
+
+    for (size_t i = num_locked; i > 0; i--) {
+      pthread_mutex_unlock(&locked[i - 1]->lock);
+    }
+    prof_rwunlock(&table->tablelock);
+    if (valid) {
+      result = 0;
+      break;
+    }
+  }
+
+  free(scratch);
+  return result;
+}
+
+// Commits a transaction whose keys are in several shards, holding the write
+// lock of every shard involved (taken in shard order, so such commits cannot
+// deadlock). Each shard commits separately, so a snapshot of one shard may
+// see the transaction before a snapshot of another does.
+// @param mask Shards of the keys.
+// @param new_versions See commit_txn.
+// @return 0 if committed, 1 if a key of the read set did not match.
+static int commit_txn_across(const Txn *txn, Encoder *enc, int *listed, uint64_t mask,
+                             Version **new_versions) {
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    if (mask & (uint64_t)1 << shard) {
+      prof_wrlock(&tables[shard]->tablelock, "tablelock");
+    }
+  }
+
+  char *scratch = NULL;
+  size_t scratch_cap = 0;
+  int matched = 1;
+  uint64_t now_ms = ttl_now_ms();
+  for (size_t i = 0; i < txn->num_reads; i++) {
+    KeyNode *node;
+    read_pairs(table_of(txn->read_keys[i]), 1, &txn->read_keys[i], &node);
+    Version *version = node == NULL ? NULL : latest_version(node, now_ms);
+    const char *value = version != NULL && version->value_len == txn->expected_lens[i]
+                            ? version_value(version, &scratch, &scratch_cap)
+                            : NULL;
+    if (value == NULL || memcmp(value, txn->expected[i], version->value_len) != 0) {
+      list_mismatch(enc, listed, txn->read_keys[i], version, &scratch, &scratch_cap);
+      matched = 0;
+    }
+  }
+
+  if (matched) {
+    uint64_t seqs[MAX_SHARDS];
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      if (mask & (uint64_t)1 << shard) {
+        seqs[shard] = commit_begin(tables[shard]);
+      }
+    }
+    for (size_t i = 0; i < txn->num_writes; i++) {
+      size_t shard = shard_of(txn->write_keys[i]);
+      if (write_pair(tables[shard], txn->write_keys[i], new_versions[i], seqs[shard]) != 0) {
+        fprintf(stderr, "Failed to write key pair (%s,%s)\n", txn->write_keys[i], txn->values[i]);
+      }
+      new_versions[i] = NULL;
+    }
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      if (mask & (uint64_t)1 << shard) {
+        commit_end(tables[shard], seqs[shard]);
+      }
+    }
+  }
+
+  for (size_t shard = num_shards; shard-- > 0;) {
+    if (mask & (uint64_t)1 << shard) {
+      prof_rwunlock(&tables[shard]->tablelock);
+    }
+  }
+  free(scratch);
+  return matched ? 0 : 1;
+}
+
+// Runs a transaction (see commit_txn).
+// @return 0 if committed, 1 if a key of the read set did not match, -1 on error.
+static int run_txn(const Txn *txn, Encoder *enc, int *listed) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < txn->num_reads; i++) {
+    mask |= (uint64_t)1 << shard_of(txn->read_keys[i]);
+  }
+  for (size_t i = 0; i < txn->num_writes; i++) {
+    mask |= (uint64_t)1 << shard_of(txn->write_keys[i]);
+  }
+  size_t first_shard = 0;
+  while (first_shard < num_shards - 1 && !(mask & (uint64_t)1 << first_shard)) {
+    first_shard++;
+  }
+
+  size_t num_nodes = txn->num_reads + txn->num_writes;
+  KeyNode **nodes = malloc(num_nodes * sizeof(KeyNode *));  // Read set, then write set
+  KeyNode **locked = malloc(num_nodes * sizeof(KeyNode *));
+  Version **seen = malloc(num_nodes * sizeof(Version *));
+  Version **new_versions = calloc(txn->num_writes, sizeof(Version *));
+
+  int result = -1;
+  if (nodes != NULL && locked != NULL && seen != NULL && new_versions != NULL) {
+    // Allocated up front, so nothing is allocated while the nodes are locked
+    size_t allocated = 0;
+    while (allocated < txn->num_writes &&
+           (new_versions[allocated] = new_version(txn->values[allocated], txn->value_lens[allocated])) != NULL) {
+      allocated++;
+    }
+    if (allocated == txn->num_writes) {
+      result = mask & (mask - 1)
+                   ? commit_txn_across(txn, enc, listed, mask, new_versions)
+                   : commit_txn(tables[first_shard], txn, enc, listed, nodes, locked, seen, new_versions);
+    }
+  }
+  if (result < 0) {
+    fprintf(stderr, "Failed to allocate memory for the transaction\n");
+  }
+
+  if (new_versions != NULL) {
+    for (size_t i = 0; i < txn->num_writes; i++) {
+      if (new_versions[i] != NULL) {
+        free_version(new_versions[i]);
+      }
+    }
+  }
+  free(new_versions);
+  free(seen);
+  free(locked);
+  free(nodes);
+
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    if (mask & (uint64_t)1 << shard) {
+      maybe_evict(tables[shard]);
+      maybe_collect_garbage(tables[shard]);
+    }
+  }
+  return result;
+}
+
+int kvs_cas(size_t num_keys, char keys[][MAX_STRING_SIZE], const ValueList *expected,
+            const ValueList *values, int fd) {
+  if (tables[0] == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  touch_keys(num_keys, keys, 1);
+
+  char buffer[ENC_BUFFER_SIZE];
+  Encoder enc;
+  enc_init(&enc, fd, output_mode, buffer, sizeof(buffer));
+
+  int listed = 0, failed = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    Txn txn = {1, &keys[i], &expected->values[i], &expected->lens[i],
+               1, &keys[i], &values->values[i], &values->lens[i]};
+    failed |= run_txn(&txn, &enc, &listed) < 0;
+  }
+  if (listed) {
+    enc_list_end(&enc);
+  }
+
+  enc_flush(&enc);
+  return failed;
+}
+
+int kvs_txn(size_t num_reads, char read_keys[][MAX_STRING_SIZE], const ValueList *expected,
+            size_t num_writes, char write_keys[][MAX_STRING_SIZE], const ValueList *values,
+            int fd) {
+  if (tables[0] == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  touch_keys(num_reads, read_keys, 0);
+  touch_keys(num_writes, write_keys, 1);
+
+  char buffer[ENC_BUFFER_SIZE];
+  Encoder enc;
+  enc_init(&enc, fd, output_mode, buffer, sizeof(buffer));
+
+  Txn txn = {num_reads, read_keys, expected->values, expected->lens,
+             num_writes, write_keys, values->values, values->lens};
+  int listed = 0;
+  int result = run_txn(&txn, &enc, &listed);
+  if (listed) {
+    enc_list_end(&enc);
+  }
+
+  enc_flush(&enc);
+  return result < 0;
+}
+
+static void delete_part(ShardTask *task, size_t shard) {
+  ShardOp *op = (ShardOp *)task;
+  HashTable *table = tables[shard];
+  prof_wrlock(&table->tablelock, "tablelock");
+
+  uint64_t seq = commit_begin(table);
+  for (size_t j = 0; j < op->count; j++) {
+    size_t i = op->idx[j];
+    op->missing[i] = delete_pair(table, op->keys[i], seq) != 0;
+  }
+  commit_end(table, seq);
+
+  prof_rwunlock(&table->tablelock);
+
+  maybe_collect_garbage(table);
+}
+
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+  if (tables[0] == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  touch_keys(num_pairs, keys, 1);
+
+  unsigned char missing[MAX_WRITE_SIZE];
+  ShardOp op = {.keys = keys, .missing = missing};
+  run_sharded(num_pairs, &op, delete_part);
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  char buffer[ENC_BUFFER_SIZE];
+  Encoder enc;
+  enc_init(&enc, fd, output_mode, buffer, sizeof(buffer));
 
   int aux = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (missing[i]) {
       if (!aux) {
-        write_str(fd, "[");
+        enc_list_begin(&enc);
         aux = 1;
       }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      enc_status(&enc, keys[i], strlen(keys[i]), ENC_TAG_MISSING);
     }
   }
   if (aux) {
-    write_str(fd, "]\n");
+    enc_list_end(&enc);
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  enc_flush(&enc);
   return 0;
 }
 
+// Registers a reader of every table.
+// @param snapshots One per shard.
+static void begin_snapshots(Snapshot *snapshots) {
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    snapshot_begin(tables[shard], &snapshots[shard]);
+  }
+}
+
+static void end_snapshots(Snapshot *snapshots) {
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    snapshot_end(tables[shard], &snapshots[shard]);
+  }
+}
+
 void kvs_show(int fd) {
-  if (kvs_table == NULL) {
+  if (tables[0] == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
-  
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
-  
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key, keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+
+  char *buffer = malloc(SHOW_CHUNK_SIZE);
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to allocate memory for SHOW\n");
+    return;
+  }
+
+  Encoder enc;
+  enc_init(&enc, fd, output_mode, buffer, SHOW_CHUNK_SIZE);
+
+  // Every table is read as of one commit without its lock, so writers go on
+  // and the output (flushed every time the buffer fills up) is consistent
+  Snapshot snapshots[MAX_SHARDS];
+  begin_snapshots(snapshots);
+  char *scratch = NULL;
+  size_t scratch_cap = 0;
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    TableCursor cursor;
+    table_cursor_init(&cursor);
+    KeyNode *keyNode;
+    while ((keyNode = table_cursor_next(tables[shard], &cursor)) != NULL) {
+      Version *version = version_at(keyNode, &snapshots[shard]);
+      if (version != NULL) {
+        encode_version(&enc, 1, keyNode->key, keyNode->key_len, version, &scratch, &scratch_cap);
+      }
     }
   }
+  end_snapshots(snapshots);
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  enc_flush(&enc);
+  free(scratch);
+  free(buffer);
+}
+
+// A pair copied out of the table by kvs_show_sorted.
+typedef struct ShowEntry {
+  const char *key;
+  size_t key_len;
+  const char *value;
+  size_t value_len;
+  size_t compressed_len;  // Bytes of value if it was kept compressed, 0 otherwise
+} ShowEntry;
+
+// Pairs copied while holding the lock once, sorted by key.
+typedef struct ShowChunk {
+  char *data;  // Keys and values
+  ShowEntry *entries;
+  size_t count;
+  size_t next;  // Next entry to merge
+} ShowChunk;
+
+static int compare_keys(const char *a, size_t a_len, const char *b, size_t b_len) {
+  int result = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (result != 0) {
+    return result;
+  }
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const ShowEntry *x = a;
+  const ShowEntry *y = b;
+  return compare_keys(x->key, x->key_len, y->key, y->key_len);
+}
+
+// Copies the next pairs of the table (about SHOW_CHUNK_SIZE bytes) into a
+// chunk and sorts them.
+// @return 1 if there may be more pairs, 0 at the end of the table, -1 on error.
+static int read_show_chunk(HashTable *table, TableCursor *cursor, const Snapshot *snapshot,
+                           ShowChunk *chunk) {
+  size_t data_cap = 2 * SHOW_CHUNK_SIZE, data_len = 0;
+  size_t entries_cap = 256;
+  chunk->data = malloc(data_cap);
+  chunk->entries = malloc(entries_cap * sizeof(ShowEntry));
+  chunk->count = 0;
+  chunk->next = 0;
+  if (chunk->data == NULL || chunk->entries == NULL) {
+    return -1;
+  }
+
+  int result = 0;
+  KeyNode *keyNode;
+  while ((keyNode = table_cursor_next(table, cursor)) != NULL) {
+    Version *version = version_at(keyNode, snapshot);
+    if (version == NULL) {
+      continue;
+    }
+    // Compressed values are only kept as they are to be passed through
+    size_t compressed_len = output_mode == ENC_BINARY_LZ ? version->compressed_len : 0;
+    size_t size = keyNode->key_len + (compressed_len != 0 ? compressed_len : version->value_len);
+    if (data_len + size > data_cap) {
+      data_cap = data_len + size;
+      char *data = realloc(chunk->data, data_cap);
+      if (data == NULL) {
+        result = -1;
+        break;
+      }
+      chunk->data = data;
+    }
+    if (chunk->count == entries_cap) {
+      ShowEntry *entries = realloc(chunk->entries, 2 * entries_cap * sizeof(ShowEntry));
+      if (entries == NULL) {
+        result = -1;
+        break;
+      }
+      chunk->entries = entries;
+      entries_cap *= 2;
+    }
+
+    // Offsets for now, the data may still move
+    ShowEntry *entry = &chunk->entries[chunk->count++];
+    entry->key = (const char *)(uintptr_t)data_len;
+    entry->key_len = keyNode->key_len;
+    memcpy(chunk->data + data_len, keyNode->key, keyNode->key_len);
+    data_len += keyNode->key_len;
+    entry->value = (const char *)(uintptr_t)data_len;
+    entry->value_len = version->value_len;
+    entry->compressed_len = compressed_len;
+    if (compressed_len != 0) {
+      memcpy(chunk->data + data_len, version->value, compressed_len);
+      data_len += compressed_len;
+    } else if (version_copy(version, chunk->data + data_len) != 0) {
+      fprintf(stderr, "Failed to decompress the value of key %s\n", keyNode->key);
+      chunk->count--;
+      data_len -= keyNode->key_len;
+    } else {
+      data_len += version->value_len;
+    }
+
+    if (data_len >= SHOW_CHUNK_SIZE) {
+      result = 1;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < chunk->count; i++) {
+    chunk->entries[i].key = chunk->data + (uintptr_t)chunk->entries[i].key;
+    chunk->entries[i].value = chunk->data + (uintptr_t)chunk->entries[i].value;
+  }
+  qsort(chunk->entries, chunk->count, sizeof(ShowEntry), compare_entries);
+  return result;
+}
+
+static int chunk_less(ShowChunk *chunks, size_t a, size_t b) {
+  ShowEntry *x = &chunks[a].entries[chunks[a].next];
+  ShowEntry *y = &chunks[b].entries[chunks[b].next];
+  return compare_keys(x->key, x->key_len, y->key, y->key_len) < 0;
+}
+
+// Restores the min-heap of chunks (ordered by their next key) below position i.
+static void sift_down(ShowChunk *chunks, size_t *heap, size_t size, size_t i) {
+  while (1) {
+    size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < size && chunk_less(chunks, heap[left], heap[smallest])) {
+      smallest = left;
+    }
+    if (right < size && chunk_less(chunks, heap[right], heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    size_t tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+void kvs_show_sorted(int fd) {
+  if (tables[0] == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
+
+  size_t num_chunks = 0, chunks_cap = 16;
+  ShowChunk *chunks = malloc(chunks_cap * sizeof(ShowChunk));
+  if (chunks == NULL) {
+    fprintf(stderr, "Failed to allocate memory for SHOW\n");
+    return;
+  }
+
+  // Every chunk of a table is read as of the same commit
+  Snapshot snapshots[MAX_SHARDS];
+  begin_snapshots(snapshots);
+  int failed = 0;
+  for (size_t shard = 0; shard < num_shards && !failed; shard++) {
+    TableCursor cursor;
+    table_cursor_init(&cursor);
+    int more = 1;
+    while (more == 1) {
+      if (num_chunks == chunks_cap) {
+        ShowChunk *grown = realloc(chunks, 2 * chunks_cap * sizeof(ShowChunk));
+        if (grown == NULL) {
+          failed = 1;
+          break;
+        }
+        chunks = grown;
+        chunks_cap *= 2;
+      }
+      more = read_show_chunk(tables[shard], &cursor, &snapshots[shard], &chunks[num_chunks++]);
+      failed = more == -1;
+    }
+  }
+  end_snapshots(snapshots);
+
+  if (failed) {
+    fprintf(stderr, "Failed to allocate memory for SHOW\n");
+  } else {
+    // k-way merge of the sorted chunks
+    size_t *heap = malloc(num_chunks * sizeof(size_t));
+    size_t heap_size = 0;
+    for (size_t i = 0; heap != NULL && i < num_chunks; i++) {
+      if (chunks[i].count > 0) {
+        heap[heap_size++] = i;
+      }
+    }
+    for (size_t i = heap_size; i-- > 0;) {
+      sift_down(chunks, heap, heap_size, i);
+    }
+
+    char buffer[ENC_BUFFER_SIZE];
+    Encoder enc;
+    enc_init(&enc, fd, output_mode, buffer, sizeof(buffer));
+    while (heap_size > 0) {
+      ShowChunk *chunk = &chunks[heap[0]];
+      ShowEntry *entry = &chunk->entries[chunk->next++];
+      if (entry->compressed_len != 0) {
+        enc_compressed(&enc, entry->key, entry->key_len, entry->value, entry->compressed_len,
+                       entry->value_len);
+      } else {
+        enc_entry(&enc, entry->key, entry->key_len, entry->value, entry->value_len);
+      }
+      if (chunk->next == chunk->count) {
+        heap[0] = heap[--heap_size];
+      }
+      sift_down(chunks, heap, heap_size, 0);
+    }
+    enc_flush(&enc);
+    free(heap);
+  }
+
+  for (size_t i = 0; i < num_chunks; i++) {
+    free(chunks[i].data);
+    free(chunks[i].entries);
+  }
+  free(chunks);
+}
+
+// Writes, in key order, the pairs from first up to last (both optional) whose
+// key starts with prefix (optional), merging the indexes of the shards. The
+// indexes need the table locks, so they are scanned in chunks and the locks
+// are released between them; the next chunk starts after the last key
+// written. Every chunk reads the same snapshots.
+static void scan_index(const char *first, const char *last, const char *prefix, int fd) {
+  size_t cap = 2 * SHOW_CHUNK_SIZE;
+  char *buffer = malloc(cap);
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to allocate memory for the scan\n");
+    return;
+  }
+
+  Encoder enc;
+  enc_init(&enc, fd, output_mode, buffer, cap);
+  enc_list_begin(&enc);
+
+  size_t prefix_len = prefix == NULL ? 0 : strlen(prefix);
+  char *scratch = NULL;
+  size_t scratch_cap = 0;
+  Snapshot snapshots[MAX_SHARDS];
+  begin_snapshots(snapshots);
+  char *resume = NULL;
+  int done = 0;
+  while (!done) {
+    // Next entry of the index of every shard, NULL key once it ran out
+    BTreeIter iters[MAX_SHARDS];
+    const char *keys[MAX_SHARDS];
+    void *values[MAX_SHARDS];
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      prof_rdlock(&tables[shard]->tablelock, "tablelock");
+      btree_seek(&tables[shard]->index, resume != NULL ? resume : first, &iters[shard]);
+      if (!btree_next(&iters[shard], &keys[shard], &values[shard])) {
+        keys[shard] = NULL;
+      }
+    }
+
+    done = 1;
+    while (1) {
+      size_t min = num_shards;
+      for (size_t shard = 0; shard < num_shards; shard++) {
+        if (keys[shard] != NULL && (min == num_shards || strcmp(keys[shard], keys[min]) < 0)) {
+          min = shard;
+        }
+      }
+      if (min == num_shards) {
+        break;
+      }
+      const char *key = keys[min];
+      KeyNode *keyNode = values[min];
+      if (!btree_next(&iters[min], &keys[min], &values[min])) {
+        keys[min] = NULL;
+      }
+
+      if (resume != NULL && strcmp(key, resume) == 0) {
+        continue;
+      }
+      if ((last != NULL && strcmp(key, last) > 0) ||
+          (prefix != NULL && strncmp(key, prefix, prefix_len) != 0)) {
+        break;
+      }
+      Version *version = version_at(keyNode, &snapshots[min]);
+      if (version == NULL) {
+        continue;
+      }
+      encode_version(&enc, 0, keyNode->key, keyNode->key_len, version, &scratch, &scratch_cap);
+      if (enc.len >= SHOW_CHUNK_SIZE) {
+        free(resume);
+        resume = strdup(keyNode->key);
+        if (resume == NULL) {
+          fprintf(stderr, "Failed to allocate memory for the scan\n");
+        } else {
+          done = 0;
+        }
+        break;
+      }
+    }
+    for (size_t shard = num_shards; shard-- > 0;) {
+      prof_rwunlock(&tables[shard]->tablelock);
+    }
+
+    if (done) {
+      enc_list_end(&enc);
+    }
+    enc_flush(&enc);
+  }
+  end_snapshots(snapshots);
+
+  free(scratch);
+  free(resume);
+  free(buffer);
+}
+
+void kvs_range(const char *first, const char *last, int fd) {
+  if (tables[0] == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
+  scan_index(first, last, NULL, fd);
+}
+
+void kvs_prefix(const char *prefix, int fd) {
+  if (tables[0] == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
+  scan_index(prefix, NULL, prefix, fd);
 }
 
 int kvs_backup(size_t num_backup,char* job_filename , char* directory) {
@@ -142,35 +1189,69 @@ int kvs_backup(size_t num_backup,char* job_filename , char* directory) {
   snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory, strtok(job_filename, "."),
            num_backup);
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  // Backups keep compressed values as they are in the binary-lz format, and
+  // are text otherwise.
+  int mode = output_mode == ENC_BINARY_LZ ? ENC_BINARY_LZ : ENC_TEXT;
+
+  // Held for writing so no commit is halfway through when memory is copied
+  uint64_t now_ms = ttl_now_ms();
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    prof_wrlock(&tables[shard]->tablelock, "tablelock");
+  }
+  // The child may not allocate, so the scratch buffer already fits the
+  // longest value. It only grows when that limit went up, under the locks
+  // so one backup grows it at a time.
+  size_t max_value_size = get_max_value_size();
+  if (mode == ENC_TEXT && backup_scratch_cap < max_value_size) {
+    char *grown = realloc(backup_scratch, max_value_size);
+    if (grown == NULL) {
+      for (size_t shard = num_shards; shard-- > 0;) {
+        prof_rwunlock(&tables[shard]->tablelock);
+      }
+      fprintf(stderr, "Failed to allocate memory for the backup\n");
+      return -1;
+    }
+    backup_scratch = grown;
+    backup_scratch_cap = max_value_size;
+  }
   pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  for (size_t shard = num_shards; shard-- > 0;) {
+    prof_rwunlock(&tables[shard]->tablelock);
+  }
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
+    // (the encoder only copies into this stack buffer and calls write)
     int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->key, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ", ", MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->value, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ")\n", MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
+    char buffer[ENC_BUFFER_SIZE];
+    Encoder enc;
+    enc_init(&enc, fd, mode, buffer, sizeof(buffer));
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      for (int i = 0; i < TABLE_SIZE; i++) {
+        KeyNode *keyNode = tables[shard]->table[i]; // Get the next list head
+        while (keyNode != NULL) {
+          Version *version = latest_version(keyNode, now_ms);
+          if (version == NULL) {
+            // Deleted or expired
+          } else if (version->compressed_len == 0) {
+            enc_entry(&enc, keyNode->key, keyNode->key_len, version->value, version->value_len);
+          } else if (mode == ENC_BINARY_LZ) {
+            enc_compressed(&enc, keyNode->key, keyNode->key_len, version->value,
+                           version->compressed_len, version->value_len);
+          } else {
+            const char *value = version_value(version, &backup_scratch, &backup_scratch_cap);
+            if (value != NULL) {
+              enc_entry(&enc, keyNode->key, keyNode->key_len, value, version->value_len);
+            }
+          }
+          keyNode = keyNode->next; // Move to the next node of the list
+        }
       }
     }
+    enc_flush(&enc);
     exit(1);
-  } else if (pid < 0) {
+  }
+  if (pid < 0) {
     return -1;
   }
   return 0;
@@ -210,9 +1291,24 @@ void add_client(Client** head, Client* new_client) {
     }
 }
 
+void remove_client(Client** head, Client* client) {
+    Client** link = head;
+    while (*link != NULL && *link != client) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = client->next;
+    }
+}
+
 int subscribe(const char * key, const char * client_id, int fd_resp_pipe, int fd_notif_pipe){
   int op_code = 3;
-  int value = sub_key(kvs_table, key, client_id, fd_notif_pipe);
+  // Held for writing: the subscribers of a pair change, and collect_garbage
+  // must not free its node meanwhile
+  HashTable *table = table_of(key);
+  prof_wrlock(&table->tablelock, "tablelock");
+  int value = sub_key(table, key, client_id, fd_notif_pipe);
+  prof_rwunlock(&table->tablelock);
   char buffer[3];
 
   snprintf(buffer, sizeof(buffer), "%d%d", op_code, value);
@@ -220,14 +1316,17 @@ int subscribe(const char * key, const char * client_id, int fd_resp_pipe, int fd
     fprintf(stderr, "Failed to write to the response FIFO while subscribing!");
     return -1;
   }
-  //print_everything_at_key(key, kvs_table);
+  //print_everything_at_key(key, table_of(key));
   return value;
 }
 
 int unsubscribe(const char * key, const char * client_id, int fd_resp_pipe){
-  //print_everything_at_key(key, kvs_table);
+  //print_everything_at_key(key, table_of(key));
   int op_code = 4;
-  int value = unsub_key(kvs_table, key, client_id);
+  HashTable *table = table_of(key);
+  prof_wrlock(&table->tablelock, "tablelock");
+  int value = unsub_key(table, key, client_id);
+  prof_rwunlock(&table->tablelock);
   char buffer[3];
   memset(buffer, '\0', sizeof(buffer));
   snprintf(buffer, sizeof(buffer), "%d%d", op_code, value);
@@ -237,22 +1336,30 @@ int unsubscribe(const char * key, const char * client_id, int fd_resp_pipe){
     fprintf(stderr, "Failed to write to the response FIFO while unsubscribing");
     return -1;
   }
-  //print_everything_at_key(key, kvs_table);
+  //print_everything_at_key(key, table_of(key));
   return value;
 }
 
-int disconnect(Client *client){
+int reset_subscriptions(Client *client){
   Chaves_subscritas *keyNode;
   keyNode = client->sub_keys;
 
   while (keyNode != NULL){
-    if (remove_subs(kvs_table, client->id, keyNode->key) == 1){
-      fprintf(stderr, "Error while unsubscribing in hashtable\n");
-      return -1;
-    }
+    // A key that is gone ended its subscriptions as it went
+    HashTable *table = table_of(keyNode->key);
+    prof_wrlock(&table->tablelock, "tablelock");
+    remove_subs(table, client->id, keyNode->key);
+    prof_rwunlock(&table->tablelock);
     keyNode->active = 0;
     keyNode = keyNode->next;
   }
+  return 0;
+}
+
+int disconnect(Client *client){
+  if (reset_subscriptions(client) != 0){
+    return -1;
+  }
   client->active = 0;
   return 0;
 }
@@ -270,6 +1377,10 @@ int delete_subscriptions(Client *client){
     client = client->next;
   }
 
-  remove_todas(kvs_table);
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    prof_wrlock(&tables[shard]->tablelock, "tablelock");
+    remove_todas(tables[shard]);
+    prof_rwunlock(&tables[shard]->tablelock);
+  }
   return 0;
 }
\ No newline at end of file
@@ -2,12 +2,31 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "constants.h"
+#include "values.h"
 
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Selects the format of the results written by kvs_read, kvs_delete and
+/// kvs_show. Backups are written as text, unless the format is ENC_BINARY_LZ.
+/// @param mode ENC_TEXT, ENC_BINARY or ENC_BINARY_LZ (see encoder.h).
+void set_output_mode(int mode);
+
+/// Bounds the memory of the pairs. Once writes go past it, the least recently
+/// used pairs are evicted (see evict_pairs).
+/// @param bytes The budget, 0 for no bound.
+void set_memory_budget(size_t bytes);
+
+/// Splits the keyspace by key hash in shards, each a table of its own whose
+/// writes, reads and deletes are run by an owner thread (see shard.h). The
+/// memory budget is shared evenly between them. Must be called before
+/// kvs_init.
+/// @param count Number of shards, 1 to MAX_SHARDS.
+void set_num_shards(size_t count);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
@@ -15,9 +34,11 @@ int kvs_terminate();
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param values The values, in the order of the keys.
+/// @param ttl_ms Milliseconds the pairs live for, 0 if they never expire.
+/// With shards, the pairs of each shard are committed on their own.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], const ValueList *values, unsigned int ttl_ms);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
@@ -26,16 +47,65 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 /// @return 0 if the key reading, 1 otherwise.
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
+/// Compare-and-swap: writes each new value only if its key currently has the
+/// expected value. Every key is swapped atomically on its own. The keys that
+/// did not match are written as a list with the value they had, or
+/// KVSMISSING, like the result of kvs_delete.
+/// @param num_keys Number of keys.
+/// @param keys Array of keys' strings.
+/// @param expected Values the keys must have.
+/// @param values New values.
+/// @param fd File descriptor to write the output.
+/// @return 0 if every key was checked, 1 otherwise.
+int kvs_cas(size_t num_keys, char keys[][MAX_STRING_SIZE], const ValueList *expected,
+            const ValueList *values, int fd);
+
+/// Atomically applies a write set if every key of the read set has its
+/// expected value. Transactions that touch existing keys only are committed
+/// with optimistic concurrency control (per-key versions) and do not block
+/// each other unless they share keys. The keys of the read set that did not
+/// match are written like with kvs_cas, and then nothing is written.
+/// @param num_reads Number of keys in the read set.
+/// @param read_keys Keys of the read set.
+/// @param expected Values the keys of the read set must have.
+/// @param num_writes Number of pairs in the write set.
+/// @param write_keys Keys of the write set.
+/// @param values Values of the write set.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the transaction was committed or rejected, 1 on error.
+int kvs_txn(size_t num_reads, char read_keys[][MAX_STRING_SIZE], const ValueList *expected,
+            size_t num_writes, char write_keys[][MAX_STRING_SIZE], const ValueList *values,
+            int fd);
+
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
-/// Writes the state of the KVS.
+/// Writes the state of the KVS. The table is walked in chunks of about
+/// SHOW_CHUNK_SIZE bytes and the lock is released between chunks, so
+/// writers are not blocked for the whole dump.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Writes the state of the KVS ordered by key. Every chunk is copied and
+/// sorted while holding the lock once, and the chunks are merged at the end.
+/// @param fd File descriptor to write the output.
+void kvs_show_sorted(int fd);
+
+/// Writes the pairs whose keys are between first and last (inclusive), in key
+/// order, as a list like the one of kvs_read.
+/// @param first Smallest key.
+/// @param last Largest key.
+/// @param fd File descriptor to write the output.
+void kvs_range(const char *first, const char *last, int fd);
+
+/// Writes the pairs whose keys start with prefix, in key order.
+/// @param prefix The prefix.
+/// @param fd File descriptor to write the output.
+void kvs_prefix(const char *prefix, int fd);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
 /// backup file
 /// @return 0 if the backup was successful, 1 otherwise.
@@ -48,9 +118,23 @@ void kvs_wait_backup();
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
 
+/// Counts the clients subscribed to a key (see hotkeys_set_subscribers_fn).
+/// @return The active subscriptions, 0 if the key is not there.
+size_t kvs_subscribers(const char *key);
+
+/// Sums the memory of the pairs and their evictions over the shards (see
+/// metrics_set_memory_fn).
+/// @param memory_used Where the bytes of the nodes and versions are stored.
+/// @param evictions Where the pairs evicted so far are stored.
+void kvs_memory(uint64_t *memory_used, uint64_t *evictions);
+
 int subscribe(const char * key, const char * client_id, int fd_resp_pipe, int fd_notif_pipe);
 int unsubscribe(const char * key, const char * client_id, int fd_resp_pipe);
 int disconnect(Client* client);
+
+/// Ends every subscription of a client, which stays connected.
+/// @return 0 (subscriptions of keys that are gone have already ended).
+int reset_subscriptions(Client *client);
 void add_client(Client** head, Client* new_client);
 
 /// Finds a client based on its key
@@ -62,6 +146,11 @@ Client* find_client(const char* key, Client* head);
 /// @param head The head of the list
 /// @param new_client The client to be added
 void add_client(Client** head, Client* new_client);
+
+/// Removes a client from the list, if it is there
+/// @param head The head of the list
+/// @param client The client to be removed
+void remove_client(Client** head, Client* client);
 // Setter for max_backups
 // @param _max_backups
 void set_max_backups(int _max_backups);
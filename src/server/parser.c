@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "aio.h"
 #include "constants.h"
 #include "io.h"
 
@@ -20,7 +21,7 @@ static int read_string(int fd, char *buffer, size_t max) {
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+    bytes_read = aio_read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
         return -1;
@@ -46,11 +47,43 @@ static int read_string(int fd, char *buffer, size_t max) {
     buffer[i++] = ch;
   }
 
+  if (i == max) {
+    buffer[max - 1] = '\0';  // Too long, with no room left for the terminator
+    return -1;
+  }
   buffer[i] = '\0';
 
   return value;
 }
 
+// Reads a value of any length up to the value size limit, the same way as
+// read_string.
+// @param fd File to read from.
+// @param values List the value is added to.
+// @return Like read_string, or -2 if the line ended before the value did, so
+//         the caller must not skip to the next one.
+static int read_value(int fd, ValueList *values) {
+  char ch;
+
+  while (1) {
+    if (aio_read(fd, &ch, 1) <= 0 || ch == ' ') {
+      return -1;
+    }
+    if (ch == '\n') {
+      return -2;
+    }
+
+    int value = ch == ',' ? 0 : ch == ')' ? 1 : ch == ']' ? 2 : -1;
+    if (value != -1) {
+      return value_list_end(values) == 0 ? value : -1;
+    }
+
+    if (value_list_put(values, ch) != 0) {
+      return -1;
+    }
+  }
+}
+
 // Reads a number and stores it in an unsigned integer
 // variable.
 // @param fd File to read from.
@@ -61,7 +94,7 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (aio_read(fd, buf + i, 1) == 0) {
       *next = '\0';
       break;
     }
@@ -91,20 +124,21 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 // @param fd File descriptor.
 static void cleanup(int fd) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (aio_read(fd, &ch, 1) == 1 && ch != '\n')
     ;
 }
 
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  ssize_t bytes_read;
+  if (aio_read(fd, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+      if (aio_read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (aio_read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
           cleanup(fd);
           return CMD_INVALID;
         }
@@ -114,15 +148,71 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      if (aio_read(fd, buf + 1, 4) != 4) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      if (strncmp(buf, "READ ", 5) == 0) {
+        return CMD_READ;
+      }
+      if (strncmp(buf, "RANGE", 5) != 0 || aio_read(fd, buf + 5, 1) != 1 || buf[5] != ' ') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_RANGE;
+
+    case 'P':
+      if (aio_read(fd, buf + 1, 6) != 6 || strncmp(buf, "PREFIX ", 7) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_PREFIX;
+
+    case 'C':
+      if (aio_read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_CAS;
+
+    case 'T':
+      if (aio_read(fd, buf + 1, 3) != 3) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      if (strncmp(buf, "TRAC", 4) == 0) {
+        if (aio_read(fd, buf + 4, 4) != 4 || strncmp(buf, "TRACE O", 7) != 0) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        if (buf[7] == 'F') {
+          if (aio_read(fd, buf + 8, 1) != 1 || buf[8] != 'F') {
+            cleanup(fd);
+            return CMD_INVALID;
+          }
+        } else if (buf[7] != 'N') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        bytes_read = aio_read(fd, buf + 9, 1);
+        if (bytes_read != 0 && buf[9] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return buf[7] == 'N' ? CMD_TRACE_ON : CMD_TRACE_OFF;
+      }
+      if (strncmp(buf, "TXN ", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_READ;
+      return CMD_TXN;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+      if (aio_read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -130,12 +220,52 @@ enum Command get_next(int fd) {
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      if (aio_read(fd, buf + 1, 3) != 3) {
         cleanup(fd);
         return CMD_INVALID;
       }
+      if (strncmp(buf, "STAT", 4) == 0) {
+        if (aio_read(fd, buf + 4, 1) != 1 || buf[4] != 'S') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        bytes_read = aio_read(fd, buf + 5, 1);
+        if (bytes_read == 1 && buf[5] == ' ') {
+          if (aio_read(fd, buf + 6, 4) != 4 || strncmp(buf, "STATS JSON", 10) != 0) {
+            cleanup(fd);
+            return CMD_INVALID;
+          }
+          if (aio_read(fd, buf + 10, 1) != 0 && buf[10] != '\n') {
+            cleanup(fd);
+            return CMD_INVALID;
+          }
+          return CMD_STATS_JSON;
+        }
+        if (bytes_read != 0 && buf[5] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return CMD_STATS;
+      }
+      if (strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      bytes_read = aio_read(fd, buf + 4, 1);
+      if (bytes_read == 1 && buf[4] == ' ') {
+        if (aio_read(fd, buf + 5, 6) != 6 || strncmp(buf, "SHOW SORTED", 11) != 0) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        if (aio_read(fd, buf + 11, 1) != 0 && buf[11] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return CMD_SHOW_SORTED;
+      }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (bytes_read != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -143,12 +273,12 @@ enum Command get_next(int fd) {
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+      if (aio_read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+      if (aio_read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -156,12 +286,24 @@ enum Command get_next(int fd) {
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      if (aio_read(fd, buf + 1, 3) != 3) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      if (strncmp(buf, "HOTK", 4) == 0) {
+        if (aio_read(fd, buf + 4, 3) != 3 || strncmp(buf, "HOTKEYS", 7) != 0 ||
+            (aio_read(fd, buf + 7, 1) != 0 && buf[7] != '\n')) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return CMD_HOTKEYS;
+      }
+      if (strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (aio_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -184,48 +326,52 @@ enum Command get_next(int fd) {
 // Parses a key value pair.
 // @param fd File decriptor to read from.
 // @param key Pointer where the key will be stored
-// @param value Pointer where the value will be stored
+// @param values List the value is added to
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
+int parse_pair(int fd, char *key, ValueList *values) {
   if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  int end = read_value(fd, values);
+  if (end != 1) {
+    if (end != -2) {
+      cleanup(fd);
+    }
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+// Parses a list of pairs, up to and including its closing bracket.
+// @return Number of pairs parsed, 0 on error (the line is skipped).
+static size_t parse_pair_list(int fd, char keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  value_list_clear(values);
+
+  if (aio_read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
+  if (aio_read(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
 
   size_t num_pairs = 0;
   char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
-      return 0;
+    if(parse_pair(fd, key, values) == 0) {
+      return 0;  // The line was skipped already
     }
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    strcpy(keys[num_pairs++], key);
 
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+    if (aio_read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -240,18 +386,124 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  return num_pairs;
+}
+
+// Checks that the command ends here.
+// @return 1 if it does, 0 otherwise (the line is skipped).
+static int parse_end(int fd) {
+  char ch;
+
+  if (aio_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
 
-  return num_pairs;
+  return 1;
+}
+
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size, unsigned int *ttl_ms) {
+  char buf[4];
+
+  size_t num_pairs = parse_pair_list(fd, keys, values, max_pairs, max_string_size);
+  if (num_pairs == 0) {
+    return 0;
+  }
+
+  *ttl_ms = 0;
+  if (aio_read(fd, buf, 1) != 1 || buf[0] == '\n' || buf[0] == '\0') {
+    return num_pairs;
+  }
+
+  if (buf[0] != ' ' || aio_read(fd, buf, 4) != 4 || strncmp(buf, "TTL ", 4) != 0) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_uint(fd, ttl_ms, buf) != 0 || (buf[0] != '\n' && buf[0] != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return *ttl_ms == 0 ? 0 : num_pairs;
+}
+
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], ValueList *expected, ValueList *values, size_t max_keys, size_t max_string_size) {
+  char ch;
+
+  value_list_clear(expected);
+  value_list_clear(values);
+
+  if (aio_read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (aio_read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_keys = 0;
+  char key[max_string_size];
+  while (num_keys < max_keys) {
+    int end = read_string(fd, key, MAX_STRING_SIZE) == 0 ? read_value(fd, expected) : -1;
+    if (end == 0) {
+      end = read_value(fd, values);
+    } else if (end != -2) {
+      end = -1;
+    }
+    if (end != 1) {
+      if (end != -2) {
+        cleanup(fd);
+      }
+      return 0;
+    }
+    strcpy(keys[num_keys++], key);
+
+    if (aio_read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_keys == max_keys || !parse_end(fd)) {
+    return 0;
+  }
+
+  return num_keys;
+}
+
+size_t parse_txn(int fd, char read_keys[][MAX_STRING_SIZE], ValueList *expected, size_t *num_reads,
+                 char write_keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  *num_reads = parse_pair_list(fd, read_keys, expected, max_pairs, max_string_size);
+  if (*num_reads == 0) {
+    return 0;
+  }
+
+  if (aio_read(fd, &ch, 1) != 1 || ch != ' ') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_writes = parse_pair_list(fd, write_keys, values, max_pairs, max_string_size);
+  if (num_writes == 0 || !parse_end(fd)) {
+    return 0;
+  }
+
+  return num_writes;
 }
 
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (aio_read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
@@ -277,7 +529,7 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (aio_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
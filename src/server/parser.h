@@ -3,12 +3,23 @@
 
 #include <stddef.h>
 #include "constants.h"
+#include "values.h"
 
 enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
+  CMD_RANGE,
+  CMD_PREFIX,
+  CMD_CAS,
+  CMD_TXN,
   CMD_SHOW,
+  CMD_SHOW_SORTED,
+  CMD_STATS,
+  CMD_STATS_JSON,
+  CMD_TRACE_ON,
+  CMD_TRACE_OFF,
+  CMD_HOTKEYS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -23,15 +34,42 @@ enum Command {
 // @return enum Command Command code.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses a WRITE command: WRITE [(key,value)(key2,value2),...] [TTL <ms>]
 /// @param fd File descriptor to read from.
 /// @param keys Array to store the keys
-/// @param values Array to store the values
+/// @param values List to store the values in, of any length up to the value
+///               size limit (see set_max_value_size)
 /// @param max_pairs Maximum number of pairs it will write.
-/// @param max_string_size Maximum string size allowed.
+/// @param max_string_size Maximum key size allowed.
+/// @param ttl_ms Where to store the time to live of the pairs, 0 if none.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size, unsigned int *ttl_ms);
+
+/// Parses a CAS command: CAS [(key,expected,value)(key2,expected2,value2),...]
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys
+/// @param expected List to store the expected values in
+/// @param values List to store the new values in
+/// @param max_keys Maximum number of triples it will write.
+/// @param max_string_size Maximum key size allowed.
+/// @return 0 if the command was not parsed successfully, otherwise the number
+///         of triples parsed.
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], ValueList *expected, ValueList *values, size_t max_keys, size_t max_string_size);
+
+/// Parses a TXN command: TXN [(key,expected),...] [(key,value),...]
+/// @param fd File descriptor to read from.
+/// @param read_keys Array to store the keys of the read set
+/// @param expected List to store the expected values of the read set in
+/// @param num_reads Where to store the number of pairs of the read set.
+/// @param write_keys Array to store the keys of the write set
+/// @param values List to store the values of the write set in
+/// @param max_pairs Maximum number of pairs of each set.
+/// @param max_string_size Maximum key size allowed.
+/// @return 0 if the command was not parsed successfully, otherwise the number
+///         of pairs of the write set.
+size_t parse_txn(int fd, char read_keys[][MAX_STRING_SIZE], ValueList *expected, size_t *num_reads,
+                 char write_keys[][MAX_STRING_SIZE], ValueList *values, size_t max_pairs, size_t max_string_size);
 
 // Parses a READ or a DELETE command.
 // @param fd File descriptor to read from.
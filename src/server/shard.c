@@ -0,0 +1,227 @@
+#include "shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numa.h"
+#include "trace.h"
+
+#define RINGS_SIZE (MAX_SHARD_PORTS * sizeof(SpscQueue))
+
+typedef struct Shard {
+  pthread_t thread;
+  sem_t doorbell;       // Posted once per task sent to the shard
+  SpscQueue *rings;     // One per port, on the node of the owner
+  size_t next_port;     // Where the owner looks for the next task
+  size_t slot;          // NUMA slot of the owner
+  int failed;           // 1 if the owner could not get ready
+} Shard;
+
+static Shard shards[MAX_SHARDS];
+static size_t num_owned = 0;  // Shards with an owner thread
+static ShardPort ports[MAX_SHARD_PORTS];
+static size_t num_ports = 0;  // Ports ever taken, the owners only look at these
+static int stopping = 0;
+static ShardStartFn start_fn = NULL;
+static sem_t ready;           // Posted by every owner once it is ready or failed
+static pthread_mutex_t ports_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void spsc_init(SpscQueue *queue) {
+  queue->head = 0;
+  queue->tail = 0;
+}
+
+int spsc_push(SpscQueue *queue, void *item) {
+  size_t tail = queue->tail;
+  if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == SHARD_QUEUE_SIZE) {
+    return 1;
+  }
+  queue->slots[tail % SHARD_QUEUE_SIZE] = item;
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void *spsc_pop(SpscQueue *queue) {
+  size_t head = queue->head;
+  if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  void *item = queue->slots[head % SHARD_QUEUE_SIZE];
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+// Takes the next task sent to a shard, looking at the ports in turn so no
+// thread waits behind a busier one.
+// @return The task, NULL if there is none.
+static ShardTask *next_task(size_t index) {
+  Shard *shard = &shards[index];
+  size_t count = __atomic_load_n(&num_ports, __ATOMIC_ACQUIRE);
+  for (size_t i = 0; i < count; i++) {
+    size_t port = (shard->next_port + i) % count;
+    ShardTask *task = spsc_pop(&shard->rings[port]);
+    if (task != NULL) {
+      shard->next_port = port + 1;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void *owner_loop(void *arg) {
+  size_t index = (size_t)(uintptr_t)arg;
+
+  // Signals are handled by the main thread
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  // Pinned first, so the rings and whatever on_start allocates are first
+  // touched on the node of the owner
+  Shard *shard = &shards[index];
+  if (numa_pin(shard->slot) != 0 || (shard->rings = numa_alloc_local(RINGS_SIZE)) == NULL ||
+      (start_fn != NULL && start_fn(index) != 0)) {
+    shard->failed = 1;
+    sem_post(&ready);
+    return NULL;
+  }
+  for (size_t i = 0; i < MAX_SHARD_PORTS; i++) {
+    spsc_init(&shard->rings[i]);
+  }
+  trace_thread_name("shard");
+  sem_post(&ready);
+
+  while (1) {
+    sem_wait(&shards[index].doorbell);
+    ShardTask *task = next_task(index);
+    if (task == NULL) {
+      if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      continue;
+    }
+    task->run(task, index);
+    sem_post(&task->port->done);
+  }
+  return NULL;
+}
+
+int shards_start(size_t num_shards, ShardStartFn on_start) {
+  stopping = 0;
+  start_fn = on_start;
+  if (sem_init(&ready, 0, 0) != 0) {
+    fprintf(stderr, "Failed to initialize the shards\n");
+    return 1;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < num_shards && !failed; i++) {
+    Shard *shard = &shards[i];
+    shard->rings = NULL;
+    shard->next_port = 0;
+    shard->slot = numa_next_slot();
+    shard->failed = 0;
+    if (sem_init(&shard->doorbell, 0, 0) != 0) {
+      fprintf(stderr, "Failed to initialize shard %zu\n", i);
+      failed = 1;
+    } else if (pthread_create(&shard->thread, NULL, owner_loop, (void *)(uintptr_t)i) != 0) {
+      fprintf(stderr, "Failed to create the owner thread of shard %zu\n", i);
+      sem_destroy(&shard->doorbell);
+      failed = 1;
+    } else {
+      num_owned = i + 1;
+    }
+  }
+
+  for (size_t i = 0; i < num_owned; i++) {
+    while (sem_wait(&ready) != 0) {
+      // Interrupted by a signal
+    }
+  }
+  for (size_t i = 0; i < num_owned; i++) {
+    if (shards[i].failed) {
+      fprintf(stderr, "Failed to start the owner of shard %zu\n", i);
+      failed = 1;
+    }
+  }
+  if (failed) {
+    shards_stop();
+    return 1;
+  }
+  return 0;
+}
+
+void shards_stop(void) {
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < num_owned; i++) {
+    sem_post(&shards[i].doorbell);
+  }
+  for (size_t i = 0; i < num_owned; i++) {
+    pthread_join(shards[i].thread, NULL);
+    sem_destroy(&shards[i].doorbell);
+    numa_free(shards[i].rings, RINGS_SIZE);
+    shards[i].rings = NULL;
+  }
+  sem_destroy(&ready);
+
+  for (size_t i = 0; i < num_ports; i++) {
+    sem_destroy(&ports[i].done);
+  }
+  num_ports = 0;
+  num_owned = 0;
+}
+
+ShardPort *shard_port_acquire(void) {
+  if (num_owned == 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ports_lock);
+  ShardPort *port = NULL;
+  for (size_t i = 0; i < num_ports && port == NULL; i++) {
+    if (!ports[i].in_use) {
+      port = &ports[i];
+    }
+  }
+  if (port == NULL && num_ports < MAX_SHARD_PORTS) {
+    // A new port, published to the owners once it is ready
+    ShardPort *fresh = &ports[num_ports];
+    if (sem_init(&fresh->done, 0, 0) == 0) {
+      fresh->index = num_ports;
+      __atomic_store_n(&num_ports, num_ports + 1, __ATOMIC_RELEASE);
+      port = fresh;
+    }
+  }
+  if (port != NULL) {
+    port->in_use = 1;
+  }
+  pthread_mutex_unlock(&ports_lock);
+  return port;
+}
+
+void shard_port_release(ShardPort *port) {
+  pthread_mutex_lock(&ports_lock);
+  port->in_use = 0;
+  pthread_mutex_unlock(&ports_lock);
+}
+
+void shard_submit(ShardPort *port, size_t shard, ShardTask *task) {
+  task->port = port;
+  while (spsc_push(&shards[shard].rings[port->index], task) != 0) {
+    sched_yield();
+  }
+  sem_post(&shards[shard].doorbell);
+}
+
+void shard_wait(ShardPort *port, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    while (sem_wait(&port->done) != 0) {
+      // Interrupted by a signal
+    }
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include <semaphore.h>
+#include <stddef.h>
+
+// The keyspace can be split in shards (see set_num_shards), each one a table
+// of its own whose commands are run by one owner thread. Threads hand parts
+// of their commands to the owners through single-producer single-consumer
+// rings, one per (port, shard) pair, and wait for them to be done. The rings
+// of a shard are allocated by its owner, on its NUMA node (see numa.h).
+#define MAX_SHARDS 64
+#define MAX_SHARD_PORTS 64    // Threads that can send tasks at the same time
+#define SHARD_QUEUE_SIZE 16   // Tasks a port can have pending for one shard
+#define SHARD_CACHE_LINE 64
+
+// Bounded ring of pointers with one producer and one consumer. The indices
+// only grow; each is written by one side and lives in a cache line of its
+// own, so the two sides do not share lines they write.
+typedef struct SpscQueue {
+  _Alignas(SHARD_CACHE_LINE) size_t head;  // Next slot to pop, written by the consumer
+  _Alignas(SHARD_CACHE_LINE) size_t tail;  // Next slot to push, written by the producer
+  _Alignas(SHARD_CACHE_LINE) void *slots[SHARD_QUEUE_SIZE];
+} SpscQueue;
+
+struct ShardPort;
+
+// Work for the owner of a shard, usually embedded in a larger struct.
+typedef struct ShardTask {
+  /// Runs the task on the owner thread.
+  /// @param task The task.
+  /// @param shard The shard.
+  void (*run)(struct ShardTask *task, size_t shard);
+  struct ShardPort *port;  // Told when the task is done
+} ShardTask;
+
+// Where a thread sends tasks from.
+typedef struct ShardPort {
+  size_t index;  // Of its ring in every shard
+  sem_t done;    // Posted once per task done
+  int in_use;
+} ShardPort;
+
+/// Prepares a shard on its owner thread, before it takes any task.
+/// @param shard The shard.
+/// @return 0 if successful, 1 otherwise.
+typedef int (*ShardStartFn)(size_t shard);
+
+/// Initializes an empty queue.
+/// @param queue The queue.
+void spsc_init(SpscQueue *queue);
+
+/// Adds an item. Only called by the producer.
+/// @param queue The queue.
+/// @param item The item, not NULL.
+/// @return 0 if successful, 1 if the queue is full.
+int spsc_push(SpscQueue *queue, void *item);
+
+/// Takes the oldest item. Only called by the consumer.
+/// @param queue The queue.
+/// @return The item, NULL if the queue is empty.
+void *spsc_pop(SpscQueue *queue);
+
+/// Starts the owner threads, each pinned to the CPU of the next NUMA slot,
+/// and waits for them to be ready.
+/// @param num_shards Number of shards, up to MAX_SHARDS.
+/// @param on_start Called by every owner once it is pinned, NULL for none.
+/// @return 0 if successful, 1 otherwise.
+int shards_start(size_t num_shards, ShardStartFn on_start);
+
+/// Stops the owner threads, once the tasks sent are done.
+void shards_stop(void);
+
+/// Takes a free port, for the calling thread alone until it is released.
+/// @return The port, NULL if the shards are not started or every port is
+///         taken (the caller then runs its tasks itself).
+ShardPort *shard_port_acquire(void);
+
+/// Gives a port back. Every task sent through it must be done.
+/// @param port The port.
+void shard_port_release(ShardPort *port);
+
+/// Sends a task to the owner of a shard.
+/// @param port The port of the calling thread.
+/// @param shard The shard.
+/// @param task The task, which must stay valid until it is done.
+void shard_submit(ShardPort *port, size_t shard, ShardTask *task);
+
+/// Waits for tasks sent through a port to be done.
+/// @param port The port.
+/// @param count Number of tasks.
+void shard_wait(ShardPort *port, size_t count);
+
+#endif  // KVS_SHARD_H
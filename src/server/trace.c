@@ -0,0 +1,237 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/common/io.h"
+
+#define LINE_SIZE 256
+
+typedef struct TraceEvent {
+  uint64_t start_ns;
+  uint64_t end_ns;
+  const char *name;
+  int64_t value;
+  char detail[TRACE_DETAIL_SIZE];
+  char phase;  // 'X' for spans, 'i' for instants
+} TraceEvent;
+
+// The events of one thread. Rings are never freed, so the events of threads
+// that are gone are still written.
+typedef struct Ring {
+  TraceEvent events[TRACE_RING_EVENTS];
+  uint64_t head;         // Events recorded, the latest ones are kept
+  unsigned generation;   // Recording the events belong to
+  const char *thread_name;
+  size_t tid;
+  struct Ring *next;
+} Ring;
+
+static const char *trace_path = NULL;
+static int recording = 0;
+static unsigned generation = 0;
+static Ring *rings = NULL;  // Every ring, pushed without a lock
+
+#ifndef KVS_NO_TRACE
+static size_t num_rings = 0;
+static _Thread_local Ring *local_ring = NULL;
+static _Thread_local const char *local_name = NULL;
+
+static uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+uint64_t trace_now(void) {
+  if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  return clock_ns();
+}
+
+void trace_thread_name(const char *name) {
+  local_name = name;
+  if (local_ring != NULL) {
+    local_ring->thread_name = name;
+  }
+}
+
+static Ring *get_local_ring(void) {
+  if (local_ring == NULL) {
+    Ring *ring = calloc(1, sizeof(Ring));
+    if (ring == NULL) {
+      return NULL;
+    }
+    ring->thread_name = local_name;
+    ring->tid = __atomic_add_fetch(&num_rings, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+      // Another thread pushed its ring first, ring->next was refreshed
+    }
+    local_ring = ring;
+  }
+  return local_ring;
+}
+
+static void record(char phase, const char *name, uint64_t start_ns, uint64_t end_ns,
+                   const char *detail, int64_t value) {
+  Ring *ring = get_local_ring();
+  if (ring == NULL) {
+    return;
+  }
+  // The owner drops the events of an earlier recording itself, so no other
+  // thread writes to its ring
+  unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  if (ring->generation != current) {
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->generation, current, __ATOMIC_RELEASE);
+  }
+  uint64_t head = ring->head;
+  TraceEvent *event = &ring->events[head % TRACE_RING_EVENTS];
+  event->start_ns = start_ns;
+  event->end_ns = end_ns;
+  event->name = name;
+  event->value = value;
+  event->phase = phase;
+  if (detail == NULL) {
+    event->detail[0] = '\0';
+  } else {
+    strncpy(event->detail, detail, TRACE_DETAIL_SIZE - 1);
+    event->detail[TRACE_DETAIL_SIZE - 1] = '\0';
+  }
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns, const char *detail,
+                int64_t value) {
+  if (start_ns == 0 || !__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+    return;
+  }
+  record('X', name, start_ns, end_ns > start_ns ? end_ns : start_ns, detail, value);
+}
+
+void trace_instant(const char *name, const char *detail, int64_t value) {
+  if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+    return;
+  }
+  uint64_t now = clock_ns();
+  record('i', name, now, now, detail, value);
+}
+#endif
+
+// Copies a string into a JSON string, escaping what must be.
+static void json_escape(char *dst, size_t size, const char *src) {
+  size_t len = 0;
+  for (; *src != '\0' && len + 7 < size; src++) {
+    unsigned char ch = (unsigned char)*src;
+    if (ch == '"' || ch == '\\') {
+      dst[len++] = '\\';
+      dst[len++] = (char)ch;
+    } else if (ch < 0x20) {
+      len += (size_t)snprintf(dst + len, size - len, "\\u%04x", ch);
+    } else {
+      dst[len++] = (char)ch;
+    }
+  }
+  dst[len] = '\0';
+}
+
+// Writes the events of the current recording, oldest first in every ring.
+static int write_events(int fd) {
+  char line[LINE_SIZE];
+  char detail[TRACE_DETAIL_SIZE * 6 + 1];
+  long pid = (long)getpid();
+  unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  int first = 1;
+  int len = snprintf(line, sizeof(line), "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  int result = write_all(fd, line, (size_t)len) == -1;
+
+  for (Ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL && !result;
+       ring = ring->next) {
+    if (__atomic_load_n(&ring->generation, __ATOMIC_ACQUIRE) != current) {
+      continue;
+    }
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->thread_name != NULL) {
+      len = snprintf(line, sizeof(line),
+                     "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,\"tid\":%zu,"
+                     "\"args\":{\"name\":\"%s %zu\"}}",
+                     first ? "" : ",\n", pid, ring->tid, ring->thread_name, ring->tid);
+      result |= write_all(fd, line, (size_t)len) == -1;
+      first = 0;
+    }
+    for (uint64_t i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0; i < head && !result;
+         i++) {
+      const TraceEvent *event = &ring->events[i % TRACE_RING_EVENTS];
+      json_escape(detail, sizeof(detail), event->detail);
+      if (event->phase == 'X') {
+        len = snprintf(line, sizeof(line),
+                       "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%zu,\"ts\":%.3f,"
+                       "\"dur\":%.3f,\"args\":{\"detail\":\"%s\",\"value\":%lld}}",
+                       first ? "" : ",\n", event->name, pid, ring->tid,
+                       (double)event->start_ns / 1e3,
+                       (double)(event->end_ns - event->start_ns) / 1e3, detail,
+                       (long long)event->value);
+      } else {
+        len = snprintf(line, sizeof(line),
+                       "%s{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%zu,"
+                       "\"ts\":%.3f,\"args\":{\"detail\":\"%s\",\"value\":%lld}}",
+                       first ? "" : ",\n", event->name, pid, ring->tid,
+                       (double)event->start_ns / 1e3, detail, (long long)event->value);
+      }
+      result |= write_all(fd, line, (size_t)len) == -1;
+      first = 0;
+    }
+  }
+  if (!result) {
+    result |= write_all(fd, "\n]}\n", 4) == -1;
+  }
+  return result;
+}
+
+int trace_open(const char *path) {
+  trace_path = path;
+  return trace_start();
+}
+
+int trace_start(void) {
+#ifdef KVS_NO_TRACE
+  fprintf(stderr, "Tracing was left out of this build (KVS_NO_TRACE)\n");
+  return 1;
+#else
+  if (trace_path == NULL) {
+    fprintf(stderr, "Tracing needs a trace file (-T)\n");
+    return 1;
+  }
+  __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+  return 0;
+#endif
+}
+
+int trace_stop(void) {
+  if (trace_path == NULL || !__atomic_exchange_n(&recording, 0, __ATOMIC_ACQ_REL)) {
+    fprintf(stderr, "Tracing is not on\n");
+    return 1;
+  }
+  // Lets the events being recorded as it stopped be finished
+  nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 1000000}, NULL);
+
+  int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open the trace file %s\n", trace_path);
+    return 1;
+  }
+  int result = write_events(fd);
+  result |= close(fd) == -1;
+  if (result) {
+    fprintf(stderr, "Failed to write the trace file %s\n", trace_path);
+  }
+  return result;
+}
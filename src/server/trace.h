@@ -0,0 +1,62 @@
+#ifndef KVS_TRACE_H
+#define KVS_TRACE_H
+
+#include <stdint.h>
+
+// Optional trace of where requests spend their time: jobs parsing and running
+// commands, threads waiting for locks, pairs being written and notifications
+// and responses going out to clients. Every thread records its events in a
+// ring of its own, so recording takes no lock; a thread that records more
+// than TRACE_RING_EVENTS keeps the latest ones. trace_stop writes the rings in
+// the Chrome trace-event format, to be opened in chrome://tracing or
+// ui.perfetto.dev.
+//
+// Recording is off until trace_start, and every trace point then costs one
+// branch. Building with -DKVS_NO_TRACE leaves the trace points out.
+#define TRACE_RING_EVENTS 16384
+#define TRACE_DETAIL_SIZE 24  // Bytes of the detail kept by an event
+
+/// Names the file trace_stop writes to, and starts recording.
+/// @param path Path of the file, replaced by every trace_stop.
+/// @return 0 if successful, 1 otherwise.
+int trace_open(const char *path);
+
+/// Starts recording, dropping the events of earlier recordings.
+/// @return 0 if successful, 1 if there is no trace file (see trace_open).
+int trace_start(void);
+
+/// Stops recording and writes what was recorded to the trace file.
+/// @return 0 if successful, 1 otherwise.
+int trace_stop(void);
+
+#ifdef KVS_NO_TRACE
+// The arguments are still evaluated, so they do not go unused
+#define trace_now() ((uint64_t)0)
+#define trace_span(name, start_ns, end_ns, detail, value) \
+  ((void)(name), (void)(start_ns), (void)(end_ns), (void)(detail), (void)(value))
+#define trace_instant(name, detail, value) ((void)(name), (void)(detail), (void)(value))
+#define trace_thread_name(name) ((void)(name))
+#else
+/// Gets the time of the start of a span.
+/// @return Nanoseconds of the clock of metrics_now, 0 while not recording.
+uint64_t trace_now(void);
+
+/// Records something that took some time.
+/// @param name Name of the event, a string that outlives the trace.
+/// @param start_ns trace_now when it started; nothing is recorded if 0.
+/// @param end_ns trace_now when it ended.
+/// @param detail What it was about (a key, a lock), or NULL; cut to
+///               TRACE_DETAIL_SIZE - 1 bytes.
+/// @param value A number that goes with it (a size, a result).
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns, const char *detail,
+                int64_t value);
+
+/// Records something that happened now, if recording.
+void trace_instant(const char *name, const char *detail, int64_t value);
+
+/// Names the calling thread in the traces.
+/// @param name Name, a string that outlives the thread.
+void trace_thread_name(const char *name);
+#endif
+
+#endif  // KVS_TRACE_H
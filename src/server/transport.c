@@ -0,0 +1,585 @@
+#define _GNU_SOURCE  // struct ucred
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/common/constants.h"
+#include "src/common/io.h"
+#include "src/common/protocol.h"
+#include "src/common/shm.h"
+
+#define HELLO_TIMEOUT_S 1  // A client that connects must register by then
+#define TCP_MAX_PENDING 64  // TCP connections registering at once, others are closed
+#define TCP_EVENTS 16
+#define TCP_HOST_SIZE 256
+
+// A TCP connection that has not registered yet, or whose client has not
+// opened its notification connection.
+typedef struct TcpPending {
+  int fd;          // -1 if the slot is free
+  uint32_t uses;   // Times the slot was taken, so late events are told apart
+  int registered;  // 1 once the hello of a session came and was answered
+  size_t got;      // Bytes of the hello read
+  uint64_t deadline_ms;
+  char hello[UNIX_HELLO_SIZE];
+  char token[TCP_TOKEN_SIZE];
+} TcpPending;
+
+static int transport = TRANSPORT_FIFO;
+static const char *register_path = NULL;
+static int listen_fd = -1;  // Unix and TCP transports
+static int epoll_fd = -1;   // TCP transport
+static TcpPending pending[TCP_MAX_PENDING];
+
+int transport_set(const char *name) {
+  if (strcmp(name, "fifo") == 0) {
+    transport = TRANSPORT_FIFO;
+  } else if (strcmp(name, "unix") == 0) {
+    transport = TRANSPORT_UNIX;
+  } else if (strcmp(name, "tcp") == 0) {
+    transport = TRANSPORT_TCP;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+int transport_get(void) {
+  return transport;
+}
+
+static int fifo_listen(const char *path) {
+  struct stat st;
+  // A socket left by a unix transport server is replaced
+  if (lstat(path, &st) == 0 && !S_ISFIFO(st.st_mode)) {
+    unlink(path);
+  }
+  if (mkfifo(path, 0666) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create fifo\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int unix_listen(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Register socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
+    fprintf(stderr, "Failed to create the register socket\n");
+    return 1;
+  }
+  int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  if (!bound && errno == EADDRINUSE) {
+    // Taken over if nothing listens there: a FIFO, or the socket of a
+    // server that is gone
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    int alive = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (probe != -1) {
+      close(probe);
+    }
+    if (alive) {
+      fprintf(stderr, "Another server is listening on %s\n", path);
+      close(listen_fd);
+      return 1;
+    }
+    unlink(path);
+    bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+  // Anyone may connect, as to the register FIFO
+  if (!bound || chmod(path, 0666) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(listen_fd);
+    return 1;
+  }
+  return 0;
+}
+
+// Splits "[host:]port", with the host in brackets if it has colons.
+// @return 0 if successful, 1 otherwise.
+static int split_address(const char *address, char *host, const char **port) {
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL) {
+    strcpy(host, "127.0.0.1");  // Reachable from this machine alone
+    *port = address;
+    return *address == '\0';
+  }
+  const char *start = address;
+  size_t len = (size_t)(colon - address);
+  if (len >= 2 && address[0] == '[' && colon[-1] == ']') {
+    start++;
+    len -= 2;
+  }
+  if (len >= TCP_HOST_SIZE) {
+    return 1;
+  }
+  memcpy(host, start, len);
+  host[len] = '\0';
+  *port = colon + 1;
+  return **port == '\0';
+}
+
+static int tcp_listen(const char *address) {
+  char host[TCP_HOST_SIZE];
+  const char *port;
+  if (split_address(address, host, &port) != 0) {
+    fprintf(stderr, "Invalid TCP address: %s\n", address);
+    return 1;
+  }
+  struct addrinfo hints = {.ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addrs;
+  int error = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &addrs);
+  if (error != 0) {
+    fprintf(stderr, "Invalid TCP address %s: %s\n", address, gai_strerror(error));
+    return 1;
+  }
+  for (struct addrinfo *addr = addrs; addr != NULL && listen_fd == -1; addr = addr->ai_next) {
+    listen_fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       addr->ai_protocol);
+    int on = 1;
+    // A server started again takes its port back from the connections of
+    // the last one
+    if (listen_fd != -1 &&
+        (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+         bind(listen_fd, addr->ai_addr, addr->ai_addrlen) == -1 ||
+         listen(listen_fd, SOMAXCONN) == -1)) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (listen_fd == -1) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+    return 1;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.u64 = 0};
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+    fprintf(stderr, "Failed to wait for TCP clients\n");
+    close(listen_fd);
+    return 1;
+  }
+  for (size_t i = 0; i < TCP_MAX_PENDING; i++) {
+    pending[i].fd = -1;
+  }
+  return 0;
+}
+
+int transport_listen(const char *path) {
+  register_path = path;
+  if (transport == TRANSPORT_TCP) {
+    return tcp_listen(path);
+  }
+  return transport == TRANSPORT_UNIX ? unix_listen(path) : fifo_listen(path);
+}
+
+static int fifo_accept(Client *client) {
+  char buffer[BUFFER_SIZE];
+  int fd = open(register_path, O_RDONLY);
+
+  // A signal for the host thread, which waits for the next client afterwards
+  if (fd == -1 && errno == EINTR){
+    return 1;
+  }
+
+  if (fd == -1){
+    fprintf(stderr, "Failed to open register fifo\n");
+    return -1;
+  }
+
+  // A client that started registering is not left halfway
+  if (read_all(fd, buffer, BUFFER_SIZE, NULL) == -1){
+    fprintf(stderr, "Failed to read from register fifo\n");
+    return -1;
+  }
+
+  // Handle Op-code
+  char *token = strtok(buffer, " ");
+
+  if (strcmp(token, "0") != 0){
+    fprintf(stderr, "Invalid command\n");
+    return -1;
+  }
+  // Opens requests pipe for reading
+  token = strtok(NULL, " ");
+
+  int fd_req_pipe = open(token, O_RDONLY);
+  if (fd_req_pipe == -1){
+    fprintf(stderr, "Failed to open request fifo\n");
+    return -1;
+  }
+  client->request_fd = fd_req_pipe;
+  // Opens response pipe for writing
+  token = strtok(NULL, " ");
+
+  int fd_resp_pipe = open(token, O_WRONLY);
+  if (fd_resp_pipe == -1){
+    fprintf(stderr, "Failed to open response fifo\n");
+    close(fd_req_pipe);
+    return -1;
+  }
+  client->response_fd = fd_resp_pipe;
+
+  // Opens notification pipe for writing
+  token = strtok(NULL, " ");
+
+  int fd_notif_pipe = open(token, O_WRONLY);
+  if (fd_notif_pipe == -1){
+    fprintf(stderr, "Failed to open notifications fifo\n");
+    close(fd_req_pipe);
+    close(fd_resp_pipe);
+    return -1;
+  }
+  client->notification_fd = fd_notif_pipe;
+
+  // Assigns an id to the client
+  token = strtok(NULL, " ");
+
+  strcpy(client->id, token);
+  close(fd);
+  return 0;
+}
+
+// Reads the registration of a client (see UNIX_HELLO_SIZE).
+// @return The descriptor it passed, the write end of its notification pipe or
+//         the memfd of its rings, -1 if it failed.
+static int read_hello(int conn, char *hello) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {.iov_base = hello, .iov_len = UNIX_HELLO_SIZE};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t got;
+  do {
+    got = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (got == -1 && errno == EINTR);
+
+  int passed_fd = -1;
+  struct cmsghdr *cmsg = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (got != UNIX_HELLO_SIZE ||
+      (hello[0] != '0' + OP_CODE_CONNECT && hello[0] != '0' + OP_CODE_CONNECT_SHM) ||
+      (msg.msg_flags & MSG_CTRUNC) != 0 || passed_fd == -1) {
+    if (passed_fd != -1) {
+      close(passed_fd);
+    }
+    return -1;
+  }
+  return passed_fd;
+}
+
+// Names the ends of the rings of a client by descriptors of its connection.
+// @return 0 if successful, 1 otherwise (with the connection left open).
+static int attach_rings(int conn, int memfd, Client *client) {
+  int fds[SHM_RINGS] = {conn, -1, -1};
+  int result = (fds[SHM_RESPONSES] = fcntl(conn, F_DUPFD_CLOEXEC, 0)) == -1 ||
+               (fds[SHM_NOTIFICATIONS] = fcntl(conn, F_DUPFD_CLOEXEC, 0)) == -1 ||
+               shm_attach(memfd, SHM_SERVER, fds) != 0;
+  close(memfd);
+  if (result != 0) {
+    for (int i = SHM_RESPONSES; i < SHM_RINGS; i++) {
+      if (fds[i] != -1) {
+        close(fds[i]);
+      }
+    }
+    return 1;
+  }
+  client->request_fd = fds[SHM_REQUESTS];
+  client->response_fd = fds[SHM_RESPONSES];
+  client->notification_fd = fds[SHM_NOTIFICATIONS];
+  return 0;
+}
+
+static int unix_accept(Client *client) {
+  int conn;
+  do {
+    conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  } while (conn == -1 && errno == ECONNABORTED);
+  if (conn == -1 && errno == EINTR) {
+    return 1;  // A signal for the host thread
+  }
+  if (conn == -1) {
+    fprintf(stderr, "Failed to accept a client: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // Bounds the wait for the registration, not the session
+  struct timeval timeout = {.tv_sec = HELLO_TIMEOUT_S, .tv_usec = 0};
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  char hello[UNIX_HELLO_SIZE];
+  int passed_fd = -1;
+  if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+      getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+      (passed_fd = read_hello(conn, hello)) == -1) {
+    fprintf(stderr, "A client failed to register\n");
+    close(conn);
+    return 1;
+  }
+  timeout.tv_sec = 0;
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (hello[0] == '0' + OP_CODE_CONNECT_SHM) {
+    if (attach_rings(conn, passed_fd, client) != 0) {
+      fprintf(stderr, "A client failed to share its rings\n");
+      close(conn);
+      return 1;
+    }
+  } else {
+    client->request_fd = conn;
+    client->response_fd = conn;
+    client->notification_fd = passed_fd;
+  }
+  client->peer_pid = cred.pid;
+  client->peer_uid = cred.uid;
+  memcpy(client->id, hello + 1, MAX_KEY_SIZE - 1);
+  client->id[MAX_KEY_SIZE - 1] = '\0';
+  return 0;
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Epoll data of a pending connection: its slot, 1-based, and the use of the
+// slot it came from; 0 is the listening socket.
+static uint64_t pending_key(const TcpPending *p) {
+  return (uint64_t)p->uses << 32 | (uint64_t)(p - pending + 1);
+}
+
+// Stops waiting for a pending connection.
+// @param keep Whether the connection goes on as part of a session.
+static void drop_pending(TcpPending *p, int keep) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL);
+  if (!keep) {
+    close(p->fd);
+  }
+  p->fd = -1;
+}
+
+static void accept_pending(void) {
+  int conn;
+  while ((conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    TcpPending *p = NULL;
+    for (size_t i = 0; i < TCP_MAX_PENDING && p == NULL; i++) {
+      if (pending[i].fd == -1) {
+        p = &pending[i];
+      }
+    }
+    int on = 1;
+    if (p == NULL || setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+      close(conn);  // Tried again by the client
+      continue;
+    }
+    p->fd = conn;
+    p->uses++;
+    p->registered = 0;
+    p->got = 0;
+    p->deadline_ms = now_ms() + HELLO_TIMEOUT_S * 1000;
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = pending_key(p)};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn, &event) == -1) {
+      drop_pending(p, 0);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+    fprintf(stderr, "Failed to accept a client: %s\n", strerror(errno));
+  }
+}
+
+// Answers the hello of a session with its token.
+// @return 0 if successful, 1 otherwise.
+static int register_session(TcpPending *p) {
+  static const char digits[] = "0123456789abcdef";
+  unsigned char random[TCP_TOKEN_SIZE];
+  if (getrandom(random, sizeof(random), 0) != (ssize_t)sizeof(random)) {
+    return 1;
+  }
+  for (size_t i = 0; i < TCP_TOKEN_SIZE; i++) {
+    p->token[i] = digits[random[i] % 16];
+  }
+  char answer[2 + TCP_TOKEN_SIZE];
+  answer[0] = '0' + OP_CODE_CONNECT;
+  answer[1] = '0';
+  memcpy(answer + 2, p->token, TCP_TOKEN_SIZE);
+  // Fits in the empty send buffer of the connection
+  if (send(p->fd, answer, sizeof(answer), MSG_NOSIGNAL) != (ssize_t)sizeof(answer)) {
+    return 1;
+  }
+  // Only a hangup is waited for: requests may come before the notification
+  // connection, and are the session's to read
+  struct epoll_event event = {.events = EPOLLRDHUP, .data.u64 = pending_key(p)};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p->fd, &event) == -1) {
+    return 1;
+  }
+  p->registered = 1;
+  return 0;
+}
+
+static int set_blocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1;
+}
+
+// Pairs a notification connection with the session it names.
+// @return 0 if a client is complete, 1 otherwise (the connection is dropped).
+static int open_session(TcpPending *notif, Client *client) {
+  TcpPending *session = NULL;
+  for (size_t i = 0; i < TCP_MAX_PENDING && session == NULL; i++) {
+    if (pending[i].fd != -1 && pending[i].registered &&
+        memcmp(pending[i].token, notif->hello + 1, TCP_TOKEN_SIZE) == 0) {
+      session = &pending[i];
+    }
+  }
+  if (session == NULL) {
+    drop_pending(notif, 0);
+    return 1;
+  }
+  int on = 1;
+  // Sessions block like the FIFOs do; keepalives end those of hosts that
+  // vanished
+  if (set_blocking(session->fd) != 0 || set_blocking(notif->fd) != 0 ||
+      setsockopt(session->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1) {
+    drop_pending(notif, 0);
+    drop_pending(session, 0);
+    return 1;
+  }
+  client->request_fd = session->fd;
+  client->response_fd = session->fd;
+  client->notification_fd = notif->fd;
+  client->peer_pid = 0;  // No credentials over TCP
+  client->peer_uid = (uid_t)-1;
+  memcpy(client->id, session->hello + 1, MAX_KEY_SIZE - 1);
+  client->id[MAX_KEY_SIZE - 1] = '\0';
+  drop_pending(notif, 1);
+  drop_pending(session, 1);
+  return 0;
+}
+
+// Reads what came of a hello.
+// @return 0 if a client is complete, 1 otherwise.
+static int read_pending(TcpPending *p, Client *client) {
+  if (p->registered) {
+    drop_pending(p, 0);  // Hung up before its notification connection came
+    return 1;
+  }
+  ssize_t got = recv(p->fd, p->hello + p->got, UNIX_HELLO_SIZE - p->got, 0);
+  if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 1;
+  }
+  if (got <= 0) {
+    drop_pending(p, 0);
+    return 1;
+  }
+  p->got += (size_t)got;
+  if (p->got < UNIX_HELLO_SIZE) {
+    return 1;
+  }
+  if (p->hello[0] == '0' + OP_CODE_CONNECT) {
+    if (register_session(p) != 0) {
+      drop_pending(p, 0);
+    }
+    return 1;
+  }
+  if (p->hello[0] == '0' + OP_CODE_CONNECT_NOTIF) {
+    return open_session(p, client);
+  }
+  drop_pending(p, 0);
+  return 1;
+}
+
+// Drops the connections that took too long to register.
+// @return Milliseconds until the next one would be dropped, -1 if none waits.
+static int expire_pending(void) {
+  uint64_t now = now_ms();
+  int timeout = -1;
+  for (size_t i = 0; i < TCP_MAX_PENDING; i++) {
+    if (pending[i].fd == -1) {
+      continue;
+    }
+    if (pending[i].deadline_ms <= now) {
+      fprintf(stderr, "A client failed to register\n");
+      drop_pending(&pending[i], 0);
+    } else if (timeout == -1 || pending[i].deadline_ms - now < (uint64_t)timeout) {
+      timeout = (int)(pending[i].deadline_ms - now);
+    }
+  }
+  return timeout;
+}
+
+static int tcp_accept(Client *client) {
+  struct epoll_event events[TCP_EVENTS];
+  while (1) {
+    int ready = epoll_wait(epoll_fd, events, TCP_EVENTS, expire_pending());
+    if (ready == -1 && errno == EINTR) {
+      return 1;  // A signal for the host thread
+    }
+    if (ready == -1) {
+      fprintf(stderr, "Failed to wait for TCP clients: %s\n", strerror(errno));
+      return -1;
+    }
+    // Events left when a client is complete come back on the next call
+    for (int i = 0; i < ready; i++) {
+      uint64_t key = events[i].data.u64;
+      if (key == 0) {
+        accept_pending();
+        continue;
+      }
+      TcpPending *p = &pending[(key & UINT32_MAX) - 1];
+      if (p->fd != -1 && p->uses == key >> 32 && read_pending(p, client) == 0) {
+        return 0;
+      }
+    }
+  }
+}
+
+int transport_accept(Client *client) {
+  if (transport == TRANSPORT_TCP) {
+    return tcp_accept(client);
+  }
+  return transport == TRANSPORT_UNIX ? unix_accept(client) : fifo_accept(client);
+}
+
+void transport_close(Client *client) {
+  if (shm_close(client->request_fd) == -1){
+    fprintf(stderr, "Failed to close fifo\n");
+  }
+
+  // Requests and responses share a socket, unless they go through rings
+  if (client->response_fd != client->request_fd && shm_close(client->response_fd) == -1){
+    fprintf(stderr, "Failed to close fifo\n");
+  }
+
+  if (shm_close(client->notification_fd) == -1){
+    fprintf(stderr, "Failed to close fifo\n");
+  }
+}
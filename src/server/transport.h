@@ -0,0 +1,54 @@
+#ifndef KVS_TRANSPORT_H
+#define KVS_TRANSPORT_H
+
+#include "kvs.h"
+
+// How clients reach the server. Whatever the transport, a session reads
+// requests from request_fd and writes responses to response_fd, with the
+// byte protocol of src/common/protocol.h, and notifications go to
+// notification_fd.
+//
+// The FIFO transport reads registrations from the register FIFO, reopening
+// it for every client, and opens the three FIFOs each client made. The unix
+// transport listens on a stream socket at the same path: every client has one
+// connection for requests and responses, and passes the pipe its
+// notifications go to (see UNIX_HELLO_SIZE). Clients wait in the accept
+// queue, leave no files behind, and their credentials come from the kernel.
+// A client on the same machine may share rings instead of the pipe (see
+// src/common/shm.h); the descriptors of its session then name the rings.
+//
+// The TCP transport listens on "[host:]port" instead of a path, on the
+// loopback interface if no host is given (an empty one is every interface).
+// Every client has a connection for requests and responses and one for its
+// notifications (see TCP_TOKEN_SIZE), both with TCP_NODELAY. A single thread
+// takes them with epoll, so clients that are slow to register hold none of
+// the others back.
+#define TRANSPORT_FIFO 0
+#define TRANSPORT_UNIX 1
+#define TRANSPORT_TCP 2
+
+/// Selects the transport by name ("fifo", "unix" or "tcp").
+/// @param name Name of the transport.
+/// @return 0 if the name is valid, 1 otherwise.
+int transport_set(const char *name);
+
+/// Gets the transport in use.
+/// @return TRANSPORT_FIFO, TRANSPORT_UNIX or TRANSPORT_TCP.
+int transport_get(void);
+
+/// Starts taking clients, replacing the socket of a server that is gone.
+/// @param path Path of the register FIFO or socket, or the TCP address.
+/// @return 0 if successful, 1 otherwise.
+int transport_listen(const char *path);
+
+/// Waits for a client to register and opens its channels.
+/// @param client Client (zeroed, with room for its id) to be filled in.
+/// @return 0 if a client registered, 1 if one failed to or a signal ended
+///         the wait (and the next may be waited for), -1 if no more clients
+///         can be taken.
+int transport_accept(Client *client);
+
+/// Closes the channels of a client.
+void transport_close(Client *client);
+
+#endif  // KVS_TRANSPORT_H
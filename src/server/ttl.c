@@ -0,0 +1,208 @@
+#include "ttl.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOT_MASK (TTL_WHEEL_SLOTS - 1)
+// Ticks the whole wheel reaches
+#define WHEEL_SPAN ((uint64_t)1 << (TTL_WHEEL_BITS * TTL_WHEEL_LEVELS))
+
+static TtlEntry *wheel[TTL_WHEEL_LEVELS][TTL_WHEEL_SLOTS];
+static uint64_t current_tick = 0;  // Every tick before this one was processed
+static size_t num_entries = 0;
+static int running = 0;
+static int stopped = 0;
+static TtlExpireFn expire_fn = NULL;
+static pthread_t reaper_thread;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_cond;
+
+uint64_t ttl_now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+// Tick at which an entry is due (the first one that is not before it).
+static uint64_t entry_tick(const TtlEntry *entry) {
+  return (entry->expires_at + TTL_TICK_MS - 1) / TTL_TICK_MS;
+}
+
+// Puts an entry in the slot of its tick. Must be called with wheel_lock held.
+static void wheel_add(TtlEntry *entry) {
+  uint64_t tick = entry_tick(entry);
+  if (tick < current_tick) {
+    tick = current_tick;
+  }
+  if (tick - current_tick >= WHEEL_SPAN) {
+    // Too far for now, it is put back when it reaches the lower levels
+    tick = current_tick + WHEEL_SPAN - 1;
+  }
+
+  int level = 0;
+  while (level < TTL_WHEEL_LEVELS - 1 &&
+         tick - current_tick >= (uint64_t)1 << (TTL_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+  size_t slot = (tick >> (TTL_WHEEL_BITS * level)) & SLOT_MASK;
+  entry->next = wheel[level][slot];
+  wheel[level][slot] = entry;
+}
+
+// Moves the entries of the current slot of a level down to the lower ones.
+// @return The index of that slot.
+static size_t cascade(int level) {
+  size_t slot = (current_tick >> (TTL_WHEEL_BITS * level)) & SLOT_MASK;
+  TtlEntry *entry = wheel[level][slot];
+  wheel[level][slot] = NULL;
+  while (entry != NULL) {
+    TtlEntry *next = entry->next;
+    wheel_add(entry);
+    entry = next;
+  }
+  return slot;
+}
+
+// Processes the current tick and moves to the next one. Must be called with
+// wheel_lock held.
+// @param due List the entries of the tick are added to.
+static void wheel_advance(TtlEntry **due) {
+  // Refill the lower levels whenever one of them wraps around
+  for (int level = 1; level < TTL_WHEEL_LEVELS; level++) {
+    if (((current_tick >> (TTL_WHEEL_BITS * (level - 1))) & SLOT_MASK) != 0 || cascade(level) != 0) {
+      break;
+    }
+  }
+
+  size_t slot = current_tick & SLOT_MASK;
+  TtlEntry *entry = wheel[0][slot];
+  wheel[0][slot] = NULL;
+  while (entry != NULL) {
+    TtlEntry *next = entry->next;
+    if (entry_tick(entry) <= current_tick) {
+      entry->next = *due;
+      *due = entry;
+      num_entries--;
+    } else {
+      // Clamped to the end of the wheel
+      wheel_add(entry);
+    }
+    entry = next;
+  }
+  current_tick++;
+}
+
+static void free_entries(TtlEntry *entry) {
+  while (entry != NULL) {
+    TtlEntry *next = entry->next;
+    free(entry);
+    entry = next;
+  }
+}
+
+static void *reaper_loop(void *arg) {
+  (void)arg;
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  pthread_mutex_lock(&wheel_lock);
+  while (!stopped) {
+    if (num_entries == 0) {
+      pthread_cond_wait(&wheel_cond, &wheel_lock);
+      continue;
+    }
+
+    uint64_t next_ms = current_tick * TTL_TICK_MS;
+    struct timespec deadline = {(time_t)(next_ms / 1000), (long)(next_ms % 1000) * 1000000};
+    pthread_cond_timedwait(&wheel_cond, &wheel_lock, &deadline);
+
+    // Catch up with every tick that went by
+    uint64_t now_tick = ttl_now_ms() / TTL_TICK_MS;
+    TtlEntry *due = NULL;
+    while (current_tick <= now_tick && num_entries > 0) {
+      wheel_advance(&due);
+    }
+    if (num_entries == 0) {
+      current_tick = now_tick + 1;
+    }
+
+    if (due != NULL) {
+      pthread_mutex_unlock(&wheel_lock);
+      expire_fn(due);
+      free_entries(due);
+      pthread_mutex_lock(&wheel_lock);
+    }
+  }
+  pthread_mutex_unlock(&wheel_lock);
+  return NULL;
+}
+
+int ttl_start(TtlExpireFn expire) {
+  pthread_condattr_t attr;
+  if (pthread_condattr_init(&attr) != 0 || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+      pthread_cond_init(&wheel_cond, &attr) != 0) {
+    fprintf(stderr, "Failed to initialize the reaper\n");
+    return 1;
+  }
+  pthread_condattr_destroy(&attr);
+
+  expire_fn = expire;
+  current_tick = ttl_now_ms() / TTL_TICK_MS;
+  stopped = 0;
+  if (pthread_create(&reaper_thread, NULL, reaper_loop, NULL) != 0) {
+    fprintf(stderr, "Failed to create reaper thread\n");
+    pthread_cond_destroy(&wheel_cond);
+    return 1;
+  }
+  running = 1;
+  return 0;
+}
+
+int ttl_schedule(const char *key, uint64_t expires_at) {
+  TtlEntry *entry = malloc(sizeof(TtlEntry));
+  if (entry == NULL) {
+    return 1;
+  }
+  entry->expires_at = expires_at;
+  strncpy(entry->key, key, MAX_KEY_SIZE - 1);
+  entry->key[MAX_KEY_SIZE - 1] = '\0';
+
+  pthread_mutex_lock(&wheel_lock);
+  if (num_entries == 0) {
+    // Nothing was due while the wheel was empty, so no tick needs processing
+    current_tick = ttl_now_ms() / TTL_TICK_MS;
+  }
+  wheel_add(entry);
+  num_entries++;
+  pthread_cond_signal(&wheel_cond);
+  pthread_mutex_unlock(&wheel_lock);
+  return 0;
+}
+
+void ttl_stop() {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&wheel_lock);
+  stopped = 1;
+  pthread_cond_signal(&wheel_cond);
+  pthread_mutex_unlock(&wheel_lock);
+  pthread_join(reaper_thread, NULL);
+  pthread_cond_destroy(&wheel_cond);
+  running = 0;
+
+  for (int level = 0; level < TTL_WHEEL_LEVELS; level++) {
+    for (size_t slot = 0; slot < TTL_WHEEL_SLOTS; slot++) {
+      free_entries(wheel[level][slot]);
+      wheel[level][slot] = NULL;
+    }
+  }
+  num_entries = 0;
+}
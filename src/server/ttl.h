@@ -0,0 +1,45 @@
+#ifndef KVS_TTL_H
+#define KVS_TTL_H
+
+#include <stdint.h>
+
+#include "src/common/constants.h"
+
+// Hierarchical timing wheel of key expirations. Level 0 has one slot per
+// tick; every slot of level n covers a whole turn of level n - 1, so adding
+// and expiring an entry cost O(1) and entries far in the future are only
+// moved down a level at a time as their time comes.
+#define TTL_TICK_MS 10
+#define TTL_WHEEL_BITS 6
+#define TTL_WHEEL_SLOTS (1 << TTL_WHEEL_BITS)
+#define TTL_WHEEL_LEVELS 4  // Reaches 2^24 ticks (about 46 hours), later ones wait on the last level
+
+typedef struct TtlEntry {
+  uint64_t expires_at;  // See ttl_now_ms
+  struct TtlEntry *next;
+  char key[MAX_KEY_SIZE];
+} TtlEntry;
+
+/// Called by the reaper thread with the entries that are due.
+/// @param due List of entries, freed once the function returns.
+typedef void (*TtlExpireFn)(TtlEntry *due);
+
+/// Gets the time used for expirations.
+/// @return Milliseconds of the monotonic clock.
+uint64_t ttl_now_ms();
+
+/// Starts the reaper thread.
+/// @param expire Function the due entries are handed to.
+/// @return 0 if successful, 1 otherwise.
+int ttl_start(TtlExpireFn expire);
+
+/// Schedules the expiration of a key.
+/// @param key The key.
+/// @param expires_at When it expires (see ttl_now_ms).
+/// @return 0 if successful, 1 otherwise.
+int ttl_schedule(const char *key, uint64_t expires_at);
+
+/// Stops the reaper thread and drops the pending entries.
+void ttl_stop();
+
+#endif  // KVS_TTL_H
@@ -0,0 +1,151 @@
+#include "values.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "lz.h"
+#include "numa.h"
+
+#define NUM_CLASSES (VALUE_MAX_CLASS - VALUE_MIN_CLASS + 1)
+
+typedef struct FreeBuffer {
+  struct FreeBuffer *next;
+} FreeBuffer;
+
+static size_t max_value_size = MAX_VALUE_SIZE;
+static size_t compress_threshold = VALUE_COMPRESS_MIN;
+
+// Freed buffers are kept by the node of the thread that freed them, so a
+// pinned thread reuses memory of its own node
+static FreeBuffer *free_buffers[NUMA_MAX_NODES][NUM_CLASSES];
+static size_t num_free_buffers[NUMA_MAX_NODES][NUM_CLASSES];
+static pthread_mutex_t classes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_max_value_size(size_t size) {
+  max_value_size = size;
+}
+
+size_t get_max_value_size(void) {
+  return max_value_size;
+}
+
+void set_compress_threshold(size_t size) {
+  compress_threshold = size;
+}
+
+size_t value_compress(const char *value, size_t len, char *dst) {
+  if (compress_threshold == 0 || len < compress_threshold) {
+    return 0;
+  }
+  // A block that does not fit saves less than an eighth
+  return lz_compress(value, len, dst, len - len / 8);
+}
+
+void value_list_init(ValueList *list) {
+  list->data = NULL;
+  list->cap = 0;
+  value_list_clear(list);
+}
+
+void value_list_clear(ValueList *list) {
+  list->len = 0;
+  list->count = 0;
+  list->start = 0;
+}
+
+// Makes room for a character and the terminator of its value.
+static int grow(ValueList *list) {
+  size_t cap = list->cap == 0 ? 256 : 2 * list->cap;
+  char *data = realloc(list->data, cap);
+  if (data == NULL) {
+    return 1;
+  }
+  list->data = data;
+  list->cap = cap;
+  for (size_t i = 0; i < list->count; i++) {
+    list->values[i] = data + list->offsets[i];
+  }
+  return 0;
+}
+
+int value_list_put(ValueList *list, char ch) {
+  if (list->count == MAX_WRITE_SIZE || list->len - list->start >= max_value_size) {
+    return 1;
+  }
+  if (list->len + 2 > list->cap && grow(list) != 0) {
+    return 1;
+  }
+  list->data[list->len++] = ch;
+  return 0;
+}
+
+int value_list_end(ValueList *list) {
+  if (list->count == MAX_WRITE_SIZE || (list->len + 1 > list->cap && grow(list) != 0)) {
+    return 1;
+  }
+  list->data[list->len++] = '\0';
+  list->offsets[list->count] = list->start;
+  list->lens[list->count] = list->len - list->start - 1;
+  list->values[list->count] = list->data + list->start;
+  list->count++;
+  list->start = list->len;
+  return 0;
+}
+
+void value_list_free(ValueList *list) {
+  free(list->data);
+  value_list_init(list);
+}
+
+// Gets the size class of a buffer.
+// @return Its index, NUM_CLASSES if the buffer is too big for any.
+static int size_class(size_t size) {
+  int index = 0;
+  while (index < NUM_CLASSES && ((size_t)1 << (index + VALUE_MIN_CLASS)) < size) {
+    index++;
+  }
+  return index;
+}
+
+size_t value_alloc_size(size_t size) {
+  int index = size_class(size);
+  return index == NUM_CLASSES ? size : (size_t)1 << (index + VALUE_MIN_CLASS);
+}
+
+char *value_alloc(size_t size) {
+  int index = size_class(size);
+  if (index == NUM_CLASSES) {
+    return malloc(size);
+  }
+
+  size_t node = numa_local_node();
+  pthread_mutex_lock(&classes_lock);
+  FreeBuffer *buffer = free_buffers[node][index];
+  if (buffer != NULL) {
+    free_buffers[node][index] = buffer->next;
+    num_free_buffers[node][index]--;
+  }
+  pthread_mutex_unlock(&classes_lock);
+
+  if (buffer == NULL) {
+    return malloc((size_t)1 << (index + VALUE_MIN_CLASS));
+  }
+  return (char *)buffer;
+}
+
+void value_free(char *data, size_t size) {
+  int index = size_class(size);
+  if (index < NUM_CLASSES) {
+    size_t node = numa_local_node();
+    pthread_mutex_lock(&classes_lock);
+    if (num_free_buffers[node][index] < VALUE_CLASS_CACHE) {
+      FreeBuffer *buffer = (FreeBuffer *)(void *)data;
+      buffer->next = free_buffers[node][index];
+      free_buffers[node][index] = buffer;
+      num_free_buffers[node][index]++;
+      data = NULL;
+    }
+    pthread_mutex_unlock(&classes_lock);
+  }
+  free(data);
+}
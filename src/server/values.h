@@ -0,0 +1,92 @@
+#ifndef KVS_VALUES_H
+#define KVS_VALUES_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+// Values up to this size (terminator included) are stored in the same
+// allocation as their version; longer ones get a buffer of their own.
+#define VALUE_INLINE_SIZE 64
+// Buffers of out of line values are rounded up to a power of two between
+// 2^VALUE_MIN_CLASS and 2^VALUE_MAX_CLASS bytes, and freed buffers of every
+// size class are kept for reuse. Longer values are allocated as they are.
+#define VALUE_MIN_CLASS 7
+#define VALUE_MAX_CLASS 16
+#define VALUE_CLASS_CACHE 64  // Freed buffers kept per size class and NUMA node
+// Values at least this long are compressed by default (see
+// set_compress_threshold), and kept compressed if that saves an eighth.
+#define VALUE_COMPRESS_MIN 256
+
+// Values of the pairs of a command, of any length up to the value size limit.
+// They are stored back to back, NUL terminated, in one buffer that grows as
+// needed and is kept from one command to the next.
+typedef struct ValueList {
+  char *data;
+  size_t len;
+  size_t cap;
+  size_t count;  // Values complete
+  size_t start;  // Where the value being read begins
+  size_t offsets[MAX_WRITE_SIZE];
+  size_t lens[MAX_WRITE_SIZE];
+  const char *values[MAX_WRITE_SIZE];  // Valid until the next value_list_put
+} ValueList;
+
+/// Sets the longest value accepted (MAX_VALUE_SIZE by default).
+/// @param size The limit in bytes.
+void set_max_value_size(size_t size);
+
+/// Gets the longest value accepted.
+/// @return The limit in bytes.
+size_t get_max_value_size(void);
+
+/// Sets the shortest value that is compressed (VALUE_COMPRESS_MIN by default).
+/// @param size The threshold in bytes, 0 to store every value as it is.
+void set_compress_threshold(size_t size);
+
+/// Compresses a value (see lz.h) if it is long enough and compresses well.
+/// @param value The value.
+/// @param len Length of the value.
+/// @param dst Room for len bytes.
+/// @return Length of the compressed value, 0 if it is better stored as is.
+size_t value_compress(const char *value, size_t len, char *dst);
+
+/// Prepares an empty list.
+/// @param list The list.
+void value_list_init(ValueList *list);
+
+/// Empties a list, keeping its buffer.
+/// @param list The list.
+void value_list_clear(ValueList *list);
+
+/// Adds a character to the value being read. The first one starts it.
+/// @param list The list.
+/// @param ch The character.
+/// @return 0 if successful, 1 if the value is too long or memory ran out.
+int value_list_put(ValueList *list, char ch);
+
+/// Completes the value being read, which may be empty.
+/// @param list The list.
+/// @return 0 if successful, 1 if memory ran out or the list is full.
+int value_list_end(ValueList *list);
+
+/// Frees the buffer of a list.
+/// @param list The list.
+void value_list_free(ValueList *list);
+
+/// Allocates the buffer of an out of line value.
+/// @param size Bytes needed.
+/// @return The buffer, NULL on failure.
+char *value_alloc(size_t size);
+
+/// Frees a buffer from value_alloc.
+/// @param data The buffer.
+/// @param size Bytes it was allocated for.
+void value_free(char *data, size_t size);
+
+/// Gets the bytes value_alloc actually takes for a size.
+/// @param size Bytes needed.
+/// @return Bytes allocated.
+size_t value_alloc_size(size_t size);
+
+#endif  // KVS_VALUES_H
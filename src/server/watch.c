@@ -0,0 +1,326 @@
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+#define WATCH_EVENT_BUFFER_SIZE 4096
+
+typedef enum { JOB_PENDING, JOB_RUNNING } JobState;
+
+// A job known to the watcher, either waiting for a worker or being run.
+typedef struct WatchedJob {
+  char name[MAX_JOB_FILE_NAME_SIZE];
+  JobState state;
+  int rerun;  // 1 if the file was rewritten while it was running
+  struct WatchedJob *next;
+} WatchedJob;
+
+static const char *watch_dir = NULL;
+static int inotify_fd = -1;
+static int stop_pipe[2] = {-1, -1};
+static int stopped = 0;
+static pthread_t watcher_thread;
+
+static WatchedJob *jobs_head = NULL;
+static WatchedJob *jobs_tail = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static int is_job_file(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot != NULL && dot != name && strcmp(dot, ".job") == 0;
+}
+
+// Builds <dir>/<job name without .job>.done
+// @return 0 on success, 1 if the path does not fit.
+static int marker_path(const char *name, char *path) {
+  size_t base_len = (size_t)(strrchr(name, '.') - name);
+  if (strlen(watch_dir) + base_len + strlen("/.done") + 1 > MAX_JOB_FILE_NAME_SIZE) {
+    return 1;
+  }
+  snprintf(path, MAX_JOB_FILE_NAME_SIZE, "%s/%.*s.done", watch_dir, (int)base_len, name);
+  return 0;
+}
+
+static int has_marker(const char *name) {
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  struct stat st;
+  return marker_path(name, path) == 0 && stat(path, &st) == 0;
+}
+
+// Queues a job unless it is already waiting; a job that is running is
+// flagged so it runs again once the current run finishes.
+// Must be called with jobs_lock held.
+static void enqueue_job(const char *name) {
+  if (strlen(name) >= MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "Job file name too long: %s\n", name);
+    return;
+  }
+
+  for (WatchedJob *job = jobs_head; job != NULL; job = job->next) {
+    if (strcmp(job->name, name) == 0) {
+      if (job->state == JOB_RUNNING) {
+        job->rerun = 1;
+      }
+      return;
+    }
+  }
+
+  WatchedJob *job = malloc(sizeof(WatchedJob));
+  if (job == NULL) {
+    fprintf(stderr, "Failed to allocate memory for job %s\n", name);
+    return;
+  }
+  strcpy(job->name, name);
+  job->state = JOB_PENDING;
+  job->rerun = 0;
+  job->next = NULL;
+
+  if (jobs_tail == NULL) {
+    jobs_head = job;
+  } else {
+    jobs_tail->next = job;
+  }
+  jobs_tail = job;
+  pthread_cond_signal(&jobs_cond);
+}
+
+static void remove_job(WatchedJob *target) {
+  WatchedJob *prev = NULL;
+  for (WatchedJob *job = jobs_head; job != NULL; prev = job, job = job->next) {
+    if (job == target) {
+      if (prev == NULL) {
+        jobs_head = job->next;
+      } else {
+        prev->next = job->next;
+      }
+      if (jobs_tail == job) {
+        jobs_tail = prev;
+      }
+      free(job);
+      return;
+    }
+  }
+}
+
+// Queues the job files that were left in the directory before the watcher
+// started and have not been completed yet.
+static int scan_directory() {
+  DIR *dir = opendir(watch_dir);
+  if (dir == NULL) {
+    fprintf(stderr, "Failed to open directory: %s\n", watch_dir);
+    return 1;
+  }
+
+  struct dirent *entry;
+  pthread_mutex_lock(&jobs_lock);
+  while ((entry = readdir(dir)) != NULL) {
+    if (is_job_file(entry->d_name) && !has_marker(entry->d_name)) {
+      enqueue_job(entry->d_name);
+    }
+  }
+  pthread_mutex_unlock(&jobs_lock);
+
+  closedir(dir);
+  return 0;
+}
+
+static void *watch_loop(void *arg) {
+  (void)arg;
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  // Aligned as required by struct inotify_event
+  char events[WATCH_EVENT_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to poll the jobs directory\n");
+      break;
+    }
+
+    if (fds[1].revents != 0) {
+      break;
+    }
+
+    ssize_t len = read(inotify_fd, events, sizeof(events));
+    if (len <= 0) {
+      if (len == -1 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+      fprintf(stderr, "Failed to read inotify events\n");
+      break;
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    for (char *ptr = events; ptr < events + len;) {
+      struct inotify_event *event = (struct inotify_event *)(void *)ptr;
+      if (event->len > 0 && !(event->mask & IN_ISDIR) && is_job_file(event->name)) {
+        enqueue_job(event->name);
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+    pthread_mutex_unlock(&jobs_lock);
+  }
+
+  return NULL;
+}
+
+static void close_watch_fds() {
+  close(inotify_fd);
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  inotify_fd = -1;
+}
+
+int watch_start(const char *dir_name) {
+  watch_dir = dir_name;
+
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    fprintf(stderr, "Failed to initialize inotify\n");
+    return 1;
+  }
+
+  // The watch is added before scanning so no file can slip in between
+  if (inotify_add_watch(inotify_fd, dir_name, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    fprintf(stderr, "Failed to watch directory: %s\n", dir_name);
+    close(inotify_fd);
+    return 1;
+  }
+
+  if (pipe(stop_pipe) == -1) {
+    fprintf(stderr, "Failed to create watcher pipe\n");
+    close(inotify_fd);
+    return 1;
+  }
+
+  if (scan_directory() != 0) {
+    close_watch_fds();
+    return 1;
+  }
+
+  if (pthread_create(&watcher_thread, NULL, watch_loop, NULL) != 0) {
+    fprintf(stderr, "Failed to create watcher thread\n");
+    close_watch_fds();
+    return 1;
+  }
+
+  return 0;
+}
+
+int watch_next(char *name, size_t size) {
+  pthread_mutex_lock(&jobs_lock);
+  while (1) {
+    if (stopped) {
+      pthread_mutex_unlock(&jobs_lock);
+      return 0;
+    }
+
+    for (WatchedJob *job = jobs_head; job != NULL; job = job->next) {
+      if (job->state == JOB_PENDING) {
+        job->state = JOB_RUNNING;
+        snprintf(name, size, "%s", job->name);
+        pthread_mutex_unlock(&jobs_lock);
+
+        // The marker only describes the last finished run
+        char path[MAX_JOB_FILE_NAME_SIZE];
+        if (marker_path(name, path) == 0 && unlink(path) == -1 && errno != ENOENT) {
+          fprintf(stderr, "Failed to remove completion marker: %s\n", path);
+        }
+        return 1;
+      }
+    }
+
+    pthread_cond_wait(&jobs_cond, &jobs_lock);
+  }
+}
+
+// Lets go of a claimed job, queueing it again if its file was rewritten
+// while it ran.
+// @return 1 if it was queued again, 0 otherwise.
+static int release_job(const char *name) {
+  int rerun = 0;
+
+  pthread_mutex_lock(&jobs_lock);
+  for (WatchedJob *job = jobs_head; job != NULL; job = job->next) {
+    if (strcmp(job->name, name) == 0 && job->state == JOB_RUNNING) {
+      rerun = job->rerun;
+      if (rerun) {
+        job->state = JOB_PENDING;
+        job->rerun = 0;
+        pthread_cond_signal(&jobs_cond);
+      } else {
+        remove_job(job);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&jobs_lock);
+  return rerun;
+}
+
+void watch_job_done(const char *name) {
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  if (release_job(name) || marker_path(name, path) != 0) {
+    return;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create completion marker: %s\n", path);
+    return;
+  }
+  close(fd);
+}
+
+void watch_job_failed(const char *name) {
+  release_job(name);
+}
+
+void watch_stop() {
+  pthread_mutex_lock(&jobs_lock);
+  int was_running = inotify_fd != -1 && !stopped;
+  stopped = 1;
+  pthread_cond_broadcast(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+
+  if (!was_running) {
+    return;
+  }
+
+  if (write(stop_pipe[1], "x", 1) == -1) {
+    fprintf(stderr, "Failed to stop the watcher thread\n");
+  }
+  pthread_join(watcher_thread, NULL);
+  close_watch_fds();
+
+  // Workers still finishing a job find it gone
+  pthread_mutex_lock(&jobs_lock);
+  while (jobs_head != NULL) {
+    WatchedJob *job = jobs_head;
+    jobs_head = job->next;
+    free(job);
+  }
+  jobs_tail = NULL;
+  pthread_mutex_unlock(&jobs_lock);
+}
@@ -0,0 +1,33 @@
+#ifndef KVS_WATCH_H
+#define KVS_WATCH_H
+
+#include <stddef.h>
+
+/// Starts watching a jobs directory. Job files that are already in the
+/// directory and have no completion marker are queued first, then every
+/// .job file that is closed after writing (or moved into the directory) is
+/// queued as it appears.
+/// @param dir_name Directory to watch.
+/// @return 0 if the watcher was started successfully, 1 otherwise.
+int watch_start(const char *dir_name);
+
+/// Waits for the next job file to process and claims it.
+/// @param name Buffer to store the job file name (without the directory).
+/// @param size Size of the buffer.
+/// @return 1 if a job was claimed, 0 if the watcher was stopped.
+int watch_next(char *name, size_t size);
+
+/// Marks a claimed job as finished and writes its completion marker
+/// (<job>.done, next to the .job file).
+/// @param name Name of the job file returned by watch_next.
+void watch_job_done(const char *name);
+
+/// Lets go of a claimed job that could not be run, without writing its
+/// completion marker, so it runs when its file is written again.
+/// @param name Name of the job file returned by watch_next.
+void watch_job_failed(const char *name);
+
+/// Stops the watcher and wakes every thread blocked in watch_next.
+void watch_stop();
+
+#endif  // KVS_WATCH_H